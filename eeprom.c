@@ -1,25 +1,78 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "eeprom.h"
+#ifdef ENC28J60_MODEL
+// The host model build keeps the 2K of EEPROM in SRAM
+#define EEPROM_WORDS 512
+uint32_t eepromWords[EEPROM_WORDS];
+#else
 #include "tm4c123gh6pm.h"
+#endif
 void initEeprom()
 {
+#ifndef ENC28J60_MODEL
     SYSCTL_RCGCEEPROM_R = 1;
     _delay_cycles(3);
     while (EEPROM_EEDONE_R & EEPROM_EEDONE_WORKING);
+#endif
 }
 
 void writeEeprom(uint16_t add, uint32_t data)//assuming 16 bit addr, 12 bits for block addr, 4 for offset
 {
+#ifdef ENC28J60_MODEL
+    eepromWords[add % EEPROM_WORDS] = data;
+#else
     EEPROM_EEBLOCK_R = add >> 4;
     EEPROM_EEOFFSET_R = add & 0xF;
     EEPROM_EERDWR_R = data;
     while (EEPROM_EEDONE_R & EEPROM_EEDONE_WORKING);
+#endif
 }
 
 uint32_t readEeprom(uint16_t add)
 {
+#ifdef ENC28J60_MODEL
+    return eepromWords[add % EEPROM_WORDS];
+#else
     EEPROM_EEBLOCK_R = add >> 4;
     EEPROM_EEOFFSET_R = add & 0xF;
     return EEPROM_EERDWR_R;
+#endif
+}
+
+// CRC-32 (IEEE 802.3) of words, taken low byte first
+uint32_t crcEeprom(const uint32_t data[], uint8_t count)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint8_t i, bit;
+    for (i = 0; i < count * 4; i++)
+    {
+        crc ^= (data[i / 4] >> (8 * (i % 4))) & 0xFF;
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// Writes count words followed by their crc, skipping words that already
+// hold the value so an unchanged record costs no erase cycles
+void writeEepromRecord(uint16_t add, const uint32_t data[], uint8_t count)
+{
+    uint32_t crc = crcEeprom(data, count);
+    uint8_t i;
+    for (i = 0; i < count; i++)
+        if (readEeprom(add + i) != data[i])
+            writeEeprom(add + i, data[i]);
+    if (readEeprom(add + count) != crc)
+        writeEeprom(add + count, crc);
+}
+
+// Reads a record written by writeEepromRecord()
+// Returns false if the crc does not match, as for a record never written
+bool readEepromRecord(uint16_t add, uint32_t data[], uint8_t count)
+{
+    uint8_t i;
+    for (i = 0; i < count; i++)
+        data[i] = readEeprom(add + i);
+    return readEeprom(add + count) == crcEeprom(data, count);
 }
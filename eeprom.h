@@ -3,4 +3,7 @@
 void initEeprom();
 void writeEeprom(uint16_t add, uint32_t data);
 uint32_t readEeprom(uint16_t add);
+uint32_t crcEeprom(const uint32_t data[], uint8_t count);
+void writeEepromRecord(uint16_t add, const uint32_t data[], uint8_t count);
+bool readEepromRecord(uint16_t add, uint32_t data[], uint8_t count);
 #endif
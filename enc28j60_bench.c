@@ -0,0 +1,1263 @@
+// ENC28J60 Model Benchmark
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Host (Linux) build of the eth0 library
+// Target uC:       -
+// System Clock:    -
+
+// Model configuration:
+// Feeds frames through the ENC28J60 model into the same receive, dispatch
+//   and timer code that main() runs on the target, and prints the SPI bytes,
+//   SPI transactions, bank selects and simulated microseconds each operation
+//   costs
+// Build and run with "make bench"; the numbers depend only on the code, so
+//   runs are repeatable and can be compared before and after a change
+// Time spent in waitMicrosecond() is shown apart from SPI and wire time
+// "enc28j60_bench flood" instead pings the main loop every ms for 2 s of
+//   simulated time and prints the echo replies per second
+// "enc28j60_bench dispatch" times, in host ns per frame, finding the handler
+//   of each kind of frame by the tests processPacket() used to run in turn
+//   against etherClassifyPacket(); these vary from run to run
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifdef ENC28J60_MODEL
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "eth0.h"
+#include "timer.h"
+#include "eeprom.h"
+#include "enc28j60_model.h"
+
+#define BENCH_FRAME_SIZE 1518
+#define BENCH_FLOOD_MS    2000
+#define BENCH_LOOP_US     10        // simulated time per main loop pass
+#define BENCH_DISPATCH_RUNS 200000
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+const uint8_t benchLocalMac[6] = {2, 3, 4, 5, 6, 123};
+const uint8_t benchLocalIp[4] = {192, 168, 2, 123};
+const uint8_t benchPeerMac[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+const uint8_t benchPeerIp[4] = {192, 168, 2, 10};
+const uint8_t benchBroadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+const uint8_t benchBroadcastIp[4] = {255, 255, 255, 255};
+
+uint8_t benchFrame[BENCH_FRAME_SIZE];
+uint8_t benchReply[BENCH_FRAME_SIZE];
+uint16_t benchReplySize = 0;
+uint32_t benchDhcpXid = 0;
+uint32_t benchEchoReplies = 0;
+uint8_t benchFailures = 0;
+volatile uint8_t benchDispatchTag;
+
+// Timer wheel events, with the ms each last called back and how often
+timerEvent benchTimers[2];
+uint32_t benchTimerFired[2];
+uint8_t benchTimerCount[2];
+
+// The peer port of benchTcp(), and what telnet has sent to it: the last
+// segment, their number and the sequence number past the last one
+uint16_t benchTcpPort = 40000;
+uint8_t benchTcpReply[BENCH_FRAME_SIZE];
+uint16_t benchTcpReplySize = 0;
+uint16_t benchTcpSent = 0;
+uint32_t benchTcpNext = 0;
+
+extern uint32_t hostWaitUs;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void processPacket(etherPacket* packet);
+
+void benchCopy(uint8_t dest[], const uint8_t src[], uint16_t size)
+{
+    uint16_t i;
+    for (i = 0; i < size; i++)
+        dest[i] = src[i];
+}
+
+void benchPut16(uint8_t data[], uint16_t value)
+{
+    data[0] = value >> 8;
+    data[1] = value & 0xFF;
+}
+
+void benchPut32(uint8_t data[], uint32_t value)
+{
+    benchPut16(data, value >> 16);
+    benchPut16(data + 2, value & 0xFFFF);
+}
+
+uint32_t benchGet32(const uint8_t data[])
+{
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | data[2] << 8 | data[3];
+}
+
+// Ones' complement sum of big-endian words, folded and inverted
+uint16_t benchChecksum(uint32_t sum, const uint8_t data[], uint16_t size)
+{
+    uint16_t i;
+    for (i = 0; i + 1 < size; i += 2)
+        sum += data[i] << 8 | data[i + 1];
+    if (size & 1)
+        sum += data[size - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+// Writes ethernet and ip headers for an l4 payload of size bytes
+// Returns the offset of the payload
+uint16_t benchIpHeaders(const uint8_t destMac[], const uint8_t sourceIp[], const uint8_t destIp[],
+                        uint8_t protocol, uint16_t size)
+{
+    uint8_t* ip = benchFrame + 14;
+    uint16_t i;
+    for (i = 0; i < 34; i++)
+        benchFrame[i] = 0;
+    benchCopy(benchFrame, destMac, 6);
+    benchCopy(benchFrame + 6, benchPeerMac, 6);
+    benchPut16(benchFrame + 12, 0x0800);
+    ip[0] = 0x45;
+    benchPut16(ip + 2, 20 + size);
+    ip[8] = 64;
+    ip[9] = protocol;
+    benchCopy(ip + 12, sourceIp, 4);
+    benchCopy(ip + 16, destIp, 4);
+    benchPut16(ip + 10, benchChecksum(0, ip, 20));
+    return 34;
+}
+
+// Sets the udp or tcp checksum over the pseudo-header and segment
+void benchL4Checksum(uint16_t checkOffset, uint16_t size)
+{
+    uint8_t* ip = benchFrame + 14;
+    uint32_t sum = 0;
+    uint8_t i;
+    for (i = 12; i < 20; i += 2)
+        sum += ip[i] << 8 | ip[i + 1];
+    sum += ip[9] + size;
+    benchPut16(benchFrame + 34 + checkOffset, 0);
+    benchPut16(benchFrame + 34 + checkOffset, benchChecksum(sum, benchFrame + 34, size));
+}
+
+uint16_t benchArpRequest()
+{
+    uint8_t* arp = benchFrame + 14;
+    uint8_t i;
+    for (i = 0; i < 42; i++)
+        benchFrame[i] = 0;
+    benchCopy(benchFrame, benchBroadcastMac, 6);
+    benchCopy(benchFrame + 6, benchPeerMac, 6);
+    benchPut16(benchFrame + 12, 0x0806);
+    benchPut16(arp, 1);
+    benchPut16(arp + 2, 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    benchPut16(arp + 6, 1);
+    benchCopy(arp + 8, benchPeerMac, 6);
+    benchCopy(arp + 14, benchPeerIp, 4);
+    benchCopy(arp + 24, benchLocalIp, 4);
+    return 42;
+}
+
+// An arp reply to this ip, static or leased, from the host at mac and ip
+uint16_t benchArpReply(const uint8_t mac[], const uint8_t ip[])
+{
+    uint8_t* arp = benchFrame + 14;
+    uint8_t localIp[4];
+    uint8_t i;
+    for (i = 0; i < 42; i++)
+        benchFrame[i] = 0;
+    benchCopy(benchFrame, benchLocalMac, 6);
+    benchCopy(benchFrame + 6, mac, 6);
+    benchPut16(benchFrame + 12, 0x0806);
+    benchPut16(arp, 1);
+    benchPut16(arp + 2, 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    benchPut16(arp + 6, 2);
+    benchCopy(arp + 8, mac, 6);
+    benchCopy(arp + 14, ip, 4);
+    benchCopy(arp + 18, benchLocalMac, 6);
+    etherGetIpAddress(localIp);
+    benchCopy(arp + 24, localIp, 4);
+    return 42;
+}
+
+uint16_t benchPing(uint16_t sequence, uint16_t dataSize)
+{
+    uint16_t offset = benchIpHeaders(benchLocalMac, benchPeerIp, benchLocalIp, 1, 8 + dataSize);
+    uint8_t* icmp = benchFrame + offset;
+    uint16_t i;
+    icmp[0] = 8;
+    icmp[1] = 0;
+    benchPut16(icmp + 2, 0);
+    benchPut16(icmp + 4, 1);
+    benchPut16(icmp + 6, sequence);
+    for (i = 0; i < dataSize; i++)
+        icmp[8 + i] = i;
+    benchPut16(icmp + 2, benchChecksum(0, icmp, 8 + dataSize));
+    return offset + 8 + dataSize;
+}
+
+// A segment from benchTcpPort to telnet
+// The data is the letters of the stream at its sequence number, so held and
+// reassembled data can be checked in the echo
+uint16_t benchTcp(uint8_t flags, uint32_t seq, uint32_t ack, uint16_t dataSize)
+{
+    uint16_t offset = benchIpHeaders(benchLocalMac, benchPeerIp, benchLocalIp, 6, 20 + dataSize);
+    uint8_t* tcp = benchFrame + offset;
+    uint16_t i;
+    benchPut16(tcp, benchTcpPort);
+    benchPut16(tcp + 2, 23);
+    benchPut32(tcp + 4, seq);
+    benchPut32(tcp + 8, ack);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    benchPut16(tcp + 14, 8192);
+    benchPut16(tcp + 18, 0);
+    for (i = 0; i < dataSize; i++)
+        tcp[20 + i] = 'a' + (seq + i) % 26;
+    benchL4Checksum(16, 20 + dataSize);
+    return offset + 20 + dataSize;
+}
+
+// A dhcp offer, ack or nak of a 1-hour lease on 192.168.2.77 for
+// transaction xid, from server 192.168.2.1, with the rapid commit option
+// (80) if rapidCommit
+uint16_t benchDhcpMessage(uint8_t type, uint32_t xid, bool rapidCommit)
+{
+    uint8_t options[] = {99, 130, 83, 99, 53, 1, 2, 54, 4, 192, 168, 2, 1,
+                         51, 4, 0, 0, 0x0E, 0x10, 1, 4, 255, 255, 255, 0,
+                         3, 4, 192, 168, 2, 1, 80, 0, 255};
+    uint8_t count = rapidCommit ? sizeof(options) : sizeof(options) - 2;
+    uint16_t size = 8 + 236 + count;
+    uint16_t offset = benchIpHeaders(benchBroadcastMac, benchPeerIp, benchBroadcastIp, 17, size);
+    uint8_t* udp = benchFrame + offset;
+    uint8_t* dhcp = udp + 8;
+    uint16_t i;
+    for (i = 0; i < size; i++)
+        udp[i] = 0;
+    benchPut16(udp, 67);
+    benchPut16(udp + 2, 68);
+    benchPut16(udp + 4, size);
+    dhcp[0] = 2;
+    dhcp[1] = 1;
+    dhcp[2] = 6;
+    benchCopy(dhcp + 4, (const uint8_t*)&xid, 4);
+    dhcp[16] = 192;
+    dhcp[17] = 168;
+    dhcp[18] = 2;
+    dhcp[19] = 77;
+    benchCopy(dhcp + 28, benchLocalMac, 6);
+    options[6] = type;
+    options[count - 1] = 255;
+    benchCopy(dhcp + 236, options, count);
+    benchL4Checksum(6, size);
+    return offset + size;
+}
+
+// Returns true if benchReply is an arp request for ip sent to mac
+bool benchIsArpRequest(const uint8_t ip[], const uint8_t mac[])
+{
+    return benchReply[12] == 0x08 && benchReply[13] == 0x06 && benchReply[21] == 1
+           && memcmp(benchReply, mac, 6) == 0 && memcmp(benchReply + 38, ip, 4) == 0;
+}
+
+// Returns true if benchReply is a udp datagram for ip sent to mac
+bool benchIsUdp(const uint8_t ip[], const uint8_t mac[])
+{
+    return benchReply[12] == 0x08 && benchReply[13] == 0x00 && benchReply[23] == 17
+           && memcmp(benchReply, mac, 6) == 0 && memcmp(benchReply + 30, ip, 4) == 0;
+}
+
+// Finds an option in the dhcp client message in benchReply
+// Returns a pointer to its value, or 0 if it is absent
+const uint8_t* benchDhcpOption(uint8_t code)
+{
+    uint16_t i = 282;
+    while (i + 1 < benchReplySize && benchReply[i] != 255)
+    {
+        if (benchReply[i] == 0)
+            i++;
+        else if (benchReply[i] == code)
+            return benchReply + i + 2;
+        else
+            i += 2 + benchReply[i + 1];
+    }
+    return 0;
+}
+
+// Returns true if benchReply is a dhcp client message of type sent to ip
+bool benchIsDhcp(uint8_t type, const uint8_t ip[])
+{
+    const uint8_t* option = benchDhcpOption(53);
+    return benchReply[23] == 17 && benchReply[35] == 68 && memcmp(benchReply + 30, ip, 4) == 0
+           && option != 0 && option[0] == type;
+}
+
+// Returns true if the ip configuration is addr, mask and gateway
+bool benchIsConfigured(const uint8_t addr[], const uint8_t mask[], const uint8_t gateway[])
+{
+    uint8_t ip[4], m[4], gw[4];
+    etherGetIpAddress(ip);
+    etherGetIpSubnetMask(m);
+    etherGetIpGatewayAddress(gw);
+    return memcmp(ip, addr, 4) == 0 && memcmp(m, mask, 4) == 0 && memcmp(gw, gateway, 4) == 0;
+}
+
+// Returns the data size of the segment in benchTcpReply
+uint16_t benchTcpData()
+{
+    return (benchTcpReply[16] << 8 | benchTcpReply[17]) - 20 - (benchTcpReply[46] >> 4) * 4;
+}
+
+// Returns true if the segment in benchTcpReply echoes size bytes of the
+// stream benchTcp() sends, starting at seq
+bool benchTcpEchoes(uint32_t seq, uint16_t size)
+{
+    uint16_t i;
+    if (benchTcpData() != size)
+        return false;
+    for (i = 0; i < size; i++)
+        if (benchTcpReply[54 + i] != 'a' + (seq + i) % 26)
+            return false;
+    return true;
+}
+
+// Keeps a segment sent to benchTcpPort and moves benchTcpNext past it
+void benchCollectTcp(uint16_t size)
+{
+    uint32_t end;
+    benchCopy(benchTcpReply, benchReply, size);
+    benchTcpReplySize = size;
+    benchTcpSent++;
+    end = benchGet32(benchTcpReply + 38) + benchTcpData();
+    if ((benchTcpReply[47] & 0x03) != 0)
+        end++;
+    if ((int32_t)(end - benchTcpNext) > 0)
+        benchTcpNext = end;
+}
+
+// Collects the frames sent since the last call
+// Returns their number; the last one is kept in benchReply, the xid of the
+// last dhcp client message in benchDhcpXid, and echo replies are counted
+uint16_t benchCollect()
+{
+    uint16_t sent = 0, size;
+    while ((size = enc28j60ModelGetTxPacket(benchReply, sizeof(benchReply))) > 0)
+    {
+        benchReplySize = size;
+        if (benchReply[23] == 17 && benchReply[34] == 0 && benchReply[35] == 68)
+            benchCopy((uint8_t*)&benchDhcpXid, benchReply + 46, 4);
+        if (benchReply[23] == 1 && benchReply[34] == 0)
+            benchEchoReplies++;
+        if (benchReply[23] == 6 && benchReply[34] == 0 && benchReply[35] == 23
+            && (benchReply[36] << 8 | benchReply[37]) == benchTcpPort)
+            benchCollectTcp(size);
+        sent++;
+    }
+    return sent;
+}
+
+// Runs the main loop's receive, dispatch and timer steps until idle
+// Returns the number of frames sent (see benchCollect())
+uint16_t benchPoll()
+{
+    etherPacket* packet;
+    do
+    {
+        while (enc28j60ModelIsIntActive())
+            etherIsr();
+        while ((packet = etherGetRxPacket()) != 0)
+        {
+            processPacket(packet);
+            etherReleaseRxPacket();
+        }
+    }
+    while (etherIsRxDmaBusy() || enc28j60ModelIsIntActive());
+    serviceTimers();
+    return benchCollect();
+}
+
+// Lets time pass, running the main loop every ms
+void benchIdle(uint32_t ms)
+{
+    while (ms-- > 0)
+    {
+        enc28j60ModelAdvanceTime(1000);
+        benchPoll();
+    }
+}
+
+// Prints the cost of what was started since the stats were reset
+void benchPrint(const char* name, uint16_t size, uint16_t sent, uint32_t waitStart)
+{
+    enc28j60ModelStats stats;
+    uint32_t waitUs;
+    enc28j60ModelGetStats(&stats);
+    waitUs = hostWaitUs - waitStart;
+    printf("%-16s %5u %4u %8u %6u %5u %10u %8u", name, size, sent, stats.spiBytes,
+           stats.spiTransactions, stats.bankSelects, stats.timeUs - waitUs, waitUs);
+}
+
+// Runs the main loop and prints the cost of what was started since the
+// stats were reset
+// Returns the number of frames sent, for benchCheck()
+uint16_t benchReport(const char* name, uint16_t size, uint32_t waitStart)
+{
+    uint16_t sent;
+    sent = benchPoll();
+    benchPrint(name, size, sent, waitStart);
+    return sent;
+}
+
+// Delivers a frame and prints the cost of handling it and any replies
+// The link is left idle first so a reply never waits on an earlier transmit
+uint16_t benchMeasure(const char* name, uint16_t size)
+{
+    benchIdle(5);
+    enc28j60ModelReceive(benchFrame, size);
+    enc28j60ModelResetStats();
+    return benchReport(name, size, hostWaitUs);
+}
+
+// Ends the row with whether the reply was the one expected
+void benchCheck(bool ok)
+{
+    printf("  %s\n", ok ? "ok" : "FAIL");
+    if (!ok)
+        benchFailures++;
+}
+
+// Sends a 5-byte udp datagram to ip and prints the cost of sending it and
+// whatever it sets off
+// Returns the number of frames sent
+uint16_t benchMeasureUdp(const char* name, const uint8_t ip[])
+{
+    uint32_t waitStart;
+    benchIdle(5);
+    enc28j60ModelResetStats();
+    waitStart = hostWaitUs;
+    etherSendUdp(ip, 1024, 1024, "bench", 5);
+    return benchReport(name, 5, waitStart);
+}
+
+// Lets time pass, running the main loop every ms, until a frame is sent or
+// maxMs has passed, and prints the row; the us column is the time waited
+// Returns the ms waited
+uint32_t benchMeasureWait(const char* name, uint32_t maxMs)
+{
+    uint32_t waitStart = hostWaitUs, ms = 0;
+    uint16_t sent = 0;
+    enc28j60ModelResetStats();
+    while (ms < maxMs && sent == 0)
+    {
+        enc28j60ModelAdvanceTime(1000);
+        sent = benchPoll();
+        ms++;
+    }
+    benchPrint(name, 0, sent, waitStart);
+    return ms;
+}
+
+// Lets time pass, running the main loop every ms, until the dhcp client
+// reaches state or maxMs has passed, and prints the row; the us column is
+// the time waited
+// Returns the ms waited
+uint32_t benchMeasureDhcp(const char* name, dhcpState state, uint32_t maxMs)
+{
+    uint32_t waitStart = hostWaitUs, ms = 0;
+    uint16_t sent = 0;
+    enc28j60ModelResetStats();
+    while (ms < maxMs && dhcpGetState() != state)
+    {
+        enc28j60ModelAdvanceTime(1000);
+        sent += benchPoll();
+        ms++;
+    }
+    benchPrint(name, 0, sent, waitStart);
+    return ms;
+}
+
+// Returns true if ms is within a second of expected ms, as the lease is
+// timed in whole seconds
+bool benchDhcpOnTime(uint32_t ms, uint32_t expected)
+{
+    return ms + 1000 >= expected && ms <= expected + 1000;
+}
+
+// Delivers a frame without printing a row
+// Returns the number of frames sent (see benchCollect())
+uint16_t benchSend(uint16_t size)
+{
+    enc28j60ModelReceive(benchFrame, size);
+    return benchPoll();
+}
+
+// Opens a telnet connection from benchTcpPort with initial sequence number
+// seq - 1
+// Returns telnet's initial sequence number
+uint32_t benchTcpOpen(uint32_t seq)
+{
+    uint32_t iss;
+    benchSend(benchTcp(0x02, seq - 1, 0, 0));
+    iss = benchGet32(benchTcpReply + 38);
+    benchSend(benchTcp(0x10, seq, iss + 1, 0));
+    benchTcpNext = iss + 1;
+    return iss;
+}
+
+// Acknowledges everything telnet has sent from benchTcpPort, and whatever
+// that lets it send, until it sends nothing more
+void benchTcpAckAll(uint32_t seq)
+{
+    uint16_t sent;
+    do
+    {
+        sent = benchTcpSent;
+        benchSend(benchTcp(0x10, seq, benchTcpNext, 0));
+    }
+    while (benchTcpSent != sent);
+}
+
+// Lets time pass, running the main loop every ms, until telnet sends a
+// segment to benchTcpPort or maxMs has passed
+// Returns the ms waited
+uint32_t benchTcpWait(uint32_t maxMs)
+{
+    uint16_t sent = benchTcpSent;
+    uint32_t ms = 0;
+    while (ms < maxMs && benchTcpSent == sent)
+    {
+        enc28j60ModelAdvanceTime(1000);
+        benchPoll();
+        ms++;
+    }
+    return ms;
+}
+
+// Sends a 56-byte ping every intervalUs for BENCH_FLOOD_MS while running
+// main()'s loop exactly as the target does, one frame per pass, so anything
+// that blocks the loop shows up as ENC28J60 ring overflows and lost replies
+// Only replies sent within the flood are counted
+void benchFlood(uint32_t intervalUs)
+{
+    enc28j60ModelStats stats;
+    etherPacket* packet;
+    uint64_t start, next, now;
+    uint32_t requests = 0;
+    uint16_t size;
+
+    benchEchoReplies = 0;
+    enc28j60ModelResetStats();
+    start = next = enc28j60ModelGetTimeNs() / 1000;
+    now = start;
+    while (now - start < BENCH_FLOOD_MS * 1000ULL)
+    {
+        while (now >= next && next - start < BENCH_FLOOD_MS * 1000ULL)
+        {
+            size = benchPing(requests++, 56);
+            enc28j60ModelReceive(benchFrame, size);
+            next += intervalUs;
+        }
+        while (enc28j60ModelIsIntActive())
+            etherIsr();
+        packet = etherGetRxPacket();
+        if (packet != 0)
+        {
+            processPacket(packet);
+            etherReleaseRxPacket();
+        }
+        serviceTimers();
+        benchCollect();
+        enc28j60ModelAdvanceTime(BENCH_LOOP_US);
+        now = enc28j60ModelGetTimeNs() / 1000;
+    }
+    enc28j60ModelGetStats(&stats);
+    printf("ping flood every %u us for %u ms: %u requests, %u replies (%u/s), %u dropped, %u overflows\n",
+           intervalUs, BENCH_FLOOD_MS, requests, benchEchoReplies, benchEchoReplies * 1000 / BENCH_FLOOD_MS,
+           stats.rxDropped, etherGetRxOverflowCount());
+    // per frame received, counting the reply it got, if any
+    if (stats.rxFrames > 0)
+        printf("  per frame: %.1f spi transactions, %.1f bank selects\n",
+               (double)stats.spiTransactions / stats.rxFrames, (double)stats.bankSelects / stats.rxFrames);
+}
+
+// Segments ahead of rcvNxt are held and answered with a duplicate ack; the
+// one that fills the gap is acked cumulatively and the held data is echoed
+// after its own
+// Overlapping runs merge, while data past the window, or a new run once
+// TCP_RX_RANGES are held, is dropped
+void benchTcpReassembly()
+{
+    uint32_t seq = 20001, next;
+    uint16_t sent, i;
+
+    // both echoes go out, the held one last
+    benchTcpPort = 40001;
+    benchTcpOpen(seq);
+    sent = benchMeasure("tcp ooo ahead", benchTcp(0x18, seq + 10, benchTcpNext, 10));
+    benchCheck(sent == 1 && benchTcpData() == 0 && benchGet32(benchTcpReply + 42) == seq);
+    next = benchTcpNext;
+    sent = benchMeasure("tcp ooo fill", benchTcp(0x18, seq, benchTcpNext, 10));
+    benchCheck(sent == 2 && benchGet32(benchTcpReply + 42) == seq + 20 && benchTcpEchoes(seq + 10, 10)
+               && benchTcpNext == next + 20);
+    benchTcpAckAll(seq + 20);
+
+    seq += 20;
+    benchSend(benchTcp(0x18, seq + 10, benchTcpNext, 10));
+    sent = benchMeasure("tcp ooo overlap", benchTcp(0x18, seq + 5, benchTcpNext, 10));
+    benchCheck(sent == 1 && benchTcpData() == 0 && benchGet32(benchTcpReply + 42) == seq);
+    next = benchTcpNext;
+    sent = benchMeasure("tcp ooo merge", benchTcp(0x18, seq, benchTcpNext, 5));
+    benchCheck(sent == 2 && benchGet32(benchTcpReply + 42) == seq + 20 && benchTcpEchoes(seq + 5, 15)
+               && benchTcpNext == next + 20);
+    benchTcpAckAll(seq + 20);
+
+    seq += 20;
+    sent = benchMeasure("tcp ooo window", benchTcp(0x18, seq + TCP_RX_BUFFER, benchTcpNext, 10));
+    benchCheck(sent == 1 && benchTcpData() == 0 && benchGet32(benchTcpReply + 42) == seq);
+    sent = benchMeasure("tcp ooo inside", benchTcp(0x18, seq, benchTcpNext, 10));
+    benchCheck(sent == 1 && benchGet32(benchTcpReply + 42) == seq + 10);
+    benchTcpAckAll(seq + 10);
+
+    // runs of 5 at +10, +20, +30 and +40 fill the ranges, so +50 is dropped
+    seq += 10;
+    for (i = 1; i <= TCP_RX_RANGES; i++)
+        benchSend(benchTcp(0x18, seq + i * 10, benchTcpNext, 5));
+    sent = benchMeasure("tcp ooo full", benchTcp(0x18, seq + 50, benchTcpNext, 5));
+    benchCheck(sent == 1 && benchTcpData() == 0 && benchGet32(benchTcpReply + 42) == seq);
+    sent = benchMeasure("tcp ooo refill", benchTcp(0x18, seq, benchTcpNext, 50));
+    benchCheck(sent == 1 && benchGet32(benchTcpReply + 42) == seq + 50);
+    benchTcpAckAll(seq + 50);
+    benchSend(benchTcp(0x04, seq + 50, 0, 0));
+}
+
+// Waits up to maxMs for telnet to send a segment to benchTcpPort and prints
+// the row; the us column is the time waited
+// Returns the ms waited
+uint32_t benchTcpMeasureWait(const char* name, uint32_t maxMs)
+{
+    uint16_t sent = benchTcpSent;
+    uint32_t waitStart = hostWaitUs, ms;
+    enc28j60ModelResetStats();
+    ms = benchTcpWait(maxMs);
+    benchPrint(name, 0, benchTcpSent - sent, waitStart);
+    return ms;
+}
+
+// Returns true if a timer of rto ms started before the wait ended in the
+// wait of ms, given the TCP_SERVICE_INTERVAL between checks
+bool benchTcpExpired(uint32_t ms, uint32_t rto)
+{
+    return ms + 1 >= rto && ms <= rto + TCP_SERVICE_INTERVAL + 1;
+}
+
+// An echo left unacknowledged is sent again once after the rto, and again
+// after twice that; the ack of a retransmitted segment is no rtt sample
+// (Karn's rule), so the backed-off rto holds until a fresh segment is timed
+// After TCP_MAX_RETRIES the connection is reset and counted as a timeout
+void benchTcpRetransmit()
+{
+    uint32_t seq = 30001, echo, retransmits, timeouts, ms;
+    uint16_t sent;
+
+    // a syn cookie keeps no state, so the handshake is not timed and the
+    // first echo waits TCP_RTO_INITIAL
+    benchTcpPort = 40002;
+    benchTcpOpen(seq);
+    retransmits = tcpGetRetransmitCount();
+    benchSend(benchTcp(0x18, seq, benchTcpNext, 10));
+    echo = benchGet32(benchTcpReply + 38);
+    ms = benchTcpMeasureWait("tcp rto", 5000);
+    benchCheck(benchTcpExpired(ms, TCP_RTO_INITIAL) && benchGet32(benchTcpReply + 38) == echo
+               && benchTcpEchoes(seq, 10) && tcpGetRetransmitCount() == retransmits + 1);
+    ms = benchTcpMeasureWait("tcp rto backoff", 5000);
+    benchCheck(benchTcpExpired(ms, TCP_RTO_INITIAL * 2) && benchGet32(benchTcpReply + 38) == echo
+               && tcpGetRetransmitCount() == retransmits + 2);
+
+    // the retransmission is acked but not timed, so the next echo waits the
+    // backed-off rto rather than one from a sample
+    seq += 10;
+    benchTcpAckAll(seq);
+    benchSend(benchTcp(0x18, seq, benchTcpNext, 10));
+    ms = benchTcpMeasureWait("tcp rto karn", 5000);
+    benchCheck(benchTcpExpired(ms, TCP_RTO_INITIAL * 4) && tcpGetRetransmitCount() == retransmits + 3);
+
+    // an echo acked at once is a sample and brings the rto back down
+    seq += 10;
+    benchTcpAckAll(seq);
+    benchSend(benchTcp(0x18, seq, benchTcpNext, 10));
+    benchTcpAckAll(seq + 10);
+    seq += 10;
+    benchSend(benchTcp(0x18, seq, benchTcpNext, 10));
+    ms = benchTcpMeasureWait("tcp rto sample", 5000);
+    benchCheck(benchTcpExpired(ms, TCP_RTO_MIN) && tcpGetRetransmitCount() == retransmits + 4);
+
+    // the rto doubles through TCP_MAX_RETRIES retransmissions, then the
+    // connection is reset; the last of them ends with TCP_RTO_MIN to go
+    timeouts = tcpGetTimeoutCount();
+    benchIdle((TCP_RTO_MIN << (TCP_MAX_RETRIES + 1)) - TCP_RTO_MIN * 3);
+    sent = benchTcpSent;
+    ms = benchTcpMeasureWait("tcp rto timeout", TCP_RTO_MAX);
+    benchCheck(benchTcpSent == sent + 1 && (benchTcpReply[47] & 0x04) != 0
+               && tcpGetRetransmitCount() == retransmits + 3 + TCP_MAX_RETRIES
+               && tcpGetTimeoutCount() == timeouts + 1);
+}
+
+// Returns the first connection in state, or TCP_MAX_CONNECTIONS if none is
+uint8_t benchTcpConnection(tcpState state)
+{
+    uint8_t i;
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+        if (tcpGetState(i) == state)
+            return i;
+    return TCP_MAX_CONNECTIONS;
+}
+
+// Waits up to maxMs for connection to be freed and prints the row; the us
+// column is the time waited
+// Returns the ms waited
+uint32_t benchTcpMeasureFree(const char* name, uint8_t connection, uint32_t maxMs)
+{
+    uint16_t sent = benchTcpSent;
+    uint32_t waitStart = hostWaitUs, ms = 0;
+    enc28j60ModelResetStats();
+    while (ms < maxMs && tcpGetState(connection) != TCP_CLOSED)
+    {
+        enc28j60ModelAdvanceTime(1000);
+        benchPoll();
+        ms++;
+    }
+    benchPrint(name, 0, benchTcpSent - sent, waitStart);
+    return ms;
+}
+
+// Opens a connection from benchTcpPort and closes it from this end, acking
+// the fin and, if finish, sending one back
+// Returns the connection, left in FIN_WAIT_2 or TIME_WAIT
+uint8_t benchTcpHalfClose(uint32_t seq, bool finish)
+{
+    uint8_t connection;
+    benchTcpOpen(seq);
+    connection = benchTcpConnection(TCP_ESTABLISHED);
+    tcpClose(connection);
+    benchPoll();
+    benchTcpAckAll(seq);
+    if (finish)
+        benchSend(benchTcp(0x11, seq, benchTcpNext, 0));
+    return connection;
+}
+
+// An idle connection is probed from TCP_KEEPALIVE_IDLE, every
+// TCP_KEEPALIVE_INTERVAL, and reset once TCP_KEEPALIVE_PROBES go unanswered
+// FIN_WAIT_2 and TIME_WAIT are freed after their timeouts, and a full table
+// recycles its TIME_WAIT slot for a new connection or refuses it; each is
+// counted in tcpReclaimStats
+void benchTcpReclaim()
+{
+    tcpReclaimStats before, after;
+    uint32_t seq = 40001, iss, ms;
+    uint16_t sent;
+    uint8_t connection, i;
+    tcpState state;
+
+    // a probe is an ack one below sndNxt, carrying no data
+    tcpGetReclaimStats(&before);
+    benchTcpPort = 40003;
+    benchTcpOpen(seq);
+    ms = benchTcpMeasureWait("tcp probe", TCP_KEEPALIVE_IDLE * 2);
+    benchCheck(benchTcpExpired(ms, TCP_KEEPALIVE_IDLE) && benchTcpData() == 0 && benchTcpReply[47] == 0x10
+               && benchGet32(benchTcpReply + 38) == benchTcpNext - 1);
+    ms = benchTcpMeasureWait("tcp probe 2", TCP_KEEPALIVE_INTERVAL * 2);
+    benchCheck(benchTcpExpired(ms, TCP_KEEPALIVE_INTERVAL) && benchTcpData() == 0 && benchTcpReply[47] == 0x10);
+    for (i = 2; i < TCP_KEEPALIVE_PROBES; i++)
+        benchTcpWait(TCP_KEEPALIVE_INTERVAL * 2);
+    ms = benchTcpMeasureWait("tcp probe reset", TCP_KEEPALIVE_INTERVAL * 2);
+    tcpGetReclaimStats(&after);
+    benchCheck(benchTcpExpired(ms, TCP_KEEPALIVE_INTERVAL) && (benchTcpReply[47] & 0x04) != 0
+               && benchTcpConnection(TCP_ESTABLISHED) == TCP_MAX_CONNECTIONS
+               && after.keepalives == before.keepalives + 1);
+
+    // FIN_WAIT_2 is reset, TIME_WAIT freed without a word
+    benchTcpPort = 40004;
+    connection = benchTcpHalfClose(seq, false);
+    state = tcpGetState(connection);
+    ms = benchTcpMeasureFree("tcp fin wait 2", connection, TCP_FIN_WAIT_TIMEOUT * 2);
+    tcpGetReclaimStats(&after);
+    benchCheck(state == TCP_FIN_WAIT_2 && benchTcpExpired(ms, TCP_FIN_WAIT_TIMEOUT)
+               && (benchTcpReply[47] & 0x04) != 0 && after.finWaits == before.finWaits + 1);
+    benchTcpPort = 40005;
+    connection = benchTcpHalfClose(seq, true);
+    state = tcpGetState(connection);
+    sent = benchTcpSent;
+    ms = benchTcpMeasureFree("tcp time wait", connection, TCP_TIME_WAIT_TIMEOUT * 2);
+    tcpGetReclaimStats(&after);
+    benchCheck(state == TCP_TIME_WAIT && benchTcpExpired(ms, TCP_TIME_WAIT_TIMEOUT) && benchTcpSent == sent
+               && after.timeWaits == before.timeWaits + 1);
+
+    // with one connection in TIME_WAIT and the rest established, the next
+    // handshake takes the TIME_WAIT slot and the one after it is reset
+    benchTcpPort = 40006;
+    connection = benchTcpHalfClose(seq, true);
+    for (i = 1; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        benchTcpPort++;
+        benchTcpOpen(seq);
+    }
+    benchTcpPort++;
+    benchSend(benchTcp(0x02, seq - 1, 0, 0));
+    iss = benchGet32(benchTcpReply + 38);
+    sent = benchMeasure("tcp recycle", benchTcp(0x10, seq, iss + 1, 0));
+    tcpGetReclaimStats(&after);
+    benchCheck(sent == 0 && tcpGetState(connection) == TCP_ESTABLISHED && after.recycled == before.recycled + 1);
+    benchTcpPort++;
+    benchSend(benchTcp(0x02, seq - 1, 0, 0));
+    iss = benchGet32(benchTcpReply + 38);
+    sent = benchMeasure("tcp refused", benchTcp(0x10, seq, iss + 1, 0));
+    tcpGetReclaimStats(&after);
+    benchCheck(sent == 1 && (benchTcpReply[47] & 0x04) != 0 && after.refused == before.refused + 1
+               && after.inUse == TCP_MAX_CONNECTIONS);
+    for (benchTcpPort = 40007; benchTcpPort <= 40006 + TCP_MAX_CONNECTIONS; benchTcpPort++)
+        benchSend(benchTcp(0x04, seq, 0, 0));
+}
+
+// A datagram for a host not in the cache is held while its address is
+// asked for and sent when the reply comes; one off the subnet goes to the
+// gateway's address
+// With ARP_QUEUE_FRAMES held, the next is dropped, and so are those held
+// once ARP_MAX_TRIES requests go unanswered
+// An entry in use is refreshed by unicast ARP_REFRESH before it expires,
+// while one not used since its reply simply expires after ARP_TIMEOUT
+void benchArp()
+{
+    const uint8_t hostMac[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x20};
+    const uint8_t hostIp[4] = {192, 168, 2, 20};
+    const uint8_t silentIp[4] = {192, 168, 2, 21};
+    const uint8_t gatewayMac[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x01};
+    const uint8_t gatewayIp[4] = {192, 168, 2, 1};
+    const uint8_t remoteIp[4] = {10, 0, 0, 1};
+    uint32_t drops, hostTime, gatewayTime, age;
+    uint16_t sent;
+    uint8_t i;
+
+    sent = benchMeasureUdp("udp unresolved", hostIp);
+    benchCheck(sent == 1 && benchIsArpRequest(hostIp, benchBroadcastMac));
+    sent = benchMeasure("arp reply held", benchArpReply(hostMac, hostIp));
+    benchCheck(sent == 1 && benchIsUdp(hostIp, hostMac));
+    hostTime = getTimerMs();
+    sent = benchMeasureUdp("udp resolved", hostIp);
+    benchCheck(sent == 1 && benchIsUdp(hostIp, hostMac));
+    sent = benchMeasureUdp("udp gateway", remoteIp);
+    benchCheck(sent == 1 && benchIsArpRequest(gatewayIp, benchBroadcastMac));
+    sent = benchMeasure("arp reply gw", benchArpReply(gatewayMac, gatewayIp));
+    benchCheck(sent == 1 && benchIsUdp(remoteIp, gatewayMac));
+    gatewayTime = getTimerMs();
+
+    drops = etherGetArpDropCount();
+    for (i = 0; i < ARP_QUEUE_FRAMES; i++)
+        etherSendUdp(silentIp, 1024, 1024, "bench", 5);
+    sent = benchMeasureUdp("udp queue full", silentIp);
+    benchCheck(sent == 0 && etherGetArpDropCount() == drops + 1);
+    benchIdle(ARP_RETRY * ARP_MAX_TRIES + ARP_SERVICE_INTERVAL);
+    sent = benchMeasure("arp unanswered", benchArpReply(hostMac, silentIp));
+    benchCheck(sent == 0 && etherGetArpDropCount() == drops + 1 + ARP_QUEUE_FRAMES);
+
+    // the host was used after its reply and the gateway was not; the
+    // refresh is unicast to the address last seen
+    benchMeasureWait("arp refresh", ARP_TIMEOUT);
+    age = getTimerMs() - hostTime;
+    benchCheck(age >= ARP_TIMEOUT - ARP_REFRESH && age <= ARP_TIMEOUT - ARP_REFRESH + ARP_SERVICE_INTERVAL
+               && benchIsArpRequest(hostIp, hostMac));
+    benchSend(benchArpReply(hostMac, hostIp));
+    benchIdle(ARP_TIMEOUT + ARP_SERVICE_INTERVAL - (getTimerMs() - gatewayTime));
+    sent = benchMeasureUdp("udp expired gw", remoteIp);
+    benchCheck(sent == 1 && benchIsArpRequest(gatewayIp, benchBroadcastMac));
+    sent = benchMeasureUdp("udp refreshed", hostIp);
+    benchCheck(sent == 1 && benchIsUdp(hostIp, hostMac));
+    benchSend(benchArpReply(gatewayMac, gatewayIp));
+}
+
+// A nak sends the client back to INIT without an address; an ack binds the
+// address, mask and gateway it carries and is announced by gratuitous arp
+// At T1 (half the lease) the client renews by unicast to its server, and at
+// T2 (7/8 of it) rebinds by broadcast to any
+void benchDhcpLease()
+{
+    const uint8_t leasedIp[4] = {192, 168, 2, 77};
+    const uint8_t leasedMask[4] = {255, 255, 255, 0};
+    const uint8_t serverIp[4] = {192, 168, 2, 1};
+    uint32_t bound, elapsed;
+    uint16_t sent;
+
+    // the client is requesting the offer taken above
+    sent = benchMeasure("dhcp nak", benchDhcpMessage(DHCPNAK, benchDhcpXid, false));
+    benchCheck(sent <= 1 && (dhcpGetState() == DHCP_INIT || dhcpGetState() == DHCP_SELECTING) && !etherIsIpValid());
+    benchMeasureDhcp("dhcp discover", DHCP_SELECTING, 1000);
+    benchCheck(benchIsDhcp(DHCPDISCOVER, benchBroadcastIp));
+    sent = benchMeasure("dhcp offer 2", benchDhcpMessage(DHCPOFFER, benchDhcpXid, false));
+    benchCheck(sent == 1 && benchIsDhcp(DHCPREQUEST, benchBroadcastIp));
+    sent = benchMeasure("dhcp ack", benchDhcpMessage(DHCPACK, benchDhcpXid, false));
+    benchCheck(sent == 1 && dhcpGetState() == DHCP_BOUND && benchIsConfigured(leasedIp, leasedMask, serverIp)
+               && benchReply[12] == 0x08 && benchReply[13] == 0x06);
+    bound = getTimerMs();
+
+    // the server's address is resolved before the renewal goes out
+    benchMeasureDhcp("dhcp renew", DHCP_RENEWING, 3600 * 1000);
+    elapsed = getTimerMs() - bound;
+    benchCheck(benchDhcpOnTime(elapsed, 1800 * 1000) && benchIsArpRequest(serverIp, benchBroadcastMac));
+    sent = benchMeasure("dhcp renew arp", benchArpReply(benchPeerMac, serverIp));
+    benchCheck(sent == 1 && benchIsDhcp(DHCPREQUEST, serverIp) && memcmp(benchReply + 54, leasedIp, 4) == 0);
+    benchMeasureDhcp("dhcp rebind", DHCP_REBINDING, 3600 * 1000);
+    elapsed = getTimerMs() - bound;
+    benchCheck(benchDhcpOnTime(elapsed, 3150 * 1000) && benchIsDhcp(DHCPREQUEST, benchBroadcastIp)
+               && memcmp(benchReply + 54, leasedIp, 4) == 0);
+    sent = benchMeasure("dhcp rebind ack", benchDhcpMessage(DHCPACK, benchDhcpXid, false));
+    benchCheck(sent == 1 && dhcpGetState() == DHCP_BOUND && benchIsConfigured(leasedIp, leasedMask, serverIp));
+}
+
+// Stops the client and puts record back in eeprom, as if the board had
+// rebooted holding it, then starts the client again
+void benchDhcpReboot(const uint32_t record[])
+{
+    uint8_t i;
+    dhcpRelease();
+    benchPoll();
+    for (i = 0; i <= DHCP_LEASE_WORDS; i++)
+        writeEeprom(DHCP_LEASE_ADDRESS + i, record[i]);
+    dhcpStart();
+}
+
+// A lease saved in eeprom is confirmed after a reboot with a single
+// broadcast request for it (INIT-REBOOT), while a record whose crc fails is
+// ignored for a discover
+void benchDhcpInitReboot()
+{
+    const uint8_t leasedIp[4] = {192, 168, 2, 77};
+    const uint8_t leasedMask[4] = {255, 255, 255, 0};
+    const uint8_t serverIp[4] = {192, 168, 2, 1};
+    const uint8_t* requested;
+    uint32_t record[DHCP_LEASE_WORDS + 1];
+    uint16_t sent;
+    uint8_t i;
+
+    for (i = 0; i <= DHCP_LEASE_WORDS; i++)
+        record[i] = readEeprom(DHCP_LEASE_ADDRESS + i);
+    benchDhcpReboot(record);
+    benchMeasureDhcp("dhcp init-reboot", DHCP_REBOOTING, 1000);
+    requested = benchDhcpOption(50);
+    benchCheck(benchIsDhcp(DHCPREQUEST, benchBroadcastIp) && requested != 0 && memcmp(requested, leasedIp, 4) == 0
+               && benchDhcpOption(54) == 0);
+    sent = benchMeasure("dhcp reboot ack", benchDhcpMessage(DHCPACK, benchDhcpXid, false));
+    benchCheck(sent == 1 && dhcpGetState() == DHCP_BOUND && benchIsConfigured(leasedIp, leasedMask, serverIp));
+
+    // the lease time is changed under its crc
+    record[DHCP_LEASE_WORDS - 1] ^= 1;
+    benchDhcpReboot(record);
+    benchMeasureDhcp("dhcp bad crc", DHCP_SELECTING, 1000);
+    benchCheck(benchIsDhcp(DHCPDISCOVER, benchBroadcastIp) && !etherIsIpValid());
+}
+
+// A discover offers rapid commit (RFC 4039), and an ack carrying the option
+// answers it, binding the client in two messages; an ack without it is no
+// answer to a discover
+void benchDhcpRapidCommit()
+{
+    const uint8_t leasedIp[4] = {192, 168, 2, 77};
+    const uint8_t leasedMask[4] = {255, 255, 255, 0};
+    const uint8_t serverIp[4] = {192, 168, 2, 1};
+    uint16_t sent;
+
+    dhcpRefresh();
+    benchMeasureDhcp("dhcp discover rc", DHCP_SELECTING, 1000);
+    benchCheck(benchIsDhcp(DHCPDISCOVER, benchBroadcastIp) && benchDhcpOption(80) != 0);
+    sent = benchMeasure("dhcp ack no rc", benchDhcpMessage(DHCPACK, benchDhcpXid, false));
+    benchCheck(sent == 0 && dhcpGetState() == DHCP_SELECTING && !etherIsIpValid());
+    sent = benchMeasure("dhcp rapid ack", benchDhcpMessage(DHCPACK, benchDhcpXid, true));
+    benchCheck(sent == 1 && dhcpGetState() == DHCP_BOUND && benchIsConfigured(leasedIp, leasedMask, serverIp));
+}
+
+// Finds the handler of a frame as processPacket() did before frames were
+// classified once: each handler's test is run in turn on the frame
+// Returns the protocol tag of the handler
+uint8_t benchDispatchChain(etherPacket* packet)
+{
+    uint8_t protocol = ETHER_UNKNOWN;
+    etherParsePacket(packet);
+    if (etherIsArpRequest(packet))
+        protocol = ETHER_ARP_REQUEST;
+    if (etherIsIp(packet) && etherIsIpUnicast(packet))
+    {
+        if (etherIsPingRequest(packet))
+            protocol = ETHER_ICMP_ECHO;
+        if (etherIsTcp(packet))
+            protocol = ETHER_TCP;
+    }
+    return protocol;
+}
+
+uint8_t benchDispatchTable(etherPacket* packet)
+{
+    return etherClassifyPacket(packet);
+}
+
+// Returns the host ns per call of dispatch on the frame in benchFrame
+double benchDispatchNs(uint8_t (*dispatch)(etherPacket*), uint16_t size, bool verified)
+{
+    etherPacket packet;
+    clock_t start;
+    uint32_t i;
+    packet.data = benchFrame;
+    packet.size = size;
+    packet.verified = verified;
+    start = clock();
+    for (i = 0; i < BENCH_DISPATCH_RUNS; i++)
+        benchDispatchTag = dispatch(&packet);
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / BENCH_DISPATCH_RUNS;
+}
+
+// Prints the cost of finding the handler of a frame before and after the
+// dispatch table: "chain" runs the old tests, "table" classifies the frame,
+// and "verified" classifies it as the receive path hands it over when
+// ETHER_RXCHECKSUM has checked its checksums
+void benchDispatchRow(const char* name, uint16_t size, bool checksummed)
+{
+    printf("%-16s %5u %8.0f %8.0f %8.0f\n", name, size, benchDispatchNs(benchDispatchChain, size, false),
+           benchDispatchNs(benchDispatchTable, size, false),
+           benchDispatchNs(benchDispatchTable, size, checksummed));
+}
+
+void benchDispatch()
+{
+    printf("%-16s %5s %8s %8s %8s\n", "frame", "bytes", "chain", "table", "verified");
+    benchDispatchRow("arp request", benchArpRequest(), false);
+    benchDispatchRow("ping 56", benchPing(1, 56), true);
+    benchDispatchRow("ping 1472", benchPing(2, 1472), true);
+    benchDispatchRow("tcp data 100", benchTcp(0x18, 1001, 1, 100), true);
+    benchDispatchRow("dhcp offer", benchDhcpMessage(DHCPOFFER, 0, false), true);
+}
+
+void benchTimer0()
+{
+    benchTimerFired[0] = getTimerMs();
+    benchTimerCount[0]++;
+}
+
+void benchTimer1()
+{
+    benchTimerFired[1] = getTimerMs();
+    benchTimerCount[1]++;
+}
+
+// Starts itself again from its own callback, for three calls in all
+void benchTimerRearm()
+{
+    benchTimer1();
+    if (benchTimerCount[1] < 3)
+        startTimer(&benchTimers[1], 7, 0, benchTimerRearm);
+}
+
+// Lets time pass, running the main loop every ms, until event stops or
+// maxMs has passed, and prints the row; the us column is the time waited
+void benchMeasureTimer(const char* name, timerEvent* event, uint32_t maxMs)
+{
+    uint32_t waitStart = hostWaitUs, ms = 0;
+    uint16_t sent = 0;
+    enc28j60ModelResetStats();
+    while (ms < maxMs && isTimerRunning(event))
+    {
+        enc28j60ModelAdvanceTime(1000);
+        sent += benchPoll();
+        ms++;
+    }
+    benchPrint(name, 0, sent, waitStart);
+}
+
+// Returns true if a timer started at start for ms was called back on time;
+// the main loop may pass a ms boundary on SPI time, so one late is allowed
+bool benchTimerOnTime(uint8_t timer, uint32_t start, uint32_t ms)
+{
+    return benchTimerFired[timer] - start >= ms && benchTimerFired[timer] - start <= ms + 1;
+}
+
+// A one-shot event is called back on time whichever level of the wheel it is
+// filed in, and cascades down to level 0 on the way, as does one further out
+// than the wheel spans; a stopped event is never called back, one started
+// again from its own callback is, and a periodic one repeats on time
+void benchTimerWheel()
+{
+    const char* names[TIMER_WHEEL_LEVELS + 1] = {"timer level 0", "timer level 1", "timer level 2",
+                                                 "timer level 3", "timer past span"};
+    uint32_t start, ms;
+    uint8_t level, count;
+
+    for (level = 0; level <= TIMER_WHEEL_LEVELS; level++)
+    {
+        // 3 slots into the level, or twice the span of the wheel
+        ms = level < TIMER_WHEEL_LEVELS ? 3UL << (TIMER_WHEEL_BITS * level)
+                                        : 2UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+        count = benchTimerCount[0];
+        start = getTimerMs();
+        startTimer(&benchTimers[0], ms, 0, benchTimer0);
+        benchMeasureTimer(names[level], &benchTimers[0], ms * 2);
+        benchCheck(benchTimerCount[0] == count + 1 && benchTimerOnTime(0, start, ms));
+    }
+
+    count = benchTimerCount[0];
+    start = getTimerMs();
+    startTimer(&benchTimers[0], 50, 0, benchTimer0);
+    startTimer(&benchTimers[1], 60, 0, benchTimer1);
+    benchIdle(20);
+    stopTimer(&benchTimers[0]);
+    benchMeasureTimer("timer stop", &benchTimers[1], 100);
+    benchCheck(benchTimerCount[0] == count && !isTimerRunning(&benchTimers[0]) && benchTimerOnTime(1, start, 60));
+
+    benchTimerCount[1] = 0;
+    start = getTimerMs();
+    startTimer(&benchTimers[1], 7, 0, benchTimerRearm);
+    benchMeasureTimer("timer rearm", &benchTimers[1], 100);
+    benchCheck(benchTimerCount[1] == 3 && benchTimerOnTime(1, start, 21));
+
+    count = benchTimerCount[0];
+    start = getTimerMs();
+    startTimer(&benchTimers[0], 25, 25, benchTimer0);
+    benchMeasureTimer("timer periodic", &benchTimers[0], 100);
+    stopTimer(&benchTimers[0]);
+    benchCheck(benchTimerCount[0] == count + 4 && benchTimerOnTime(0, start, 100));
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    uint32_t iss, ack;
+    uint16_t sent, size;
+
+    enc28j60ModelInit();
+    initTimer();
+    etherSetMacAddress(2, 3, 4, 5, 6, 123);
+    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX | ETHER_RXCHECKSUM);
+    etherEnableRxInterrupt();
+    etherSetIpAddress(192, 168, 2, 123);
+    etherSetIpSubnetMask(255, 255, 255, 0);
+    etherSetIpGatewayAddress(192, 168, 2, 1);
+    tcpListen(23);
+    // past the led flash etherInit() leaves to the timer wheel
+    benchIdle(200);
+
+    if (argc > 1 && strcmp(argv[1], "flood") == 0)
+    {
+        benchFlood(1000);
+        benchFlood(100);
+        return benchEchoReplies > 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "dispatch") == 0)
+    {
+        benchDispatch();
+        return 0;
+    }
+
+    printf("%-16s %5s %4s %8s %6s %5s %10s %8s\n", "operation", "bytes", "sent", "spiBytes", "trans", "banks", "us",
+           "waitUs");
+    // arp reply (opcode 2), icmp echo reply (type 0) with valid checksums
+    sent = benchMeasure("arp request", benchArpRequest());
+    benchCheck(sent == 1 && benchReply[12] == 0x08 && benchReply[13] == 0x06 && benchReply[21] == 2);
+    sent = benchMeasure("ping 56", benchPing(1, 56));
+    benchCheck(sent == 1 && benchReplySize == 98 && benchReply[23] == 1 && benchReply[34] == 0
+               && benchChecksum(0, benchReply + 14, 20) == 0 && benchChecksum(0, benchReply + 34, 64) == 0);
+    sent = benchMeasure("ping 1472", benchPing(2, 1472));
+    benchCheck(sent == 1 && benchReplySize == 1514 && benchReply[23] == 1 && benchReply[34] == 0);
+    // a corrupt payload is dropped by the checksum check
+    size = benchPing(3, 1472);
+    benchFrame[size - 1] ^= 1;
+    sent = benchMeasure("ping 1472 bad", size);
+    benchCheck(sent == 0);
+
+    // syn/ack, nothing for the ack that completes the handshake, then telnet
+    // echoes the data (in mss-sized segments) with the ack piggybacked
+    sent = benchMeasure("tcp syn", benchTcp(0x02, 1000, 0, 0));
+    benchCheck(sent == 1 && benchReply[23] == 6 && benchReply[47] == 0x12);
+    iss = benchGet32(benchReply + 38);
+    sent = benchMeasure("tcp ack", benchTcp(0x10, 1001, iss + 1, 0));
+    benchCheck(sent == 0);
+    sent = benchMeasure("tcp data 100", benchTcp(0x18, 1001, iss + 1, 100));
+    benchCheck(sent == 1 && benchReplySize == 154 && benchGet32(benchReply + 42) == 1101);
+    sent = benchMeasure("tcp data 1460", benchTcp(0x18, 1101, iss + 101, 1460));
+    benchCheck(sent > 1 && benchGet32(benchReply + 42) == 2561);
+    // data offsets under the header or past the payload are dropped, ahead
+    // of rcvNxt as well as at it, and the next segment is acked as before
+    ack = benchGet32(benchReply + 38) + benchReplySize - 54;
+    size = benchTcp(0x18, 2661, ack, 100);
+    benchFrame[46] = 4 << 4;
+    benchL4Checksum(16, 120);
+    sent = benchMeasure("tcp offset 4", size);
+    benchCheck(sent == 0);
+    size = benchTcp(0x18, 2561, ack, 10);
+    benchFrame[46] = 15 << 4;
+    benchL4Checksum(16, 30);
+    sent = benchMeasure("tcp offset 15", size);
+    benchCheck(sent == 0);
+    sent = benchMeasure("tcp data 10", benchTcp(0x18, 2561, ack, 10));
+    benchCheck(sent > 0 && benchGet32(benchReply + 42) == 2571);
+    // an ack for no connection is answered with a reset at its ack number
+    size = benchTcp(0x10, 5000, 7000, 0);
+    benchPut16(benchFrame + 34, 40001);
+    benchL4Checksum(16, 20);
+    sent = benchMeasure("tcp no conn", size);
+    benchCheck(sent == 1 && benchReply[47] == 0x04 && benchGet32(benchReply + 38) == 7000);
+    benchSend(benchTcp(0x04, 2571, 0, 0));
+
+    benchTimerWheel();
+
+    benchTcpReassembly();
+    benchTcpRetransmit();
+    benchTcpReclaim();
+    benchArp();
+
+    benchIdle(500);
+
+    // dhcp request (option 53 = 3) for the offer made to the discover's xid
+    dhcpStart();
+    benchIdle(200);
+    sent = benchMeasure("dhcp offer", benchDhcpMessage(DHCPOFFER, benchDhcpXid, false));
+    benchCheck(sent == 1 && benchReply[23] == 17 && benchReply[282] == 53 && benchReply[284] == 3);
+    // a udp length past the ip length is refused rather than walked
+    dhcpRefresh();
+    benchIdle(200);
+    size = benchDhcpMessage(DHCPOFFER, benchDhcpXid, false);
+    benchPut16(benchFrame + 38, 1400);
+    benchPut16(benchFrame + 40, 0);
+    sent = benchMeasure("dhcp offer long", size);
+    benchCheck(sent == 0);
+    // a udp checksum of 0 means none was sent, so the offer is taken as is
+    size = benchDhcpMessage(DHCPOFFER, benchDhcpXid, false);
+    benchPut16(benchFrame + 40, 0);
+    sent = benchMeasure("dhcp offer nosum", size);
+    benchCheck(sent == 1 && benchReply[23] == 17 && benchReply[282] == 53 && benchReply[284] == 3);
+
+    benchDhcpLease();
+    benchDhcpInitReboot();
+    benchDhcpRapidCommit();
+
+    return benchFailures == 0 ? 0 : 1;
+}
+
+#endif
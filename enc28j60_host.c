@@ -0,0 +1,112 @@
+// Host Stand-ins for the Board Modules
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Host (Linux) build of the eth0 library
+// Target uC:       -
+// System Clock:    -
+
+// Model configuration:
+// Replaces gpio.c, uart0.c and wait.c in the host build (see Makefile)
+// Pins do nothing, serial output is discarded, and waitMicrosecond() lets
+//   the simulated time of the ENC28J60 model pass instead of spinning
+// The CCS target build never defines ENC28J60_MODEL, so this file compiles
+//   to nothing there
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifdef ENC28J60_MODEL
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gpio.h"
+#include "uart0.h"
+#include "wait.h"
+#include "enc28j60_model.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint32_t hostWaitUs = 0;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// GPIO
+void enablePort(PORT port) {}
+void disablePort(PORT port) {}
+void selectPinPushPullOutput(PORT port, uint8_t pin) {}
+void selectPinOpenDrainOutput(PORT port, uint8_t pin) {}
+void selectPinDigitalInput(PORT port, uint8_t pin) {}
+void selectPinAnalogInput(PORT port, uint8_t pin) {}
+void setPinCommitControl(PORT port, uint8_t pin) {}
+void enablePinPullup(PORT port, uint8_t pin) {}
+void disablePinPullup(PORT port, uint8_t pin) {}
+void enablePinPulldown(PORT port, uint8_t pin) {}
+void disablePinPulldown(PORT port, uint8_t pin) {}
+void setPinAuxFunction(PORT port, uint8_t pin, uint32_t fn) {}
+void selectPinInterruptRisingEdge(PORT port, uint8_t pin) {}
+void selectPinInterruptFallingEdge(PORT port, uint8_t pin) {}
+void selectPinInterruptBothEdges(PORT port, uint8_t pin) {}
+void selectPinInterruptHighLevel(PORT port, uint8_t pin) {}
+void selectPinInterruptLowLevel(PORT port, uint8_t pin) {}
+void enablePinInterrupt(PORT port, uint8_t pin) {}
+void disablePinInterrupt(PORT port, uint8_t pin) {}
+void clearPinInterrupt(PORT port, uint8_t pin) {}
+void setPinValue(PORT port, uint8_t pin, bool value) {}
+void setPortValue(PORT port, uint8_t value) {}
+
+bool getPinValue(PORT port, uint8_t pin)
+{
+    return false;
+}
+
+uint8_t getPortValue(PORT port)
+{
+    return 0;
+}
+
+// UART0
+void initUart0() {}
+void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc) {}
+void putcUart0(char c) {}
+void putsUart0(char* str) {}
+void flushUart0() {}
+void uart0Isr() {}
+
+char getcUart0()
+{
+    return 0;
+}
+
+bool kbhitUart0()
+{
+    return false;
+}
+
+uint32_t getUart0TxDropCount()
+{
+    return 0;
+}
+
+uint32_t getUart0RxDropCount()
+{
+    return 0;
+}
+
+// Wait
+// The time is also summed in hostWaitUs, so a driver can tell busy waiting
+// apart from SPI and wire time
+void waitMicrosecond(uint32_t us)
+{
+    hostWaitUs += us;
+    enc28j60ModelAdvanceTime(us);
+}
+
+#endif
@@ -0,0 +1,505 @@
+// ENC28J60 Software Model
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Host (Linux) build of the eth0 library
+// Target uC:       -
+// System Clock:    -
+
+// Model configuration:
+// See enc28j60_model.h
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifdef ENC28J60_MODEL
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "enc28j60_model.h"
+
+// Register keys use the same encoding as eth0.c (bank << 5 | address),
+// except for the common registers 0x1B-0x1F which ignore the bank bits
+#define ERDPTL      0x00
+#define ERDPTH      0x01
+#define EWRPTL      0x02
+#define EWRPTH      0x03
+#define ETXSTL      0x04
+#define ETXSTH      0x05
+#define ETXNDL      0x06
+#define ETXNDH      0x07
+#define ERXSTL      0x08
+#define ERXSTH      0x09
+#define ERXNDL      0x0A
+#define ERXNDH      0x0B
+#define ERXRDPTL    0x0C
+#define ERXRDPTH    0x0D
+#define ERXWRPTL    0x0E
+#define ERXWRPTH    0x0F
+#define EDMASTL     0x10
+#define EDMANDL     0x12
+#define EDMACSL     0x16
+#define EDMACSH     0x17
+#define EIE         0x1B
+#define INTIE   0x80
+#define EIR         0x1C
+#define RXERIF  0x01
+#define TXIF    0x08
+#define DMAIF   0x20
+#define PKTIF   0x40
+#define ESTAT       0x1D
+#define CLKRDY  0x01
+#define ECON2       0x1E
+#define PKTDEC  0x40
+#define AUTOINC 0x80
+#define ECON1       0x1F
+#define RXEN    0x04
+#define TXRTS   0x08
+#define CSUMEN  0x10
+#define DMAST   0x20
+#define EPKTCNT     0x39
+#define MICMD       0x52
+#define MIIRD   0x01
+#define MIREGADR    0x54
+#define MIWRL       0x56
+#define MIWRH       0x57
+#define MIRDL       0x58
+#define MIRDH       0x59
+
+#define PHSTAT1     0x01
+#define LSTAT  0x0400
+
+// SPI opcodes (top 3 bits of the first byte of a transaction)
+#define OP_RCR 0
+#define OP_RBM 1
+#define OP_WCR 2
+#define OP_WBM 3
+#define OP_BFS 4
+#define OP_BFC 5
+#define OP_SRC 7
+
+#define BUFFER_SIZE 8192
+#define SPI_BYTE_NS (8000000000ULL / ENC28J60_MODEL_SPI_HZ)
+#define WIRE_BYTE_NS 800                 // 10 Mbps
+#define WIRE_OVERHEAD 24                 // preamble/SFD (8), CRC (4), IPG (12)
+#define MIN_FRAME 60
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint8_t modelBuffer[BUFFER_SIZE];
+uint8_t modelRegs[128];
+uint16_t modelPhy[32];
+
+bool modelSelected = false;
+uint8_t modelOpcode;
+uint8_t modelByteIndex;
+
+uint64_t modelTimeNs = 0;
+uint64_t modelStatsBaseNs = 0;
+uint64_t modelTxDoneNs = 0;
+bool modelTxActive = false;
+uint64_t modelDmaDoneNs = 0;
+uint64_t modelCsumDoneNs = 0;
+
+uint8_t modelTxQueue[ENC28J60_MODEL_TX_QUEUE][1536];
+uint16_t modelTxSize[ENC28J60_MODEL_TX_QUEUE];
+uint8_t modelTxReadIndex = 0;
+uint8_t modelTxWriteIndex = 0;
+
+enc28j60ModelStats modelStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+uint8_t enc28j60ModelKey(uint8_t address)
+{
+    address &= 0x1F;
+    if (address >= 0x1B)
+        return address;
+    return ((modelRegs[ECON1] & 0x03) << 5) | address;
+}
+
+uint16_t enc28j60ModelGet16(uint8_t keyL)
+{
+    return (modelRegs[keyL] | (modelRegs[keyL + 1] << 8)) & 0x1FFF;
+}
+
+void enc28j60ModelSet16(uint8_t keyL, uint16_t value)
+{
+    modelRegs[keyL] = value & 0xFF;
+    modelRegs[keyL + 1] = (value >> 8) & 0x1F;
+}
+
+// Advances a pointer inside the receive buffer, wrapping from ERXND to ERXST
+uint16_t enc28j60ModelRxNext(uint16_t ptr)
+{
+    if (ptr == enc28j60ModelGet16(ERXNDL))
+        return enc28j60ModelGet16(ERXSTL);
+    return (ptr + 1) & (BUFFER_SIZE - 1);
+}
+
+// Retires the frame on the wire once its transmit time has elapsed
+void enc28j60ModelUpdateTx()
+{
+    if (modelTxActive && modelTimeNs >= modelTxDoneNs)
+    {
+        modelTxActive = false;
+        modelRegs[ECON1] &= ~TXRTS;
+        modelRegs[EIR] |= TXIF;
+    }
+}
+
+void enc28j60ModelStartTx()
+{
+    uint16_t start = enc28j60ModelGet16(ETXSTL);
+    uint16_t end = enc28j60ModelGet16(ETXNDL);
+    uint16_t size = (end - start) & (BUFFER_SIZE - 1);
+    uint16_t wire, i;
+    uint8_t next = (modelTxWriteIndex + 1) % ENC28J60_MODEL_TX_QUEUE;
+
+    // first byte at ETXST is the per-packet control byte
+    if (size > sizeof(modelTxQueue[0]))
+        size = sizeof(modelTxQueue[0]);
+    if (next != modelTxReadIndex)
+    {
+        for (i = 0; i < size; i++)
+            modelTxQueue[modelTxWriteIndex][i] = modelBuffer[(start + 1 + i) & (BUFFER_SIZE - 1)];
+        modelTxSize[modelTxWriteIndex] = size;
+        modelTxWriteIndex = next;
+    }
+
+    wire = (size < MIN_FRAME ? MIN_FRAME : size) + WIRE_OVERHEAD;
+    modelTxDoneNs = modelTimeNs + (uint64_t)wire * WIRE_BYTE_NS;
+    modelTxActive = true;
+    modelStats.txFrames++;
+}
+
+// Runs the DMA checksum engine over EDMAST..EDMAND
+// The result is ready at once, but DMAST stays set for the time the engine
+// takes to walk the range
+void enc28j60ModelStartChecksum()
+{
+    uint16_t ptr = enc28j60ModelGet16(EDMASTL);
+    uint16_t end = enc28j60ModelGet16(EDMANDL);
+    uint32_t sum = 0;
+    uint16_t count = 0;
+    bool high = true;
+
+    while (true)
+    {
+        sum += high ? (modelBuffer[ptr] << 8) : modelBuffer[ptr];
+        high = !high;
+        count++;
+        if (ptr == end)
+            break;
+        ptr = enc28j60ModelRxNext(ptr);
+    }
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = ~sum & 0xFFFF;
+    modelRegs[EDMACSL] = sum & 0xFF;
+    modelRegs[EDMACSH] = sum >> 8;
+    modelCsumDoneNs = modelTimeNs + (uint64_t)count * ENC28J60_MODEL_CSUM_NS;
+    modelStats.dmaChecksums++;
+}
+
+void enc28j60ModelUpdateChecksum()
+{
+    if ((modelRegs[ECON1] & DMAST) && modelTimeNs >= modelCsumDoneNs)
+    {
+        modelRegs[ECON1] &= ~DMAST;
+        modelRegs[EIR] |= DMAIF;
+    }
+}
+
+uint8_t enc28j60ModelReadReg(uint8_t key)
+{
+    if (key == ECON1 || key == EIR)
+    {
+        enc28j60ModelUpdateTx();
+        enc28j60ModelUpdateChecksum();
+    }
+    if (key == ECON1 && (modelRegs[ECON1] & TXRTS))
+        modelStats.txPolls++;
+    if (key == EIR)
+    {
+        // PKTIF mirrors EPKTCNT and cannot be cleared directly
+        if (modelRegs[EPKTCNT] != 0)
+            modelRegs[EIR] |= PKTIF;
+        else
+            modelRegs[EIR] &= ~PKTIF;
+    }
+    return modelRegs[key];
+}
+
+void enc28j60ModelWriteReg(uint8_t key, uint8_t value)
+{
+    uint8_t old = modelRegs[key];
+    modelRegs[key] = value;
+    switch (key)
+    {
+    case ECON1:
+        if ((value & TXRTS) && !(old & TXRTS))
+            enc28j60ModelStartTx();
+        else if (!(value & TXRTS))
+            modelTxActive = false;
+        if ((value & DMAST) && !(old & DMAST) && (value & CSUMEN))
+            enc28j60ModelStartChecksum();
+        break;
+    case ECON2:
+        if ((value & PKTDEC) && modelRegs[EPKTCNT] != 0)
+            modelRegs[EPKTCNT]--;
+        modelRegs[ECON2] &= ~PKTDEC;
+        break;
+    case ESTAT:
+        modelRegs[ESTAT] = old;
+        break;
+    case MICMD:
+        if (value & MIIRD)
+        {
+            modelRegs[MIRDL] = modelPhy[modelRegs[MIREGADR] & 0x1F] & 0xFF;
+            modelRegs[MIRDH] = modelPhy[modelRegs[MIREGADR] & 0x1F] >> 8;
+        }
+        break;
+    case MIWRH:
+        modelPhy[modelRegs[MIREGADR] & 0x1F] = modelRegs[MIWRL] | (value << 8);
+        break;
+    default:
+        break;
+    }
+}
+
+// Puts the model into its power-on state
+void enc28j60ModelInit()
+{
+    uint16_t i;
+    for (i = 0; i < sizeof(modelRegs); i++)
+        modelRegs[i] = 0;
+    for (i = 0; i < 32; i++)
+        modelPhy[i] = 0;
+    enc28j60ModelSet16(ERXNDL, 0x1FFF);
+    enc28j60ModelSet16(ERXRDPTL, 0x1FFA);
+    modelRegs[ESTAT] = CLKRDY;
+    modelRegs[ECON2] = AUTOINC;
+    modelPhy[PHSTAT1] = LSTAT;
+    modelSelected = false;
+    modelTxActive = false;
+    modelTxReadIndex = modelTxWriteIndex = 0;
+    enc28j60ModelResetStats();
+}
+
+// Asserts ~CS, starting a new SPI transaction
+void enc28j60ModelSelect()
+{
+    modelSelected = true;
+    modelByteIndex = 0;
+    modelStats.spiTransactions++;
+}
+
+// Deasserts ~CS
+void enc28j60ModelDeselect()
+{
+    modelSelected = false;
+}
+
+// Clocks one byte in each direction
+uint8_t enc28j60ModelTransfer(uint8_t data)
+{
+    uint8_t result = 0;
+    uint16_t ptr;
+
+    modelTimeNs += SPI_BYTE_NS;
+    modelStats.spiBytes++;
+    if (!modelSelected)
+        return 0xFF;
+    if (modelByteIndex == 0)
+    {
+        modelOpcode = data;
+        modelByteIndex = 1;
+        if ((data >> 5) == OP_SRC)
+            enc28j60ModelInit();
+        return 0;
+    }
+    switch (modelOpcode >> 5)
+    {
+    case OP_RCR:
+        result = enc28j60ModelReadReg(enc28j60ModelKey(modelOpcode));
+        break;
+    case OP_RBM:
+        ptr = enc28j60ModelGet16(ERDPTL);
+        result = modelBuffer[ptr];
+        enc28j60ModelSet16(ERDPTL, enc28j60ModelRxNext(ptr));
+        break;
+    case OP_WCR:
+        enc28j60ModelWriteReg(enc28j60ModelKey(modelOpcode), data);
+        break;
+    case OP_WBM:
+        ptr = enc28j60ModelGet16(EWRPTL);
+        modelBuffer[ptr] = data;
+        enc28j60ModelSet16(EWRPTL, (ptr + 1) & (BUFFER_SIZE - 1));
+        break;
+    case OP_BFS:
+        if (enc28j60ModelKey(modelOpcode) == ECON1 && (data & 0x03))
+            modelStats.bankSelects++;
+        enc28j60ModelWriteReg(enc28j60ModelKey(modelOpcode), modelRegs[enc28j60ModelKey(modelOpcode)] | data);
+        break;
+    case OP_BFC:
+        if (enc28j60ModelKey(modelOpcode) == ECON1 && (data & 0x03))
+            modelStats.bankSelects++;
+        enc28j60ModelWriteReg(enc28j60ModelKey(modelOpcode), modelRegs[enc28j60ModelKey(modelOpcode)] & ~data);
+        break;
+    default:
+        break;
+    }
+    return result;
+}
+
+// Delivers a frame from the wire into the receive buffer
+// Returns false if reception is disabled or the frame did not fit
+bool enc28j60ModelReceive(const uint8_t frame[], uint16_t size)
+{
+    uint16_t rxStart = enc28j60ModelGet16(ERXSTL);
+    uint16_t rxEnd = enc28j60ModelGet16(ERXNDL);
+    uint16_t wr = enc28j60ModelGet16(ERXWRPTL);
+    uint16_t rd = enc28j60ModelGet16(ERXRDPTL);
+    uint16_t bufferSize = rxEnd - rxStart + 1;
+    uint16_t count = size + 4;                      // byte count includes crc
+    uint16_t needed = (6 + count + 1) & ~1;         // packets start on even addresses
+    uint16_t free, next, i;
+    uint8_t header[6];
+
+    if (!(modelRegs[ECON1] & RXEN))
+        return false;
+    free = (wr < rd) ? (rd - wr) : (bufferSize - (wr - rd));
+    if (needed >= free || modelRegs[EPKTCNT] == 0xFF)
+    {
+        modelRegs[EIR] |= RXERIF;
+        modelStats.rxDropped++;
+        return false;
+    }
+
+    next = wr;
+    for (i = 0; i < needed; i++)
+        next = enc28j60ModelRxNext(next);
+    header[0] = next & 0xFF;
+    header[1] = next >> 8;
+    header[2] = count & 0xFF;
+    header[3] = count >> 8;
+    header[4] = 0x80;                               // received ok (bit 23)
+    header[5] = 0x00;
+    for (i = 0; i < 6; i++)
+    {
+        modelBuffer[wr] = header[i];
+        wr = enc28j60ModelRxNext(wr);
+    }
+    for (i = 0; i < count; i++)
+    {
+        modelBuffer[wr] = (i < size) ? frame[i] : 0;
+        wr = enc28j60ModelRxNext(wr);
+    }
+    enc28j60ModelSet16(ERXWRPTL, next);
+    modelRegs[EPKTCNT]++;
+    modelRegs[EIR] |= PKTIF;
+    modelStats.rxFrames++;
+    return true;
+}
+
+// Returns the oldest transmitted frame (without control byte) or 0 if none
+uint16_t enc28j60ModelGetTxPacket(uint8_t frame[], uint16_t maxSize)
+{
+    uint16_t i, size;
+    if (modelTxReadIndex == modelTxWriteIndex)
+        return 0;
+    size = modelTxSize[modelTxReadIndex];
+    if (size > maxSize)
+        size = maxSize;
+    for (i = 0; i < size; i++)
+        frame[i] = modelTxQueue[modelTxReadIndex][i];
+    modelTxReadIndex = (modelTxReadIndex + 1) % ENC28J60_MODEL_TX_QUEUE;
+    return size;
+}
+
+// Returns the level of the active-low INT pin as asserted (true) or not
+bool enc28j60ModelIsIntActive()
+{
+    uint8_t flags = modelRegs[EIR];
+    if (modelRegs[EPKTCNT] != 0)
+        flags |= PKTIF;
+    else
+        flags &= ~PKTIF;
+    return (modelRegs[EIE] & INTIE) && (flags & modelRegs[EIE] & 0x7B);
+}
+
+// Lets simulated time pass outside of SPI traffic (eg. waitMicrosecond)
+void enc28j60ModelAdvanceTime(uint32_t us)
+{
+    modelTimeNs += (uint64_t)us * 1000;
+}
+
+void enc28j60ModelAdvanceNs(uint32_t ns)
+{
+    modelTimeNs += ns;
+}
+
+uint64_t enc28j60ModelGetTimeNs()
+{
+    return modelTimeNs;
+}
+
+// Moves a block over SPI as uDMA would
+// The bytes are exchanged at once, but the transfer only completes once the
+// simulated time for clocking them has passed, so the caller can overlap work
+void enc28j60ModelStartDma(uint8_t rx[], const uint8_t tx[], uint16_t size)
+{
+    uint64_t start = modelTimeNs;
+    uint16_t i;
+    uint8_t data;
+    for (i = 0; i < size; i++)
+    {
+        data = enc28j60ModelTransfer(tx ? tx[i] : 0);
+        if (rx)
+            rx[i] = data;
+    }
+    modelDmaDoneNs = modelTimeNs;
+    modelTimeNs = start;
+    modelStats.dmaTransfers++;
+}
+
+bool enc28j60ModelIsDmaBusy()
+{
+    if (modelTimeNs >= modelDmaDoneNs)
+        return false;
+    modelTimeNs += ENC28J60_MODEL_DMA_POLL_NS;
+    modelStats.dmaPolls++;
+    return true;
+}
+
+void enc28j60ModelGetStats(enc28j60ModelStats* stats)
+{
+    *stats = modelStats;
+    stats->timeUs = (modelTimeNs - modelStatsBaseNs) / 1000;
+}
+
+void enc28j60ModelResetStats()
+{
+    modelStats.spiBytes = 0;
+    modelStats.spiTransactions = 0;
+    modelStats.rxFrames = 0;
+    modelStats.rxDropped = 0;
+    modelStats.txFrames = 0;
+    modelStats.txPolls = 0;
+    modelStats.dmaTransfers = 0;
+    modelStats.dmaPolls = 0;
+    modelStats.dmaChecksums = 0;
+    modelStats.bankSelects = 0;
+    modelStats.timeUs = 0;
+    modelStatsBaseNs = modelTimeNs;
+}
+
+#endif
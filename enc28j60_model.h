@@ -0,0 +1,78 @@
+// ENC28J60 Software Model
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: Host (Linux) build of the eth0 library
+// Target uC:       -
+// System Clock:    -
+
+// Model configuration:
+// Built when ENC28J60_MODEL is defined; spi0.c then routes writeSpi0Data()
+//   and readSpi0Data() into enc28j60ModelTransfer() and eth0.c drives ~CS
+//   through enc28j60ModelSelect() / enc28j60ModelDeselect()
+// 8K buffer, 4 register banks, PHY registers, ERXRDPT/ERXWRPT, EPKTCNT,
+//   ECON1.TXRTS, the DMA checksum engine and EIR flags are modeled
+// Time is simulated: each SPI byte costs 8 SCLK periods at
+//   ENC28J60_MODEL_SPI_HZ and each transmitted frame holds TXRTS for its
+//   wire time at 10 Mbps
+// The INT pin is reported by enc28j60ModelIsIntActive(); a host driver calls
+//   etherIsr() while it is asserted
+// The CCS target build never defines ENC28J60_MODEL, so the model compiles
+//   to nothing there and costs no flash or SRAM
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef ENC28J60_MODEL_H_
+#define ENC28J60_MODEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ENC28J60_MODEL_SPI_HZ  4000000
+#define ENC28J60_MODEL_SPI_GAP_NS 750    // idle SCLK between single-byte transfers
+#define ENC28J60_MODEL_DMA_POLL_NS 250   // cost of one isSpi0DmaBusy() poll
+#define ENC28J60_MODEL_TX_QUEUE 8     // sent frames held for enc28j60ModelGetTxPacket()
+#define ENC28J60_MODEL_CSUM_NS 80        // assumed DMA checksum time per byte
+
+typedef struct _enc28j60ModelStats
+{
+    uint32_t spiBytes;            // bytes clocked over SPI
+    uint32_t spiTransactions;     // ~CS assertions
+    uint32_t rxFrames;            // frames accepted into the rx buffer
+    uint32_t rxDropped;           // frames lost to rx buffer overflow
+    uint32_t txFrames;            // frames sent by TXRTS
+    uint32_t txPolls;             // ECON1 reads while TXRTS was still set
+    uint32_t dmaTransfers;        // uDMA block transfers started
+    uint32_t dmaPolls;            // busy polls while a uDMA transfer streamed
+    uint32_t dmaChecksums;        // DMA checksum engine runs
+    uint32_t bankSelects;         // ECON1 BFC/BFS transactions touching BSEL
+    uint32_t timeUs;              // simulated time
+} enc28j60ModelStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void enc28j60ModelInit();
+void enc28j60ModelSelect();
+void enc28j60ModelDeselect();
+uint8_t enc28j60ModelTransfer(uint8_t data);
+
+bool enc28j60ModelReceive(const uint8_t frame[], uint16_t size);
+uint16_t enc28j60ModelGetTxPacket(uint8_t frame[], uint16_t maxSize);
+bool enc28j60ModelIsIntActive();
+void enc28j60ModelAdvanceTime(uint32_t us);
+void enc28j60ModelAdvanceNs(uint32_t ns);
+uint64_t enc28j60ModelGetTimeNs();
+
+void enc28j60ModelStartDma(uint8_t rx[], const uint8_t tx[], uint16_t size);
+bool enc28j60ModelIsDmaBusy();
+
+void enc28j60ModelGetStats(enc28j60ModelStats* stats);
+void enc28j60ModelResetStats();
+
+#endif
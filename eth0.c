@@ -25,13 +25,18 @@
 #include <eth0.h>
 #include <stdint.h>
 #include <stdbool.h>
+#ifdef ENC28J60_MODEL
+#include "enc28j60_model.h"
+#else
 #include "tm4c123gh6pm.h"
+#endif
 #include "uart0.h"
 #include "wait.h"
 #include "gpio.h"
 #include "spi0.h"
 #include "eeprom.h"
 #include "str.h"
+#include "timer.h"
 
 // Pins
 #define CS PORTA,3
@@ -55,7 +60,17 @@
 #define ERXRDPTH    0x0D
 #define ERXWRPTL    0x0E
 #define ERXWRPTH    0x0F
+#define EDMASTL     0x10
+#define EDMASTH     0x11
+#define EDMANDL     0x12
+#define EDMANDH     0x13
+#define EDMACSL     0x16
+#define EDMACSH     0x17
 #define EIE         0x1B
+#define RXERIE  0x01
+#define TXIE    0x08
+#define PKTIE   0x40
+#define INTIE   0x80
 #define EIR         0x1C
 #define RXERIF  0x01
 #define TXERIF  0x02
@@ -69,6 +84,9 @@
 #define ECON1       0x1F
 #define RXEN    0x04
 #define TXRTS   0x08
+#define CSUMEN  0x10
+#define DMAST   0x20
+#define TXRST   0x80
 #define ERXFCON     0x38
 #define EPKTCNT     0x39
 #define MACON1      0x40
@@ -107,6 +125,9 @@
 #define MIBUSY  0x01
 #define ECOCON      0x75
 
+// Receive status vector, bits 16-31
+#define RXOK   0x0080
+
 // Ether phy registers
 #define PHCON1      0x00
 #define PDPXMD 0x0100
@@ -146,7 +167,17 @@ uint8_t ip_tcp         = 0x06;
 #define DHCPMESSAGE 53
 #define SERVERID 54
 #define PARAMETER_REQUEST 55
+#define T1_CODE 58
+#define T2_CODE 59
+#define RAPID_COMMIT 80
 #define END 255
+#define DHCP_OPTIONS_SIZE  60                          // options sent, padded to a 300-byte message
+#define DHCP_RETRY_MIN     4000                        // ms before the first retransmission
+#define DHCP_RETRY_MAX     64000
+#define DHCP_REQUEST_TRIES 4                           // requests for an offer before starting over
+#define DHCP_RENEW_MIN     60                          // s, shortest wait between renewal requests
+#define DHCP_INFINITE      0xFFFFFFFF
+#define DHCP_SERVICE_INTERVAL 100                      // ms between runs of dhcpService()
 
 //
 // ------------------------------------------------------------------------------
@@ -155,27 +186,79 @@ uint8_t ip_tcp         = 0x06;
 uint8_t nextPacketLsb = 0x00;
 uint8_t nextPacketMsb = 0x00;
 uint8_t sequenceId = 1;
-uint32_t sum;
 uint8_t macAddress[HW_ADD_LENGTH] = {2,3,4,5,6,7};
 uint8_t ipAddress[IP_ADD_LENGTH] = {0,0,0,0};
 uint8_t ipSubnetMask[IP_ADD_LENGTH] = {255,255,255,0};
 uint8_t ipGwAddress[IP_ADD_LENGTH] = {0,0,0,0};
 uint8_t ipDnsServer[IP_ADD_LENGTH] = {0, 0, 0, 0};
 uint8_t ipDhcpServer[IP_ADD_LENGTH] = {0, 0, 0, 0};
-uint32_t transaction_id = 0x10101010; //can be randomly generated; constant is chosen
-uint8_t siaddr[4] = {0,0,0,0};
-uint8_t yiaddr[4] = {0,0,0,0};
-bool si_yi_clear = true;
-uint32_t lease_time;
-
-
-
-uint8_t tcp_flags;
-uint32_t seq_num = 0;
-uint32_t ack_num = 0;
-char telnet_command[80];
-bool command_pending = false;
-uint8_t command_iterator = 0;
+uint32_t transaction_id = 0x10101010;
+uint8_t yiaddr[4] = {0,0,0,0};              // address offered
+uint32_t lease_time;                        // s
+uint8_t dhcpClientState = DHCP_OFF;
+uint32_t dhcpSeed = 0x7147;
+uint32_t dhcpSeconds = 0;                   // clock for the lease timers
+uint32_t dhcpTickMs = 0;                    // ms time dhcpSeconds last advanced
+uint32_t dhcpStartSeconds = 0;              // start of the exchange, for secs
+uint32_t dhcpRequestSeconds = 0;            // request the next lease will run from
+uint32_t dhcpLeaseStart = 0;                // dhcpSeconds the lease runs from
+uint32_t dhcpT1, dhcpT2;                    // s from dhcpLeaseStart
+uint32_t dhcpRetryStart = 0;                // ms time of the last transmission
+uint32_t dhcpRetryTimeout = 0;              // ms until the next
+uint8_t dhcpTries = 0;
+bool dhcpLinkUp = false;
+bool dhcpLinkPending = false;               // PHSTAT1 read started, not yet collected
+timerEvent dhcpTimer;
+// The options the client reads from an ack, requested in every discover and
+// request so the server sends no others
+const uint8_t dhcpRequestList[] = {SN_MASK_CODE, GW_CODE, DNS_CODE, T1_CODE, T2_CODE};
+
+// SPI0 carries one uDMA transfer at a time
+etherTransfer etherDmaTransfer = {0, 0, false, false, false, false};
+
+// Receive ring filled by etherIsr()
+// Frames are stored contiguously in rxRingData, word aligned, and described
+// by rxRing; indices run freely and are masked with ETHER_RX_RING_FRAMES - 1
+// Descriptors between release and read have been handed out but not released
+#define RX_RING_MASK (ETHER_RX_RING_FRAMES - 1)
+#define RX_RING_FULL 0xFFFF
+#define MAX_RX_PACKET 1522
+etherPacket rxRing[ETHER_RX_RING_FRAMES];
+#ifndef ENC28J60_MODEL
+#pragma DATA_ALIGN(rxRingData, 4)
+#endif
+uint8_t rxRingData[ETHER_RX_RING_BYTES];
+volatile uint8_t rxRingWrite = 0;
+volatile uint8_t rxRingRead = 0;
+volatile uint8_t rxRingRelease = 0;
+uint16_t rxRingOffset = 0;
+volatile bool rxRingStalled = false;
+volatile uint32_t rxOverflowCount = 0;
+bool rxIntEnabled = false;
+bool etherInIsr = false;
+uint8_t rxDmaBank = 0;                   // bank to restore once a ring read finishes
+uint16_t rxPacketPtr = 0x0000;
+bool rxChecksumOffload = false;
+volatile uint32_t rxChecksumDropCount = 0;
+uint8_t etherLockDepth = 0;
+uint8_t etherBank = 0;                   // shadow of ECON1.BSEL
+bool phyReadPending = false;             // MII read started by etherStartReadPhy()
+#define LED_FLASH_TIME 100               // ms the leds flash at initialization
+timerEvent ledFlashTimer;
+
+// Transmit slots
+// A frame is staged into one slot while the other is on the wire; slots are
+// used in turn starting at txSlotHead, the oldest queued frame
+#define RX_BUFFER_END   0x13FF
+#define TX_BUFFER_START 0x1400
+#define TX_SLOTS        2
+#define TX_SLOT_SIZE    0x0600           // control byte, frame and status vector
+uint16_t txSlotSize[TX_SLOTS];
+volatile uint8_t txSlotHead = 0;
+volatile uint8_t txSlotCount = 0;        // frames staged or on the wire
+volatile bool txActive = false;          // the frame at txSlotHead is on the wire
+volatile uint32_t txAbortCount = 0;
+uint16_t txOpenSize;                   // bytes written by etherWritePacket()
 // ------------------------------------------------------------------------------
 //  Structures
 // ------------------------------------------------------------------------------
@@ -262,6 +345,21 @@ typedef struct _dhcpFrame
   uint32_t magicCookie;
   uint8_t options [0];
 } dhcpFrame;
+// Options of a received dhcp message that the client uses, decoded in one
+// pass; an address that was absent is left 0.0.0.0 and a time 0
+typedef struct _dhcpOptions
+{
+    uint8_t type;
+    bool rapidCommit;
+    uint8_t serverId[4];
+    uint8_t mask[4];
+    uint8_t router[4];
+    uint8_t dns[4];
+    uint32_t lease;
+    uint32_t t1;
+    uint32_t t2;
+} dhcpOptions;
+
 typedef struct _tcpFrame //20 bytes
 {
     uint16_t sourcePort;
@@ -276,28 +374,262 @@ typedef struct _tcpFrame //20 bytes
 
 }tcpFrame;
 const uint8_t dhcpSize = sizeof(dhcpFrame);
+const uint8_t etherHeaderLength = 14;
 const uint8_t ipHeaderLength = 20;
 const uint8_t  udpHeaderLength = 8;
+
+// ARP cache
+#define ARP_HASH_SIZE      ARP_CACHE_SIZE              // must be a power of 2
+#define ARP_NONE           0xFF
+
+typedef enum _arpState
+{
+    ARP_FREE,
+    ARP_PENDING,                         // request sent, no reply yet
+    ARP_RESOLVED
+} arpState;
+
+typedef struct _arpEntry
+{
+    uint8_t state;
+    uint8_t hashNext;                    // next entry in the hash bucket
+    uint8_t ip[IP_ADD_LENGTH];
+    uint8_t mac[HW_ADD_LENGTH];
+    uint8_t tries;                       // requests sent since the last reply
+    bool used;                           // looked up since the last reply
+    uint32_t time;                       // time of the last reply, or the last request while pending
+    uint8_t queueHead;                   // first held frame, or ARP_NONE
+} arpEntry;
+
+// A frame held for an entry that is being resolved
+typedef struct _arpQueued
+{
+    uint8_t next;                        // next frame held for the same entry
+    uint16_t size;                       // 0 when the slot is free
+    uint8_t data[ARP_QUEUE_FRAME_SIZE];
+} arpQueued;
+
+arpEntry arpEntries[ARP_CACHE_SIZE];
+uint8_t arpHashHead[ARP_HASH_SIZE];
+arpQueued arpQueue[ARP_QUEUE_FRAMES];
+uint32_t arpDropCount = 0;
+timerEvent arpTimer;
+uint16_t ipId = 0;
+
+// TCP
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_HASH_SIZE      (2 * TCP_MAX_CONNECTIONS)   // must be a power of 2
+#define TCP_RX_MSS         1460                        // advertised in syn/ack
+#define TCP_TX_MSS         1460                        // largest segment sent
+#define TCP_DEFAULT_MSS    536                         // when the syn has no mss option
+#define TCP_WINDOW         TCP_RX_BUFFER               // in-order data is consumed at once
+#define TCP_COMMAND_LENGTH 80
+#define TCP_ACK_DELAY      100                         // ms a pure ack waits for data to ride on
+#define TCP_TX_CHUNKS      8                           // runs of data queued per connection
+#define TCP_COOKIE_SHIFT   16                          // a cookie time slot is 2^16 ms
+
+// Sequence number comparisons (modulo 2^32)
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+
+// Events fed to the state machine, taken from a segment in this order
+enum tcpEvent
+{
+    TCP_EVENT_SYN,
+    TCP_EVENT_ACK,                       // everything sent has been acked
+    TCP_EVENT_FIN,                       // in-order fin
+    TCP_EVENT_RST,
+    TCP_EVENT_CLOSE,                     // local close
+    TCP_EVENT_COUNT
+};
+
+enum tcpAction
+{
+    TCP_NONE,
+    TCP_SEND_SYNACK,
+    TCP_SEND_ACK,
+    TCP_SEND_FIN,
+    TCP_FREE
+};
+
+// A run of queued data, either referenced where it lies (e.g. a constant in
+// flash) or copied into the connection's ring when data is 0
+typedef struct _tcpChunk
+{
+    const uint8_t* data;
+    uint16_t size;
+} tcpChunk;
+
+// A run of out-of-order data held in a connection's receive buffer
+typedef struct _tcpRange
+{
+    uint32_t seq;
+    uint16_t size;
+} tcpRange;
+
+typedef struct _tcpTransition
+{
+    uint8_t next;
+    uint8_t action;
+} tcpTransition;
+
+// Connection control block
+typedef struct _tcpConnection
+{
+    uint8_t state;
+    uint8_t hashNext;                    // next connection in the hash bucket
+    uint8_t remoteIp[IP_ADD_LENGTH];
+    uint8_t remoteMac[HW_ADD_LENGTH];
+    uint16_t remotePort;
+    uint16_t localPort;
+    uint32_t iss;                        // initial send sequence number
+    uint32_t sndUna;                     // oldest unacknowledged sequence number
+    uint32_t sndNxt;                     // next sequence number to send
+    uint32_t sndMax;                     // highest sequence number sent
+    uint32_t rcvNxt;                     // next sequence number expected
+    uint16_t sndWnd;                     // window advertised by the peer
+    uint16_t mss;                        // largest segment the peer accepts
+    uint32_t txCount;                    // bytes queued from sndUna on
+    uint16_t txStart;                    // index of the oldest byte in txBuffer
+    uint16_t txBuffered;                 // bytes held in txBuffer
+    uint8_t txChunkHead;
+    uint8_t txChunkCount;
+    tcpChunk txChunks[TCP_TX_CHUNKS];    // the queue, in sequence order
+    uint32_t rtoStart;                   // time the retransmit timer was started
+    uint32_t rttStart;                   // time rttSeq was sent
+    uint32_t rttSeq;                     // sequence number being timed
+    uint32_t srtt;                       // smoothed rtt in ms, scaled by 8
+    uint32_t rttvar;                     // rtt variation in ms, scaled by 4
+    uint16_t rto;                        // retransmission timeout in ms
+    bool rttValid;                       // srtt and rttvar hold a sample
+    bool rttTiming;
+    bool finSent;
+    bool ackPending;                     // received data not acknowledged yet
+    uint32_t ackStart;                   // time the oldest unacknowledged data arrived
+    uint8_t retries;                     // timeouts since data was last acked
+    uint32_t rxTime;                     // time a segment last arrived
+    uint8_t probes;                      // keepalive probes since then
+    uint16_t retransmits;
+    uint8_t commandLength;
+    bool commandPending;
+    char command[TCP_COMMAND_LENGTH];    // telnet command line
+    uint8_t txBuffer[TCP_TX_BUFFER];     // ring of copied data
+    uint8_t rxRangeCount;
+    tcpRange rxRanges[TCP_RX_RANGES];    // held runs past rcvNxt, in sequence order
+    uint8_t rxBuffer[TCP_RX_BUFFER];     // out-of-order data, indexed by sequence number
+} tcpConnection;
+
+// RFC 793 state machine for a passive (listening) end
+// A fin received while established is answered with fin/ack at once, as there
+// is nothing left to send, so CLOSE_WAIT is only left by a local close
+// The listener is tcpListenPort rather than a control block: SYNs there are
+// answered with a cookie and a block is only allocated in SYN_RCVD, so no
+// block is ever in LISTEN and its row is never used
+#define T(state, action) {TCP_##state, TCP_##action}
+const tcpTransition tcpTransitions[TCP_STATE_COUNT][TCP_EVENT_COUNT] =
+{
+    //              SYN                         ACK                         FIN                         RST                     CLOSE
+    /* CLOSED */  { T(CLOSED, NONE),           T(CLOSED, NONE),           T(CLOSED, NONE),           T(CLOSED, NONE),        T(CLOSED, NONE) },
+    /* LISTEN */  { T(LISTEN, NONE),           T(LISTEN, NONE),           T(LISTEN, NONE),           T(LISTEN, NONE),        T(LISTEN, NONE) },
+    /* SYN_SENT */{ T(SYN_SENT, NONE),         T(SYN_SENT, NONE),         T(SYN_SENT, NONE),         T(CLOSED, FREE),        T(CLOSED, FREE) },
+    /* SYN_RCVD */{ T(SYN_RCVD, SEND_SYNACK),  T(ESTABLISHED, NONE),      T(LAST_ACK, SEND_FIN),     T(CLOSED, FREE),        T(FIN_WAIT_1, SEND_FIN) },
+    /* ESTAB */   { T(ESTABLISHED, SEND_ACK),  T(ESTABLISHED, NONE),      T(LAST_ACK, SEND_FIN),     T(CLOSED, FREE),        T(FIN_WAIT_1, SEND_FIN) },
+    /* FIN_W_1 */ { T(FIN_WAIT_1, SEND_ACK),   T(FIN_WAIT_2, NONE),       T(CLOSING, SEND_ACK),      T(CLOSED, FREE),        T(FIN_WAIT_1, NONE) },
+    /* FIN_W_2 */ { T(FIN_WAIT_2, SEND_ACK),   T(FIN_WAIT_2, NONE),       T(TIME_WAIT, SEND_ACK),    T(CLOSED, FREE),        T(FIN_WAIT_2, NONE) },
+    /* CLOSE_W */ { T(CLOSE_WAIT, SEND_ACK),   T(CLOSE_WAIT, NONE),       T(CLOSE_WAIT, SEND_ACK),   T(CLOSED, FREE),        T(LAST_ACK, SEND_FIN) },
+    /* CLOSING */ { T(CLOSING, SEND_ACK),      T(TIME_WAIT, NONE),        T(CLOSING, SEND_ACK),      T(CLOSED, FREE),        T(CLOSING, NONE) },
+    /* LAST_ACK */{ T(LAST_ACK, SEND_ACK),     T(CLOSED, FREE),           T(LAST_ACK, SEND_ACK),     T(CLOSED, FREE),        T(LAST_ACK, NONE) },
+    /* TIME_W */  { T(TIME_WAIT, SEND_ACK),    T(TIME_WAIT, NONE),        T(TIME_WAIT, SEND_ACK),    T(CLOSED, FREE),        T(TIME_WAIT, NONE) },
+};
+#undef T
+
+tcpConnection tcpConnections[TCP_MAX_CONNECTIONS];
+uint8_t tcpHashHead[TCP_HASH_SIZE];
+uint8_t tcpTxData[14 + 20 + 24];    // ether, ip and tcp headers with mss option
+uint16_t tcpListenPort = 0;
+// Cookie keys for even and odd time slots, each drawn from tcpCookiePool the
+// first time its slot is seen, so a cookie dies with the slot after its own
+uint32_t tcpCookieKeys[2][2];
+uint32_t tcpCookieKeySlot[2];
+bool tcpCookieKeyValid[2] = {false, false};
+uint32_t tcpCookiePool = 0;
+timerEvent tcpCookieTimer;
+// MSS values a SYN cookie can carry, indexed by 3 bits
+const uint16_t tcpCookieMss[8] = {536, 1024, 1200, 1300, 1360, 1400, 1440, 1460};
+uint32_t tcpRetransmitCount = 0;
+timerEvent tcpTimer;
+tcpReclaimStats tcpReclaim;
+uint32_t tcpKeepaliveIdle = TCP_KEEPALIVE_IDLE;
+uint32_t tcpKeepaliveInterval = TCP_KEEPALIVE_INTERVAL;
+uint8_t tcpKeepaliveProbes = TCP_KEEPALIVE_PROBES;
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
 // Buffer is configured as follows
-// Receive buffer starts at 0x0000 (bottom 6666 bytes of 8K space)
-// Transmit buffer at 01A0A (top 1526 bytes of 8K space)
+// Receive buffer starts at 0x0000 (bottom 5120 bytes of 8K space)
+// Transmit slots at 0x1400 and 0x1A00 (top 3072 bytes of 8K space)
+
+// Keeps etherIsr() off the bus while other code has ~CS asserted or is
+// updating state shared with it
+// Calls nest; an INT edge during that time stays pending and is taken on release
+void etherLockIsr()
+{
+    if (etherInIsr)
+        return;
+#ifndef ENC28J60_MODEL
+    if (rxIntEnabled && etherLockDepth == 0)
+        NVIC_DIS0_R = 1 << (INT_GPIOC - 16);
+#endif
+    etherLockDepth++;
+}
+
+void etherUnlockIsr()
+{
+    if (etherInIsr)
+        return;
+    etherLockDepth--;
+#ifndef ENC28J60_MODEL
+    if (rxIntEnabled && etherLockDepth == 0)
+        NVIC_EN0_R = 1 << (INT_GPIOC - 16);
+#endif
+}
 
 void etherCsOn()
 {
+    // the bus belongs to the uDMA until its transfer is finished
+    if (etherDmaTransfer.pending && etherDmaTransfer.toRing)
+    {
+        while (isSpi0DmaBusy());
+        etherCompleteRxDma();
+    }
+    else if (etherDmaTransfer.pending)
+        etherWaitTransfer(&etherDmaTransfer);
+    etherLockIsr();
+#ifdef ENC28J60_MODEL
+    enc28j60ModelSelect();
+#else
     setPinValue(CS, 0);
     __asm (" NOP");                    // allow line to settle
     __asm (" NOP");
     __asm (" NOP");
     __asm (" NOP");
+#endif
 }
 
 void etherCsOff()
 {
+#ifdef ENC28J60_MODEL
+    enc28j60ModelDeselect();
+#else
     setPinValue(CS, 1);
+#endif
+    etherUnlockIsr();
 }
 
 void etherWriteReg(uint8_t reg, uint8_t data)
@@ -342,10 +674,30 @@ void etherClearReg(uint8_t reg, uint8_t mask)
     etherCsOff();
 }
 
+// Returns true if the register is mapped in every bank
+// EIE, EIR, ESTAT, ECON2 and ECON1 sit at 0x1B-0x1F of all four banks
+bool etherIsCommonReg(uint8_t reg)
+{
+    return (reg & 0x1F) >= EIE;
+}
+
+// Selects the bank holding reg
+// The selected bank is shadowed in etherBank, so nothing is sent when it is
+// already selected or reg is a common register; otherwise only the bank
+// select bits that differ are cleared and set
 void etherSetBank(uint8_t reg)
 {
-    etherClearReg(ECON1, 0x03);
-    etherSetReg(ECON1, reg >> 5);
+    uint8_t bank = (reg >> 5) & 0x03;
+    if (etherIsCommonReg(reg) || bank == etherBank)
+        return;
+    // etherIsr() saves and restores the shadow, so keep it in step with ECON1
+    etherLockIsr();
+    if ((etherBank & ~bank) != 0)
+        etherClearReg(ECON1, etherBank & ~bank);
+    if ((bank & ~etherBank) != 0)
+        etherSetReg(ECON1, bank & ~etherBank);
+    etherBank = bank;
+    etherUnlockIsr();
 }
 
 void etherWritePhy(uint8_t reg, uint16_t data)
@@ -356,20 +708,45 @@ void etherWritePhy(uint8_t reg, uint16_t data)
     etherWriteReg(MIWRH, (data >> 8) & 0xFF);
 }
 
-uint16_t etherReadPhy(uint8_t reg)
+// Starts reading a phy register and returns at once
+// The MII takes 10.24 us; etherGetPhyResult() collects the value
+void etherStartReadPhy(uint8_t reg)
 {
-    uint16_t data, dataH;
     etherSetBank(MIREGADR);
     etherWriteReg(MIREGADR, reg);
     etherWriteReg(MICMD, MIIRD);
-    waitMicrosecond(11);
+    phyReadPending = true;
+}
+
+// Returns true with the value of the read started by etherStartReadPhy(),
+// or false while the MII is still busy or if no read is pending
+// Call no sooner than 10.24 us after the start, before which MIBUSY may not
+// be set yet
+bool etherGetPhyResult(uint16_t* data)
+{
+    uint16_t dataH;
+    if (!phyReadPending)
+        return false;
     etherSetBank(MISTAT);
-    while ((etherReadReg(MISTAT) & MIBUSY) != 0);
+    if ((etherReadReg(MISTAT) & MIBUSY) != 0)
+        return false;
     etherSetBank(MICMD);
     etherWriteReg(MICMD, 0);
-    data = etherReadReg(MIRDL);
+    *data = etherReadReg(MIRDL);
     dataH = etherReadReg(MIRDH);
-    data |= (dataH << 8);
+    *data |= (dataH << 8);
+    phyReadPending = false;
+    return true;
+}
+
+// Blocking read, for initialization and the shell
+// A read started by etherStartReadPhy() is abandoned
+uint16_t etherReadPhy(uint8_t reg)
+{
+    uint16_t data;
+    etherStartReadPhy(reg);
+    waitMicrosecond(11);
+    while (!etherGetPhyResult(&data));
     return data;
 }
 
@@ -409,6 +786,14 @@ void etherReadMemStop()
     etherCsOff();
 }
 
+// Ends the led flash of etherInit()
+void etherLedFlashTimeout()
+{
+    // set LEDA (link status) and LEDB (tx/rx activity)
+    // stretch LED on to 40ms (default)
+    etherWritePhy(PHLCON, 0x0472);
+}
+
 // Initializes ethernet device
 // Uses order suggested in Chapter 6 of datasheet except 6.4 OST which is first here
 void etherInit(uint16_t mode)
@@ -417,6 +802,7 @@ void etherInit(uint16_t mode)
     initSpi0(USE_SSI0_RX);
     setSpi0BaudRate(4e6, 40e6);
     setSpi0Mode(0, 0);
+    initSpi0Dma();
 
     // Enable clocks
     enablePort(PORTA);
@@ -431,6 +817,10 @@ void etherInit(uint16_t mode)
     // make sure that oscillator start-up timer has expired
     while ((etherReadReg(ESTAT) & CLKRDY) == 0) {}
 
+    // start from bank 0 so the bank shadow matches ECON1
+    etherClearReg(ECON1, 0x03);
+    etherBank = 0;
+
     // disable transmission and reception of packets
     etherClearReg(ECON1, RXEN);
     etherClearReg(ECON1, TXRTS);
@@ -439,17 +829,23 @@ void etherInit(uint16_t mode)
     etherSetBank(ERXSTL);
     etherWriteReg(ERXSTL, LOBYTE(0x0000));
     etherWriteReg(ERXSTH, HIBYTE(0x0000));
-    etherWriteReg(ERXNDL, LOBYTE(0x1A09));
-    etherWriteReg(ERXNDH, HIBYTE(0x1A09));
+    etherWriteReg(ERXNDL, LOBYTE(RX_BUFFER_END));
+    etherWriteReg(ERXNDH, HIBYTE(RX_BUFFER_END));
 
     // initialize receiver write and read ptrs
-    // at startup, will write from 0 to 1A08 only and will not overwrite rd ptr
+    // at startup, will write from 0 to 13FE only and will not overwrite rd ptr
     etherWriteReg(ERXWRPTL, LOBYTE(0x0000));
     etherWriteReg(ERXWRPTH, HIBYTE(0x0000));
-    etherWriteReg(ERXRDPTL, LOBYTE(0x1A09));
-    etherWriteReg(ERXRDPTH, HIBYTE(0x1A09));
+    etherWriteReg(ERXRDPTL, LOBYTE(RX_BUFFER_END));
+    etherWriteReg(ERXRDPTH, HIBYTE(RX_BUFFER_END));
     etherWriteReg(ERDPTL, LOBYTE(0x0000));
     etherWriteReg(ERDPTH, HIBYTE(0x0000));
+    rxPacketPtr = 0x0000;
+    arpInit();
+    tcpInit();
+    txSlotHead = txSlotCount = 0;
+    txActive = false;
+    rxChecksumOffload = (mode & ETHER_RXCHECKSUM) != 0;
 
     // setup receive filter
     // always check CRC, use OR mode
@@ -506,15 +902,17 @@ void etherInit(uint16_t mode)
     // disable phy loopback if in half-duplex mode
     etherWritePhy(PHCON2, HDLDIS);
 
-    // Flash LEDA and LEDB
+    // Flash LEDA and LEDB until the timer wheel ends it
     etherWritePhy(PHLCON, 0x0880);
-    waitMicrosecond(100000);
+    startTimer(&ledFlashTimer, LED_FLASH_TIME, 0, etherLedFlashTimeout);
 
-    // set LEDA (link status) and LEDB (tx/rx activity)
-    // stretch LED on to 40ms (default)
-    etherWritePhy(PHLCON, 0x0472);
     // enable reception
     etherSetReg(ECON1, RXEN);
+
+    // run the protocol timers from the timer wheel
+    startTimer(&tcpTimer, TCP_SERVICE_INTERVAL, TCP_SERVICE_INTERVAL, tcpService);
+    startTimer(&arpTimer, ARP_SERVICE_INTERVAL, ARP_SERVICE_INTERVAL, etherArpService);
+    startTimer(&dhcpTimer, DHCP_SERVICE_INTERVAL, DHCP_SERVICE_INTERVAL, dhcpService);
 }
 
 // Returns true if link is up
@@ -524,8 +922,11 @@ bool etherIsLinkUp()
 }
 
 // Returns TRUE if packet received
+// Also moves queued frames to the wire when the tx interrupt is not in use
 bool etherIsDataAvailable()
 {
+    if (!rxIntEnabled)
+        etherServiceTx();
     return ((etherReadReg(EIR) & PKTIF) != 0);
 }
 
@@ -539,1073 +940,3177 @@ bool etherIsOverflow()
     return err;
 }
 
-// Returns up to max_size characters in data buffer
-// Returns number of bytes copied to buffer
-// Contents written are 16-bit size, 16-bit status, payload excl crc
-uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize)
+// Frees the frame at the read pointer and moves to the next one
+void etherAdvanceRxPacket()
 {
-    uint16_t i = 0, size, tmp16, status;
-
-    // enable read from FIFO buffers
-    etherReadMemStart();
-
-    // get next packet information
-    nextPacketLsb = etherReadMem();
-    nextPacketMsb = etherReadMem();
-
-    // calc size
-    // don't return crc, instead return size + status, so size is correct
-    size = etherReadMem();
-    tmp16 = etherReadMem();
-    size |= (tmp16 << 8);
-
-    // get status (currently unused)
-    status = etherReadMem();
-    tmp16 = etherReadMem();
-    status |= (tmp16 << 8);
-
-    // copy data
-    if (size > maxSize)
-        size = maxSize;
-    while (i < size)
-        packet[i++] = etherReadMem();
-
-    // end read from FIFO buffers
-    etherReadMemStop();
-
     // advance read pointer
     etherSetBank(ERXRDPTL);
     etherWriteReg(ERXRDPTL, nextPacketLsb); // hw ptr
     etherWriteReg(ERXRDPTH, nextPacketMsb);
     etherWriteReg(ERDPTL, nextPacketLsb);   // dma rd ptr
     etherWriteReg(ERDPTH, nextPacketMsb);
+    rxPacketPtr = nextPacketLsb | (nextPacketMsb << 8);
 
     // decrement packet counter so that PKTIF is maintained correctly
     etherSetReg(ECON2, PKTDEC);
+}
 
-    return size;
+// Returns the receive buffer address offset bytes after addr
+// The receive buffer wraps from RX_BUFFER_END to 0x0000
+uint16_t etherRxAdd(uint16_t addr, uint16_t offset)
+{
+    addr += offset;
+    if (addr > RX_BUFFER_END)
+        addr -= RX_BUFFER_END + 1;
+    return addr;
 }
 
-// Writes a packet
-bool etherPutPacket(uint8_t packet[], uint16_t size)
+// Sums size bytes of the receive buffer with the ENC28J60 DMA checksum engine
+// Returns the checksum in frame byte order, so 0 means the range sums correctly
+uint16_t etherDmaChecksum(uint16_t start, uint16_t size)
 {
-    uint16_t i;
+    uint16_t end = etherRxAdd(start, size - 1);
+    etherSetBank(EDMASTL);
+    etherWriteReg(EDMASTL, LOBYTE(start));
+    etherWriteReg(EDMASTH, HIBYTE(start));
+    etherWriteReg(EDMANDL, LOBYTE(end));
+    etherWriteReg(EDMANDH, HIBYTE(end));
+    etherSetReg(ECON1, CSUMEN | DMAST);
+    while ((etherReadReg(ECON1) & DMAST) != 0);
+    return etherReadReg(EDMACSH) | (etherReadReg(EDMACSL) << 8);
+}
 
-    // clear out any tx errors
-    if ((etherReadReg(EIR) & TXERIF) != 0)
+// Verifies a received frame while most of it is still in the ENC28J60
+// Must be called with the buffer read started just after the 6-byte header
+// The ethernet and ip headers are read into packet and their count returned
+// in copied; the rest of the frame is left to be read by the caller
+// The ip header is checked in SRAM and the icmp, udp or tcp checksum by the
+// DMA checksum engine, so only the headers cross SPI before a frame is known
+// to be good
+// Returns false only for a bad checksum
+// verified is set only when both the ip and the icmp, udp or tcp checksums
+// were checked, or the udp header says it has none; other frames (not ipv4,
+// short, malformed, fragments or other protocols) pass unverified and are
+// left to software
+bool etherRxChecksumOk(uint8_t packet[], uint16_t size, uint16_t* copied, bool* verified)
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    udpFrame* udp;
+    uint16_t ipSize, ipLength, l4Size, check;
+    uint32_t sum;
+
+    *copied = 0;
+    *verified = false;
+    if (size < etherHeaderLength + ipHeaderLength)
+        return true;
+    readSpi0Block(packet, etherHeaderLength + ipHeaderLength);
+    *copied = etherHeaderLength + ipHeaderLength;
+    if (ether->frameType != htons(IPv4_frame))
+        return true;
+    ipSize = (ip->revSize & 0xF) * 4;
+    ipLength = ntohs(ip->length);
+    if (ipSize < ipHeaderLength || ipLength < ipSize || etherHeaderLength + ipLength > size)
+        return true;
+    if (ipSize > ipHeaderLength)
     {
-        etherClearReg(EIR, TXERIF);
-        etherSetReg(ECON1, TXRTS);
-        etherClearReg(ECON1, TXRTS);
+        readSpi0Block(packet + *copied, ipSize - ipHeaderLength);
+        *copied += ipSize - ipHeaderLength;
     }
+    if (getEtherChecksum(etherSumWords(0, ip, ipSize)) != 0)
+        return false;
 
-    // set DMA start address
-    etherSetBank(EWRPTL);
-    etherWriteReg(EWRPTL, LOBYTE(0x1A0A));
-    etherWriteReg(EWRPTH, HIBYTE(0x1A0A));
+    // fragments are left alone since the l4 checksum covers the whole datagram
+    l4Size = ipLength - ipSize;
+    if ((ntohs(ip->flagsAndOffset) & 0x3FFF) != 0 || l4Size == 0)
+        return true;
+    if (ip->protocol != 0x01 && ip->protocol != 0x06 && ip->protocol != 0x11)
+        return true;
 
-    // start FIFO buffer write
-    etherWriteMemStart();
+    // a udp checksum of 0 means the sender did not compute one (RFC 768)
+    if (ip->protocol == 0x11)
+    {
+        if (l4Size < udpHeaderLength)
+            return true;
+        udp = (udpFrame*)(packet + *copied);
+        readSpi0Block((uint8_t*)udp, udpHeaderLength);
+        *copied += udpHeaderLength;
+        if (udp->check == 0)
+        {
+            *verified = true;
+            return true;
+        }
+    }
 
-    // write control byte
-    etherWriteMem(0);
+    // the buffer read is suspended while the checksum engine runs; ERDPT
+    // is not disturbed, so the read resumes where it stopped
+    etherReadMemStop();
+    check = etherDmaChecksum(etherRxAdd(rxPacketPtr, 6 + etherHeaderLength + ipSize), l4Size);
+    etherReadMemStart();
+    *verified = true;
+    if (ip->protocol == 0x01)
+        return check == 0;
+
+    // udp and tcp add the pseudo-header to the sum of the segment
+    sum = etherSumWords(0, ip->sourceIp, 8);
+    sum += ip->protocol << 8;
+    sum += htons(l4Size);
+    sum += (uint16_t)~check;
+    return getEtherChecksum(sum) == 0;
+}
 
-    // write data
-    for (i = 0; i < size; i++)
-        etherWriteMem(packet[i]);
+// Returns the buffer address of a transmit slot
+uint16_t etherTxSlotAddress(uint8_t slot)
+{
+    return TX_BUFFER_START + slot * TX_SLOT_SIZE;
+}
 
-    // stop write
-    etherWriteMemStop();
+// Hands the oldest queued frame to the transmitter
+// Must be called with the isr locked out
+void etherStartTx()
+{
+    uint16_t start = etherTxSlotAddress(txSlotHead);
+
+    // clear out any tx errors
+    if ((etherReadReg(EIR) & TXERIF) != 0)
+    {
+        etherClearReg(EIR, TXERIF);
+        etherSetReg(ECON1, TXRST);
+        etherClearReg(ECON1, TXRST);
+    }
 
     // request transmit
-    etherWriteReg(ETXSTL, LOBYTE(0x1A0A));
-    etherWriteReg(ETXSTH, HIBYTE(0x1A0A));
-    etherWriteReg(ETXNDL, LOBYTE(0x1A0A+size));
-    etherWriteReg(ETXNDH, HIBYTE(0x1A0A+size));
+    etherSetBank(ETXSTL);
+    etherWriteReg(ETXSTL, LOBYTE(start));
+    etherWriteReg(ETXSTH, HIBYTE(start));
+    etherWriteReg(ETXNDL, LOBYTE(start + txSlotSize[txSlotHead]));
+    etherWriteReg(ETXNDH, HIBYTE(start + txSlotSize[txSlotHead]));
     etherClearReg(EIR, TXIF);
     etherSetReg(ECON1, TXRTS);
-
-    // wait for completion
-    while ((etherReadReg(ECON1) & TXRTS) != 0);
-
-    // determine success
-    return ((etherReadReg(ESTAT) & TXABORT) == 0);
+    txActive = true;
 }
 
-// Calculate sum of words
-// Must use getEtherChecksum to complete 1's compliment addition
-void etherSumWords(void* data, uint16_t sizeInBytes)
+// Retires the frame on the wire once TXRTS clears and starts the next one
+// Called from etherIsr() on TXIF, and by polling when interrupts are off
+void etherServiceTx()
 {
-	uint8_t* pData = (uint8_t*)data;
-    uint16_t i;
-    uint8_t phase = 0;
-    uint16_t data_temp;
-    for (i = 0; i < sizeInBytes; i++)
+    etherLockIsr();
+    if (txActive && (etherReadReg(ECON1) & TXRTS) == 0)
     {
-        if (phase)
-        {
-            data_temp = *pData;
-            sum += data_temp << 8;
-        }
-        else
-          sum += *pData;
-        phase = 1 - phase;
-        pData++;
+        if ((etherReadReg(ESTAT) & TXABORT) != 0)
+            txAbortCount++;
+        txActive = false;
+        txSlotHead = (txSlotHead + 1) % TX_SLOTS;
+        txSlotCount--;
     }
+    if (!txActive && txSlotCount > 0)
+        etherStartTx();
+    etherUnlockIsr();
 }
 
-// Completes 1's compliment addition by folding carries back into field
-uint16_t getEtherChecksum()
+// Queues the slot just written behind any frame already waiting
+void etherQueueTxSlot(uint16_t size)
 {
-    uint16_t result;
-    // this is based on rfc1071
-    while ((sum >> 16) > 0)
-      sum = (sum & 0xFFFF) + (sum >> 16);
-    result = sum & 0xFFFF;
-    return ~result;
+    etherLockIsr();
+    txSlotSize[(txSlotHead + txSlotCount) % TX_SLOTS] = size;
+    txSlotCount++;
+    etherUnlockIsr();
+    etherServiceTx();
 }
 
-void etherCalcIpChecksum(ipFrame* ip)
+// Waits for a free transmit slot and starts writing at its control byte
+void etherStartTxSlot()
 {
-    // 32-bit sum over ip header
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
+    uint16_t start;
+
+    // a slot cannot be rewritten until its frame has left the wire
+    etherServiceTx();
+    while (txSlotCount == TX_SLOTS)
+        etherServiceTx();
+
+    // set write start address
+    start = etherTxSlotAddress((txSlotHead + txSlotCount) % TX_SLOTS);
+    etherSetBank(EWRPTL);
+    etherWriteReg(EWRPTL, LOBYTE(start));
+    etherWriteReg(EWRPTH, HIBYTE(start));
+
+    // start FIFO buffer write
+    etherWriteMemStart();
+
+    // write control byte
+    etherWriteMem(0);
 }
 
-// Converts from host to network order and vice versa
-uint16_t htons(const uint16_t value)
+// Adds a frame read into rxRingData by a transfer to the receive ring
+void etherPublishRxFrame(etherTransfer* xfer)
 {
-    return ((value & 0xFF00) >> 8) + ((value & 0x00FF) << 8);
+    etherPacket* desc = &rxRing[rxRingWrite & RX_RING_MASK];
+    // arrival times feed the syn cookie keys
+    tcpCookieStir(getTimerUs() ^ xfer->size);
+    desc->data = xfer->packet;
+    desc->size = xfer->size;
+    desc->verified = xfer->verified;
+    rxRingOffset = (xfer->packet - rxRingData + xfer->size + 3) & ~3;
+    rxRingWrite++;
 }
-#define ntohs htons
 
-// Determines whether packet is IP datagram
-bool etherIsIp(uint8_t packet[])
+// Completes a uDMA transfer once the bus is idle
+// Reads release their receive buffer space, and those started by etherIsr()
+// add their frame to the ring; writes queue the frame for transmission
+void etherFinishTransfer(etherTransfer* xfer)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    bool ok;
-    ok = (ether->frameType == htons(0x0800));
-    if (ok)
+    xfer->pending = false;
+    if (xfer->isWrite)
     {
-        sum = 0;
-        etherSumWords(&ip->revSize, (ip->revSize & 0xF) * 4);
-        ok = (getEtherChecksum() == 0);
+        // stop write
+        etherWriteMemStop();
+        etherQueueTxSlot(xfer->size);
+    }
+    else
+    {
+        // end read from FIFO buffers
+        etherReadMemStop();
+        etherAdvanceRxPacket();
+        if (xfer->toRing)
+            etherPublishRxFrame(xfer);
     }
-    return ok;
 }
 
-// Determines whether packet is unicast to this ip
-// Must be an IP packet
-bool etherIsIpUnicast(uint8_t packet[])
+// Finishes a frame etherIsr() left streaming into the ring, once the bus is
+// idle, as the handler would have: the frame is added to the ring, draining
+// resumes (INTIE gives a new edge if more is flagged) and the bank of the
+// code it interrupted is restored
+// Called from the main loop by etherGetRxPacket(), or by anything that needs
+// the bus first
+void etherCompleteRxDma()
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    uint8_t i = 0;
-    bool ok = true;
-    while (ok & (i < IP_ADD_LENGTH))
+    bool inIsr = etherInIsr;
+    etherLockIsr();
+    etherInIsr = true;
+    etherFinishTransfer(&etherDmaTransfer);
+    if (!rxRingStalled)
+        etherSetReg(EIE, INTIE);
+    etherSetBank(rxDmaBank << 5);
+    etherInIsr = inIsr;
+    etherUnlockIsr();
+}
+
+// Returns true while a frame is streaming into the receive ring
+bool etherIsRxDmaBusy()
+{
+    return etherDmaTransfer.pending && etherDmaTransfer.toRing;
+}
+
+// Returns true once the transfer has completed
+// Finishing is done here, so a completed handle must be polled at least once
+bool etherIsTransferDone(etherTransfer* xfer)
+{
+    if (xfer->pending)
     {
-        ok = (ip->destIp[i] == ipAddress[i]);
-        i++;
+        if (isSpi0DmaBusy())
+            return false;
+        etherFinishTransfer(xfer);
     }
-    return ok;
+    return true;
 }
 
-// Determines whether packet is ping request
-// Must be an IP packet
-bool etherIsPingRequest(uint8_t packet[])
+// Blocks until the transfer has completed and returns its size
+uint16_t etherWaitTransfer(etherTransfer* xfer)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    icmpFrame* icmp = (icmpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    return (ip->protocol == 0x01 & icmp->type == 8);
+    while (!etherIsTransferDone(xfer));
+    return xfer->size;
 }
 
-// Sends a ping response given the request data
-void etherSendPingResponse(uint8_t packet[])
+// Starts copying the next packet into the data buffer with uDMA
+// Up to max_size characters are copied, excluding the 16-bit size and status
+// The returned handle completes once the frame is in SRAM
+// A frame whose status vector lacks received ok is dropped, as is, with
+// ETHER_RXCHECKSUM, a frame with a bad checksum after its headers are read;
+// the handle then completes at once with a size of 0
+etherTransfer* etherStartGetPacket(uint8_t packet[], uint16_t maxSize)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    icmpFrame* icmp = (icmpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    uint8_t i, tmp;
-    uint16_t icmp_size;
-    // swap source and destination fields
-    for (i = 0; i < HW_ADD_LENGTH; i++)
+    etherTransfer* xfer = &etherDmaTransfer;
+    uint16_t size, status, copied;
+    uint8_t header[6];
+    bool drop, verified = false;
+
+    // enable read from FIFO buffers
+    etherReadMemStart();
+
+    // get next packet information, size and status
+    // don't return crc, instead return size + status, so size is correct
+    readSpi0Block(header, 6);
+    nextPacketLsb = header[0];
+    nextPacketMsb = header[1];
+    size = header[2] | (header[3] << 8);
+    status = header[4] | (header[5] << 8);
+
+    if (size > maxSize)
+        size = maxSize;
+    xfer->packet = packet;
+    xfer->isWrite = false;
+    xfer->toRing = false;
+    copied = 0;
+    drop = (status & RXOK) == 0;
+    if (!drop && rxChecksumOffload && !etherRxChecksumOk(packet, size, &copied, &verified))
     {
-        tmp = ether->destAddress[i];
-        ether->destAddress[i] = ether->sourceAddress[i];
-        ether->sourceAddress[i] = tmp;
+        rxChecksumDropCount++;
+        drop = true;
     }
-    for (i = 0; i < IP_ADD_LENGTH; i++)
-
+    if (drop)
     {
-        tmp = ip->destIp[i];
-        ip->destIp[i] = ip ->sourceIp[i];
-        ip->sourceIp[i] = tmp;
+        // drop the frame without copying the rest of it
+        etherReadMemStop();
+        etherAdvanceRxPacket();
+        xfer->size = 0;
+        xfer->pending = false;
+        return xfer;
     }
-    // this is a response
-    icmp->type = 0;
-    // calc icmp checksum
-    sum = 0;
-    etherSumWords(&icmp->type, 2);
-    icmp_size = ntohs(ip->length);
-    icmp_size -= 24; // sub ip header and icmp code, type, and check
-    etherSumWords(&icmp->id, icmp_size);
-    icmp->check = getEtherChecksum();
-    // send packet
-    etherPutPacket(ether, 14 + ntohs(ip->length));
+
+    // stream data while the caller continues
+    xfer->size = size;
+    xfer->verified = verified;
+    xfer->pending = true;
+    if (size > copied)
+        startSpi0DmaRead(packet + copied, size - copied);
+    return xfer;
 }
 
-// Determines whether packet is ARP
-bool etherIsArpRequest(uint8_t packet[])
+// Returns up to max_size characters in data buffer
+// Returns number of bytes copied to buffer
+// Contents written are 16-bit size, 16-bit status, payload excl crc
+uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    arpFrame* arp = (arpFrame*)&ether->data;
-    bool ok;
-    uint8_t i = 0;
-    ok = (ether->frameType == htons(0x0806));
-    while (ok & (i < IP_ADD_LENGTH))
-    {
-        ok = (arp->destIp[i] == ipAddress[i]);
-        i++;
-    }
-    if (ok)
-        ok = (arp->op == htons(1));
-    return ok;
+    return etherWaitTransfer(etherStartGetPacket(packet, maxSize));
 }
-bool etherIsArpResponse(uint8_t packet[])
+
+// Starts writing a packet to a free transmit slot with uDMA
+// The returned handle completes once the frame is queued for transmission;
+// it goes out when the frame ahead of it, if any, has been sent
+// Only waits when both slots are still holding frames
+etherTransfer* etherStartPutPacket(uint8_t packet[], uint16_t size)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    arpFrame* arp = (arpFrame*)&ether->data;
-    bool ok;
-    uint8_t i = 0;
-    ok = (ether->frameType == htons(0x0806));
-    while (ok & (i < IP_ADD_LENGTH))
+    etherTransfer* xfer = &etherDmaTransfer;
+
+    etherStartTxSlot();
+
+    // stream data while the caller continues
+    xfer->packet = packet;
+    xfer->size = size;
+    xfer->isWrite = true;
+    xfer->toRing = false;
+    xfer->pending = true;
+    if (size > 0)
+        startSpi0DmaWrite(packet, size);
+    return xfer;
+}
+
+// Returns the ring offset for the next frame or RX_RING_FULL
+// Room for a maximum sized frame is required, so the size is not needed
+uint16_t etherRxRingAlloc()
+{
+    uint16_t oldest;
+    if (rxRingWrite == rxRingRelease)
+        return rxRingOffset = 0;
+    if ((uint8_t)(rxRingWrite - rxRingRelease) == ETHER_RX_RING_FRAMES)
+        return RX_RING_FULL;
+    oldest = rxRing[rxRingRelease & RX_RING_MASK].data - rxRingData;
+    if (rxRingOffset >= oldest)
     {
-        ok = (arp->destIp[i] == ipAddress[i]);
-        i++;
+        if (ETHER_RX_RING_BYTES - rxRingOffset >= MAX_RX_PACKET)
+            return rxRingOffset;
+        if (oldest > MAX_RX_PACKET)
+            return 0;
     }
-    if (ok)
-        ok = (arp->op == htons(2));
-    return ok;
+    else if (oldest - rxRingOffset > MAX_RX_PACKET)
+        return rxRingOffset;
+    return RX_RING_FULL;
 }
-// Sends an ARP response given the request data
-void etherSendArpResponse(uint8_t packet[])
+
+// ENC28J60 INT handler (PC6, falling edge)
+// Drains received frames into the ring until the chip is empty or the ring is
+// full, counts rx buffer overflows and starts queued transmit frames
+// Only the headers are read here; the rest of a frame is started by uDMA and
+// the handler returns with it streaming, to be finished by
+// etherCompleteRxDma() while the main loop carries on
+// INTIE is cleared while draining so a new edge is produced on exit if
+// anything is still flagged; a full ring is restarted by etherReleaseRxPacket()
+void etherIsr()
 {
-    etherFrame* ether = (etherFrame*)packet;
-    arpFrame* arp = (arpFrame*)&ether->data;
-    uint8_t i, tmp;
-    // set op to response
-    arp->op = htons(2);
-    // swap source and destination fields
-    for (i = 0; i < HW_ADD_LENGTH; i++)
+    uint8_t bank, flags;
+    uint16_t offset;
+    etherTransfer* xfer;
+
+    etherInIsr = true;
+    clearPinInterrupt(INT);
+
+    // the bus is still streaming the last frame; INTIE is clear until it is done
+    if (etherIsRxDmaBusy())
     {
-        arp->destAddress[i] = arp->sourceAddress[i];
-        ether->destAddress[i] = ether->sourceAddress[i];
-        ether->sourceAddress[i] = arp->sourceAddress[i] = macAddress[i];
+        if (!isSpi0DmaBusy())
+            etherCompleteRxDma();
+        etherInIsr = false;
+        return;
     }
-    for (i = 0; i < IP_ADD_LENGTH; i++)
+    rxRingStalled = false;
+
+    // preserve the bank selected by the interrupted code
+    bank = etherBank;
+    etherClearReg(EIE, INTIE);
+
+    flags = etherReadReg(EIR);
+    if ((flags & RXERIF) != 0)
     {
-        tmp = arp->destIp[i];
-        arp->destIp[i] = arp->sourceIp[i];
-        arp->sourceIp[i] = tmp;
+        rxOverflowCount++;
+        etherClearReg(EIR, RXERIF);
     }
-    // send packet
-    etherPutPacket(ether, 42);
+
+    // a frame has left the wire, so start the one staged behind it
+    if ((flags & TXIF) != 0)
+    {
+        etherClearReg(EIR, TXIF);
+        etherServiceTx();
+    }
+
+    while ((etherReadReg(EIR) & PKTIF) != 0)
+    {
+        offset = etherRxRingAlloc();
+        if (offset == RX_RING_FULL)
+        {
+            rxRingStalled = true;
+            break;
+        }
+
+        // a dropped frame is already skipped, with nothing to finish
+        xfer = etherStartGetPacket(&rxRingData[offset], MAX_RX_PACKET);
+        if (xfer->size == 0)
+            continue;
+        xfer->toRing = true;
+        if (isSpi0DmaBusy())
+        {
+            rxDmaBank = bank;
+            etherInIsr = false;
+            return;
+        }
+        etherFinishTransfer(xfer);
+    }
+
+    if (!rxRingStalled)
+        etherSetReg(EIE, INTIE);
+    etherSetBank(bank << 5);
+    etherInIsr = false;
 }
-void etherSendGratuitousArpResponse(uint8_t packet[], uint8_t ip[])
+
+// Switches reception and transmit completion from polling to etherIsr()
+void etherEnableRxInterrupt()
 {
-    uint8_t i;
-    etherFrame* ether = (etherFrame*)packet;
-    arpFrame* arp = (arpFrame*)&ether->data;
-    // set op to response
-    ether->frameType = 0x0608;
-    arp->hardwareType = htons(1);
-    arp->protocolType = htons(0x0800);
-    arp->hardwareSize = HW_ADD_LENGTH;
-    arp->protocolSize = IP_ADD_LENGTH;
-    arp->op = htons(2);
-    for (i = 0; i < IP_ADD_LENGTH; i++)
-        arp->destIp[i] = arp->sourceIp[i] = ip[i];
+    selectPinInterruptFallingEdge(INT);
+    clearPinInterrupt(INT);
+    enablePinInterrupt(INT);
+    etherWriteReg(EIE, INTIE | PKTIE | TXIE | RXERIE);
+    rxIntEnabled = true;
+#ifndef ENC28J60_MODEL
+    NVIC_EN0_R = 1 << (INT_GPIOC - 16);
+#endif
+}
 
-    for (i = 0; i < HW_ADD_LENGTH; i++)
+// Finds the network and transport headers of a frame
+// Done once per frame so handlers don't re-derive them from the ip header
+void etherParsePacket(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    packet->l3Offset = etherHeaderLength;
+    packet->l4Offset = etherHeaderLength;
+    if (ether->frameType == htons(IPv4_frame))
+        packet->l4Offset += (ip->revSize & 0xF) * 4;
+}
+
+// Returns the oldest frame not yet handed out, or 0 if the ring is empty
+// A frame left streaming by etherIsr() is finished here once its transfer is
+// done, without waiting for it
+// The frame stays valid, and may be rewritten in place, until released
+etherPacket* etherGetRxPacket()
+{
+    etherPacket* packet;
+    if (etherIsRxDmaBusy() && !isSpi0DmaBusy())
+        etherCompleteRxDma();
+    if (rxRingRead == rxRingWrite)
+        return 0;
+    packet = &rxRing[rxRingRead & RX_RING_MASK];
+    rxRingRead++;
+    etherClassifyPacket(packet);
+    return packet;
+}
+
+// Returns the oldest handed out frame to the ring
+void etherReleaseRxPacket()
+{
+    if (rxRingRelease != rxRingRead)
+        rxRingRelease++;
+    // the handler stopped draining when the ring filled, so restart it
+    if (rxRingStalled)
     {
-        ether->destAddress[i] = arp->destAddress[i] = 0xFF;
-        ether->sourceAddress[i] = arp->sourceAddress[i] = macAddress[i];
+        rxRingStalled = false;
+        etherSetReg(EIE, INTIE);
     }
-    etherPutPacket(ether, 42);
 }
-// Sends an ARP request
-void etherSendArpRequest(uint8_t packet[], uint8_t ip[])
+
+uint32_t etherGetRxChecksumDropCount()
 {
-    etherFrame* ether = (etherFrame*)packet;
-    arpFrame* arp = (arpFrame*)&ether->data;
-    uint8_t i;
-    // fill ethernet frame
-    for (i = 0; i < HW_ADD_LENGTH; i++)
+    return rxChecksumDropCount;
+}
+
+uint32_t etherGetRxOverflowCount()
+{
+    return rxOverflowCount;
+}
+
+// Writes a packet
+// Returns once the frame is queued in the ENC28J60, so the buffer can be reused
+// Transmission finishes in the background; aborts are counted by
+// etherGetTxAbortCount()
+bool etherPutPacket(uint8_t packet[], uint16_t size)
+{
+    return etherWaitTransfer(etherStartPutPacket(packet, size)) == size;
+}
+
+// Opens a transmit slot for a frame that is written in pieces with
+// etherWritePacket(), so it never has to be assembled in SRAM
+// ~CS stays asserted, and the isr locked out, until etherClosePacket()
+void etherOpenPacket()
+{
+    etherStartTxSlot();
+    txOpenSize = 0;
+}
+
+// Appends data to the open frame; the data may be in flash
+void etherWritePacket(const void* data, uint16_t size)
+{
+    writeSpi0Block((const uint8_t*)data, size);
+    txOpenSize += size;
+}
+
+// Queues the open frame for transmission
+void etherClosePacket()
+{
+    etherWriteMemStop();
+    etherQueueTxSlot(txOpenSize);
+}
+
+uint32_t etherGetTxAbortCount()
+{
+    return txAbortCount;
+}
+
+// Folds a 1's compliment sum to 16 bits
+uint16_t etherFoldSum(uint32_t sum)
+{
+    // this is based on rfc1071
+    while ((sum >> 16) > 0)
+      sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+// Adds data to a running 1's compliment sum of words and returns the new sum
+// Words are summed in memory order, so the result can be stored into a
+// checksum field as is (rfc1071 byte order independence)
+// The sum is kept in the caller so this is safe to use from an isr
+// Must use getEtherChecksum to complete 1's compliment addition
+uint32_t etherSumWords(uint32_t sum, const void* data, uint16_t sizeInBytes)
+{
+    const uint8_t* pData = (const uint8_t*)data;
+    const uint32_t* pWord;
+    uint64_t acc = 0;
+    uint32_t part;
+    bool odd = false;
+    if (sizeInBytes == 0)
+        return sum;
+    // an odd start puts the first byte in the low half of a word, then sums
+    // the rest shifted by one byte and swaps the result back
+    if (((uintptr_t)pData & 1) != 0)
     {
-        ether->destAddress[i] = 0xFF;
-        ether->sourceAddress[i] = macAddress[i];
+        odd = true;
+        acc = (uint32_t)*pData++ << 8;
+        sizeInBytes--;
     }
-    ether->frameType = 0x0608;
-    // fill arp frame
-    arp->hardwareType = htons(1);
-    arp->protocolType = htons(0x0800);
-    arp->hardwareSize = HW_ADD_LENGTH;
-    arp->protocolSize = IP_ADD_LENGTH;
-    arp->op = htons(1);
-    for (i = 0; i < HW_ADD_LENGTH; i++)
+    if (((uintptr_t)pData & 2) != 0 && sizeInBytes >= 2)
     {
-        arp->sourceAddress[i] = macAddress[i];
-        arp->destAddress[i] = 0xFF;
+        acc += *(const uint16_t*)pData;
+        pData += 2;
+        sizeInBytes -= 2;
     }
-    for (i = 0; i < IP_ADD_LENGTH; i++)
+    // 32-bit words, 16 bytes per pass; carries collect in the upper word
+    pWord = (const uint32_t*)pData;
+    while (sizeInBytes >= 16)
     {
-        arp->sourceIp[i] = ipAddress[i];
-        arp->destIp[i] = ip[i];
+        acc += pWord[0];
+        acc += pWord[1];
+        acc += pWord[2];
+        acc += pWord[3];
+        pWord += 4;
+        sizeInBytes -= 16;
     }
-    // send packet
-    etherPutPacket(ether, 42);
+    while (sizeInBytes >= 4)
+    {
+        acc += *pWord++;
+        sizeInBytes -= 4;
+    }
+    pData = (const uint8_t*)pWord;
+    if (sizeInBytes >= 2)
+    {
+        acc += *(const uint16_t*)pData;
+        pData += 2;
+        sizeInBytes -= 2;
+    }
+    if (sizeInBytes)
+        acc += *pData;
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    part = etherFoldSum(acc);
+    if (odd)
+        part = ((part & 0xFF) << 8) | (part >> 8);
+    return sum + part;
 }
 
-// Determines whether packet is UDP datagram
-// Must be an IP packet
-bool etherIsUdp(uint8_t packet[])
+// Completes 1's compliment addition by folding carries back into field
+uint16_t getEtherChecksum(uint32_t sum)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    bool ok;
+    return ~etherFoldSum(sum);
+}
+
+// Updates a checksum after one 16-bit word it covers changes from
+// oldWord to newWord, without summing the rest of the data (rfc1624 eqn 3)
+// Words are given as they are stored in the frame
+uint16_t etherUpdateChecksum(uint16_t check, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~oldWord;
+    sum += newWord;
+    return getEtherChecksum(sum);
+}
+
+// Sums the udp/tcp pseudo-header of an ip frame for the given l4 length
+uint32_t etherSumPseudoHeader(ipFrame* ip, uint16_t l4Length)
+{
+    uint32_t sum;
     uint16_t tmp16;
-    ok = (ip->protocol == 0x11);
-    if (ok)
-    {
-        // 32-bit sum over pseudo-header
-        sum = 0;
-        etherSumWords(ip->sourceIp, 8);
-        tmp16 = ip->protocol;
-        sum += (tmp16 & 0xff) << 8;
-        etherSumWords(&udp->length, 2);
-        // add udp header and data
-        etherSumWords(udp, ntohs(udp->length));
-        ok = (getEtherChecksum() == 0);
-    }
-    return ok;
+    sum = etherSumWords(0, ip->sourceIp, 8);
+    tmp16 = ip->protocol;
+    sum += (tmp16 & 0xff) << 8;
+    sum += htons(l4Length);
+    return sum;
 }
-bool etherIsDhcp(uint8_t packet[])
+
+void etherCalcIpChecksum(ipFrame* ip)
 {
-  //only checks recv case
-    etherFrame* ether = (etherFrame*)packet;
+    uint32_t sum;
+    // 32-bit sum over ip header
+    sum = etherSumWords(0, &ip->revSize, 10);
+    sum = etherSumWords(sum, ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
+    ip->headerChecksum = getEtherChecksum(sum);
+}
+
+// Converts from host to network order and vice versa
+uint16_t htons(const uint16_t value)
+{
+    return ((value & 0xFF00) >> 8) + ((value & 0x00FF) << 8);
+}
+#define ntohs htons
+
+// Determines whether packet is IP datagram
+bool etherIsIp(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
     ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
     bool ok;
-    // client always sends/recvs on 68 and server always sends/recvs on 67
-    ok = ((htons(udp->sourcePort) == 67) && (htons(udp->destPort) == 68));
-    ok &= matchesXid(packet);
+    ok = (ether->frameType == htons(0x0800));
+    if (ok)
+        ok = (getEtherChecksum(etherSumWords(0, &ip->revSize, packet->l4Offset - packet->l3Offset)) == 0);
     return ok;
 }
-uint8_t getDhcpMsgNumber(uint8_t packet[])
+
+// Determines whether packet is unicast to this ip
+// Must be an IP packet
+bool etherIsIpUnicast(etherPacket* packet)
 {
-  etherFrame* ether = (etherFrame*)packet;
-  ipFrame* ip = (ipFrame*)&ether->data;
-  udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-  dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
-  return dhcp->options[2];
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    uint8_t i = 0;
+    bool ok = true;
+    while (ok & (i < IP_ADD_LENGTH))
+    {
+        ok = (ip->destIp[i] == ipAddress[i]);
+        i++;
+    }
+    return ok;
 }
-// Gets pointer to UDP payload of frame
-uint8_t* etherGetUdpData(uint8_t packet[])
+
+// Determines whether packet is ping request
+// Must be an IP packet
+bool etherIsPingRequest(etherPacket* packet)
 {
-    etherFrame* ether = (etherFrame*)packet;
+    etherFrame* ether = (etherFrame*)packet->data;
     ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    return &udp->data;
+    icmpFrame* icmp = (icmpFrame*)(packet->data + packet->l4Offset);
+    return (ip->protocol == 0x01 && icmp->type == 8);
 }
 
-// Send responses to a udp datagram
-// destination port, ip, and hardware address are extracted from provided data
-// uses destination port of received packet as destination of this packet
-void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize)
+// Sends a ping response given the request data
+void etherSendPingResponse(etherPacket* packet)
 {
-    etherFrame* ether = (etherFrame*)packet;
+    etherFrame* ether = (etherFrame*)packet->data;
     ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    uint8_t *copyData;
-    uint8_t i, tmp8;
-    uint16_t tmp16;
+    icmpFrame* icmp = (icmpFrame*)(packet->data + packet->l4Offset);
+    uint8_t i, tmp;
+    uint16_t typeCode;
     // swap source and destination fields
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
-        tmp8 = ether->destAddress[i];
+        tmp = ether->destAddress[i];
         ether->destAddress[i] = ether->sourceAddress[i];
-        ether->sourceAddress[i] = tmp8;
+        ether->sourceAddress[i] = tmp;
     }
     for (i = 0; i < IP_ADD_LENGTH; i++)
+
     {
-        tmp8 = ip->destIp[i];
-        ip->destIp[i] = ip->sourceIp[i];
-        ip->sourceIp[i] = tmp8;
+        tmp = ip->destIp[i];
+        ip->destIp[i] = ip ->sourceIp[i];
+        ip->sourceIp[i] = tmp;
     }
-    // set source port of resp will be dest port of req
-    // dest port of resp will be left at source port of req
-    // unusual nomenclature, but this allows a different tx
-    // and rx port on other machine
-    udp->sourcePort = udp->destPort;
-    // adjust lengths
-    ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + udpSize);
-    // 32-bit sum over ip header
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
-    udp->length = htons(8 + udpSize);
-    // copy data
-    copyData = &udp->data;
-    for (i = 0; i < udpSize; i++)
-        copyData[i] = udpData[i];
-    // 32-bit sum over pseudo-header
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    etherSumWords(&udp->length, 2);
-    // add udp header except crc
-    etherSumWords(udp, 6);
-    etherSumWords(&udp->data, udpSize);
-    udp->check = getEtherChecksum();
+    // this is a response; only the type word changes, so patch the
+    // icmp checksum rather than summing the echo data again
+    // the ip header checksum is unchanged by swapping addresses
+    typeCode = *(uint16_t*)&icmp->type;
+    icmp->type = 0;
+    icmp->check = etherUpdateChecksum(icmp->check, typeCode, *(uint16_t*)&icmp->type);
+    // send packet
+    etherPutPacket(packet->data, 14 + ntohs(ip->length));
+}
 
-    // send packet with size = ether + udp hdr + ip header + udp_size
-    etherPutPacket(ether, 22 + ((ip->revSize & 0xF) * 4) + udpSize);
+// Empties the arp cache and the held frames
+void arpInit()
+{
+    uint8_t i;
+    for (i = 0; i < ARP_CACHE_SIZE; i++)
+    {
+        arpEntries[i].state = ARP_FREE;
+        arpEntries[i].hashNext = ARP_NONE;
+        arpEntries[i].queueHead = ARP_NONE;
+    }
+    for (i = 0; i < ARP_HASH_SIZE; i++)
+        arpHashHead[i] = ARP_NONE;
+    for (i = 0; i < ARP_QUEUE_FRAMES; i++)
+        arpQueue[i].size = 0;
 }
 
-uint16_t etherGetId()
+// Returns the hash bucket of an ip address
+uint8_t arpHash(const uint8_t ip[])
 {
-    return htons(sequenceId);
+    return (ip[0] ^ ip[1] ^ ip[2] ^ ip[3]) & (ARP_HASH_SIZE - 1);
 }
 
-void etherIncId()
+// Looks up the cache entry of an ip address
+// Returns 0 if the address is not cached
+arpEntry* arpFind(const uint8_t ip[])
 {
-    sequenceId++;
+    uint8_t index = arpHashHead[arpHash(ip)];
+    arpEntry* entry;
+    while (index != ARP_NONE)
+    {
+        entry = &arpEntries[index];
+        if (entry->ip[0] == ip[0] && entry->ip[1] == ip[1] && entry->ip[2] == ip[2] && entry->ip[3] == ip[3])
+            return entry;
+        index = entry->hashNext;
+    }
+    return 0;
 }
 
-// Enable or disable DHCP mode
-void etherEnableDhcpMode()
+// Drops the frames held for an entry, unlinks it from its hash bucket and
+// marks it free
+void arpFree(arpEntry* entry)
 {
-    writeEeprom(0, DHCP_ENABLED);
-    etherSetIpAddress(0,0,0,0);
-    etherSetIpSubnetMask(0,0,0, 0);
-    etherSetIpGatewayAddress(0,0,0,0);
-    etherSetIpDnsServer(0,0,0,0);
+    uint8_t* link = &arpHashHead[arpHash(entry->ip)];
+    uint8_t index = entry - arpEntries;
+    while (entry->queueHead != ARP_NONE)
+    {
+        arpQueue[entry->queueHead].size = 0;
+        entry->queueHead = arpQueue[entry->queueHead].next;
+        arpDropCount++;
+    }
+    while (*link != ARP_NONE)
+    {
+        if (*link == index)
+        {
+            *link = entry->hashNext;
+            break;
+        }
+        link = &arpEntries[*link].hashNext;
+    }
+    entry->state = ARP_FREE;
+    entry->hashNext = ARP_NONE;
+}
+
+// Takes a free entry for an ip address and links it into its hash bucket
+// When the cache is full, the entry that has gone longest without a reply is
+// replaced, preferring resolved entries to pending ones
+arpEntry* arpAlloc(const uint8_t ip[])
+{
+    arpEntry* entry = 0;
+    arpEntry* e;
+    uint32_t now = getTimerMs();
+    uint8_t i, bucket;
+    for (i = 0; entry == 0 && i < ARP_CACHE_SIZE; i++)
+        if (arpEntries[i].state == ARP_FREE)
+            entry = &arpEntries[i];
+    if (entry == 0)
+    {
+        for (i = 0; i < ARP_CACHE_SIZE; i++)
+        {
+            e = &arpEntries[i];
+            if (entry == 0 || e->state > entry->state
+                || (e->state == entry->state && now - e->time > now - entry->time))
+                entry = e;
+        }
+        arpFree(entry);
+    }
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        entry->ip[i] = ip[i];
+    entry->tries = 0;
+    entry->used = false;
+    entry->time = now;
+    bucket = arpHash(ip);
+    entry->hashNext = arpHashHead[bucket];
+    arpHashHead[bucket] = entry - arpEntries;
+    return entry;
+}
+
+// Sends an arp request for an ip address, broadcast or, to refresh an entry,
+// unicast to the address last seen (RFC 1122 2.3.2.1)
+void arpSendRequest(const uint8_t ip[], const uint8_t mac[])
+{
+    uint8_t frame[14 + 28];
+    etherFrame* ether = (etherFrame*)frame;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    uint8_t i;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        ether->destAddress[i] = mac != 0 ? mac[i] : 0xFF;
+        ether->sourceAddress[i] = arp->sourceAddress[i] = macAddress[i];
+        arp->destAddress[i] = 0;
+    }
+    ether->frameType = htons(0x0806);
+    arp->hardwareType = htons(1);
+    arp->protocolType = htons(IPv4_frame);
+    arp->hardwareSize = HW_ADD_LENGTH;
+    arp->protocolSize = IP_ADD_LENGTH;
+    arp->op = htons(1);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        arp->sourceIp[i] = ipAddress[i];
+        arp->destIp[i] = ip[i];
+    }
+    etherPutPacket(frame, sizeof(frame));
+}
+
+// Records the hardware address of an ip address and sends the frames held
+// for it
+// A new entry is made only if create is set, so replies that were not asked
+// for cannot fill the cache
+void arpUpdate(const uint8_t ip[], const uint8_t mac[], bool create)
+{
+    arpEntry* entry = arpFind(ip);
+    arpQueued* queued;
+    etherFrame* ether;
+    uint8_t i;
+    if (entry == 0)
+    {
+        if (!create)
+            return;
+        entry = arpAlloc(ip);
+    }
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        entry->mac[i] = mac[i];
+    entry->state = ARP_RESOLVED;
+    entry->tries = 0;
+    entry->used = false;
+    entry->time = getTimerMs();
+    while (entry->queueHead != ARP_NONE)
+    {
+        queued = &arpQueue[entry->queueHead];
+        ether = (etherFrame*)queued->data;
+        for (i = 0; i < HW_ADD_LENGTH; i++)
+            ether->destAddress[i] = mac[i];
+        etherPutPacket(queued->data, queued->size);
+        queued->size = 0;
+        entry->queueHead = queued->next;
+    }
+}
+
+// Learns the sender of an arp reply sent to this ip
+void etherProcessArpResponse(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    arpUpdate(arp->sourceIp, arp->sourceAddress, false);
+}
+
+// Resends requests for pending entries, giving up after ARP_MAX_TRIES, and
+// refreshes resolved entries that are in use before they expire; an entry
+// not used since its last reply simply expires after ARP_TIMEOUT
+// Runs from the timer wheel every ARP_SERVICE_INTERVAL ms
+void etherArpService()
+{
+    arpEntry* entry;
+    uint32_t now = getTimerMs();
+    uint32_t age;
+    uint8_t i;
+    for (i = 0; i < ARP_CACHE_SIZE; i++)
+    {
+        entry = &arpEntries[i];
+        age = now - entry->time;
+        if (entry->state == ARP_PENDING)
+        {
+            if (age < ARP_RETRY)
+                continue;
+            if (entry->tries >= ARP_MAX_TRIES)
+            {
+                arpFree(entry);
+                continue;
+            }
+            entry->tries++;
+            entry->time = now;
+            arpSendRequest(entry->ip, 0);
+        }
+        else if (entry->state == ARP_RESOLVED)
+        {
+            if (age >= ARP_TIMEOUT)
+                arpFree(entry);
+            else if (entry->used && entry->tries < ARP_MAX_TRIES
+                     && age >= ARP_TIMEOUT - ARP_REFRESH + (uint32_t)entry->tries * ARP_RETRY)
+            {
+                entry->tries++;
+                arpSendRequest(entry->ip, entry->tries < ARP_MAX_TRIES ? entry->mac : 0);
+            }
+        }
+    }
+}
+
+// Returns the number of frames dropped because their next hop could not be
+// resolved, or there was no room to hold them meanwhile
+uint32_t etherGetArpDropCount()
+{
+    return arpDropCount;
+}
+
+// Determines whether packet is ARP
+bool etherIsArpRequest(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    bool ok;
+    uint8_t i = 0;
+    ok = (ether->frameType == htons(0x0806));
+    while (ok & (i < IP_ADD_LENGTH))
+    {
+        ok = (arp->destIp[i] == ipAddress[i]);
+        i++;
+    }
+    if (ok)
+        ok = (arp->op == htons(1));
+    return ok;
+}
+bool etherIsArpResponse(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    bool ok;
+    uint8_t i = 0;
+    ok = (ether->frameType == htons(0x0806));
+    while (ok & (i < IP_ADD_LENGTH))
+    {
+        ok = (arp->destIp[i] == ipAddress[i]);
+        i++;
+    }
+    if (ok)
+        ok = (arp->op == htons(2));
+    return ok;
+}
+// Sends an ARP response given the request data
+void etherSendArpResponse(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    uint8_t i, tmp;
+    // a request for this ip also tells us the requester's address (RFC 826)
+    arpUpdate(arp->sourceIp, arp->sourceAddress, true);
+    // set op to response
+    arp->op = htons(2);
+    // swap source and destination fields
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        arp->destAddress[i] = arp->sourceAddress[i];
+        ether->destAddress[i] = ether->sourceAddress[i];
+        ether->sourceAddress[i] = arp->sourceAddress[i] = macAddress[i];
+    }
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        tmp = arp->destIp[i];
+        arp->destIp[i] = arp->sourceIp[i];
+        arp->sourceIp[i] = tmp;
+    }
+    // send packet
+    etherPutPacket(packet->data, 42);
+}
+void etherSendGratuitousArpResponse(etherPacket* packet, uint8_t ip[])
+{
+    uint8_t i;
+    etherFrame* ether = (etherFrame*)packet->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    // set op to response
+    ether->frameType = 0x0608;
+    arp->hardwareType = htons(1);
+    arp->protocolType = htons(0x0800);
+    arp->hardwareSize = HW_ADD_LENGTH;
+    arp->protocolSize = IP_ADD_LENGTH;
+    arp->op = htons(2);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        arp->destIp[i] = arp->sourceIp[i] = ip[i];
+
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        ether->destAddress[i] = arp->destAddress[i] = 0xFF;
+        ether->sourceAddress[i] = arp->sourceAddress[i] = macAddress[i];
+    }
+    etherPutPacket(packet->data, 42);
+}
+// Sends an ARP request
+void etherSendArpRequest(etherPacket* packet, uint8_t ip[])
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    uint8_t i;
+    // fill ethernet frame
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        ether->destAddress[i] = 0xFF;
+        ether->sourceAddress[i] = macAddress[i];
+    }
+    ether->frameType = 0x0608;
+    // fill arp frame
+    arp->hardwareType = htons(1);
+    arp->protocolType = htons(0x0800);
+    arp->hardwareSize = HW_ADD_LENGTH;
+    arp->protocolSize = IP_ADD_LENGTH;
+    arp->op = htons(1);
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        arp->sourceAddress[i] = macAddress[i];
+        arp->destAddress[i] = 0xFF;
+    }
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        arp->sourceIp[i] = ipAddress[i];
+        arp->destIp[i] = ip[i];
+    }
+    // send packet
+    etherPutPacket(packet->data, 42);
+}
+
+// Finds the next hop of an ip address: the address itself on the local
+// subnet, otherwise the gateway
+// Returns false if the address is off the subnet and there is no gateway
+bool etherGetNextHop(const uint8_t ip[], uint8_t hop[])
+{
+    bool local = true, gateway = false;
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        local &= ((ip[i] ^ ipAddress[i]) & ipSubnetMask[i]) == 0;
+        gateway |= ipGwAddress[i] != 0;
+    }
+    if (!local && !gateway)
+        return false;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        hop[i] = local ? ip[i] : ipGwAddress[i];
+    return true;
+}
+
+// Sends an ip datagram whose ethernet and ip headers are in header and whose
+// payload, which may be in flash, is data
+// The ethernet addresses are filled in here; a datagram whose next hop is not
+// resolved yet is copied and held until the arp reply arrives, so only the
+// first datagram to a host waits for arp
+// Returns false if the datagram was dropped
+bool etherSendIp(uint8_t header[], uint16_t headerSize, const void* data, uint16_t size)
+{
+    etherFrame* ether = (etherFrame*)header;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    arpEntry* entry;
+    uint8_t* link;
+    uint8_t* copy;
+    uint8_t hop[IP_ADD_LENGTH];
+    uint8_t i, slot;
+    uint16_t n;
+    bool limited = true, directed = true;
+
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        ether->sourceAddress[i] = macAddress[i];
+    ether->frameType = htons(IPv4_frame);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        limited &= ip->destIp[i] == 0xFF;
+        directed &= ((ip->destIp[i] ^ ipAddress[i]) & ipSubnetMask[i]) == 0
+                 && (ip->destIp[i] | ipSubnetMask[i]) == 0xFF;
+    }
+
+    // limited and subnet broadcasts need no arp
+    entry = 0;
+    if (!limited && !directed)
+    {
+        if (!etherGetNextHop(ip->destIp, hop))
+        {
+            arpDropCount++;
+            return false;
+        }
+        entry = arpFind(hop);
+        if (entry == 0)
+        {
+            entry = arpAlloc(hop);
+            entry->state = ARP_PENDING;
+            entry->tries = 1;
+            arpSendRequest(hop, 0);
+        }
+        entry->used = true;
+    }
+    if (entry == 0 || entry->state == ARP_RESOLVED)
+    {
+        for (i = 0; i < HW_ADD_LENGTH; i++)
+            ether->destAddress[i] = entry != 0 ? entry->mac[i] : 0xFF;
+        etherOpenPacket();
+        etherWritePacket(header, headerSize);
+        etherWritePacket(data, size);
+        etherClosePacket();
+        return true;
+    }
+
+    // hold a copy at the end of the entry's queue
+    for (slot = 0; slot < ARP_QUEUE_FRAMES && arpQueue[slot].size != 0; slot++);
+    if (slot == ARP_QUEUE_FRAMES || headerSize + size > ARP_QUEUE_FRAME_SIZE)
+    {
+        arpDropCount++;
+        return false;
+    }
+    copy = arpQueue[slot].data;
+    for (i = 0; i < headerSize; i++)
+        copy[i] = header[i];
+    for (n = 0; n < size; n++)
+        copy[headerSize + n] = ((const uint8_t*)data)[n];
+    arpQueue[slot].size = headerSize + size;
+    arpQueue[slot].next = ARP_NONE;
+    link = &entry->queueHead;
+    while (*link != ARP_NONE)
+        link = &arpQueue[*link].next;
+    *link = slot;
+    return true;
+}
+
+// Sends a udp datagram, which may be in flash, from this ip
+// Returns false if the datagram was dropped
+bool etherSendUdp(const uint8_t ip[], uint16_t sourcePort, uint16_t destPort, const void* data, uint16_t size)
+{
+    uint8_t header[14 + 20 + sizeof(udpFrame)];    // room for the whole udpFrame overlay
+    etherFrame* ether = (etherFrame*)header;
+    ipFrame* ipHeader = (ipFrame*)&ether->data;
+    udpFrame* udp = (udpFrame*)(header + etherHeaderLength + ipHeaderLength);
+    uint32_t sum;
+    uint8_t i;
+
+    ipHeader->revSize = 0x45;
+    ipHeader->typeOfService = 0x00;
+    ipHeader->length = htons(ipHeaderLength + udpHeaderLength + size);
+    ipHeader->id = htons(ipId++);
+    ipHeader->flagsAndOffset = 0x0000;
+    ipHeader->ttl = 64;
+    ipHeader->protocol = 0x11;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ipHeader->destIp[i] = ip[i];
+        ipHeader->sourceIp[i] = ipAddress[i];
+    }
+    etherCalcIpChecksum(ipHeader);
+
+    udp->sourcePort = htons(sourcePort);
+    udp->destPort = htons(destPort);
+    udp->length = htons(udpHeaderLength + size);
+    udp->check = 0;
+    sum = etherSumPseudoHeader(ipHeader, udpHeaderLength + size);
+    sum = etherSumWords(sum, udp, udpHeaderLength);
+    sum = etherSumWords(sum, data, size);
+    udp->check = getEtherChecksum(sum);
+    if (udp->check == 0)
+        udp->check = 0xFFFF;
+    return etherSendIp(header, etherHeaderLength + ipHeaderLength + udpHeaderLength, data, size);
+}
+
+// Determines whether packet is UDP datagram
+// Must be an IP packet
+bool etherIsUdp(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    bool ok;
+    uint32_t sum;
+    ok = (ip->protocol == 0x11);
+    // a checksum of 0 means none was sent (RFC 768)
+    if (ok && udp->check != 0)
+    {
+        // 32-bit sum over pseudo-header
+        sum = etherSumPseudoHeader(ip, ntohs(udp->length));
+        // add udp header and data
+        sum = etherSumWords(sum, udp, ntohs(udp->length));
+        ok = (getEtherChecksum(sum) == 0);
+    }
+    return ok;
+}
+bool etherIsDhcp(etherPacket* packet)
+{
+  //only checks recv case
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    bool ok;
+    // client always sends/recvs on 68 and server always sends/recvs on 67
+    ok = ((htons(udp->sourcePort) == 67) && (htons(udp->destPort) == 68));
+    ok = ok && dhcpOptionsLength(packet) >= 0;
+    ok = ok && matchesXid(packet);
+    return ok;
+}
+
+// Returns the number of option bytes in a dhcp message, or -1 if the udp
+// length disagrees with the ip length or runs past the frame
+// The offload path checks only the ip length, so the options are never walked
+// on the udp length alone
+int16_t dhcpOptionsLength(etherPacket* packet)
+{
+    ipFrame* ip = (ipFrame*)(packet->data + packet->l3Offset);
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    uint16_t ipSize = packet->l4Offset - packet->l3Offset;
+    uint16_t ipLength = ntohs(ip->length);
+    uint16_t udpLength = ntohs(udp->length);
+    if (packet->l3Offset + ipLength > packet->size || ipLength < ipSize
+        || udpLength > ipLength - ipSize || udpLength < udpHeaderLength + dhcpSize)
+        return -1;
+    return udpLength - udpHeaderLength - dhcpSize;
+}
+
+// Finds an option in a dhcp message
+// Returns a pointer to its length byte, or 0 if it is absent
+uint8_t* dhcpFindOption(etherPacket* packet, uint8_t code)
+{
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    uint8_t* options = dhcp->options;
+    int16_t length = dhcpOptionsLength(packet);
+    uint16_t i = 0;
+    while (i < length && options[i] != END)
+    {
+        if (options[i] == 0)
+        {
+            i++;
+            continue;
+        }
+        if (i + 1 >= length || i + 2 + options[i+1] > length)
+            break;
+        if (options[i] == code)
+            return &options[i+1];
+        i += 2 + options[i+1];
+    }
+    return 0;
+}
+
+// Returns the message type of a dhcp message, or 0 if it has none
+uint8_t getDhcpMsgNumber(etherPacket* packet)
+{
+    uint8_t* option = dhcpFindOption(packet, DHCPMESSAGE);
+    return option != 0 && option[0] >= 1 ? option[1] : 0;
+}
+// Gets pointer to UDP payload of frame
+uint8_t* etherGetUdpData(etherPacket* packet)
+{
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    return &udp->data;
+}
+
+// Send responses to a udp datagram
+// destination port, ip, and hardware address are extracted from provided data
+// uses destination port of received packet as destination of this packet
+void etherSendUdpResponse(etherPacket* packet, uint8_t* udpData, uint8_t udpSize)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    uint8_t *copyData;
+    uint8_t i, tmp8;
+    uint16_t length;
+    uint32_t sum;
+    // swap source and destination fields
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        tmp8 = ether->destAddress[i];
+        ether->destAddress[i] = ether->sourceAddress[i];
+        ether->sourceAddress[i] = tmp8;
+    }
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        tmp8 = ip->destIp[i];
+        ip->destIp[i] = ip->sourceIp[i];
+        ip->sourceIp[i] = tmp8;
+    }
+    // set source port of resp will be dest port of req
+    // dest port of resp will be left at source port of req
+    // unusual nomenclature, but this allows a different tx
+    // and rx port on other machine
+    udp->sourcePort = udp->destPort;
+    // adjust lengths; the swap leaves the ip header sum alone, so only
+    // the length word needs to be patched into its checksum
+    length = ip->length;
+    ip->length = htons(packet->l4Offset - packet->l3Offset + 8 + udpSize);
+    ip->headerChecksum = etherUpdateChecksum(ip->headerChecksum, length, ip->length);
+    udp->length = htons(8 + udpSize);
+    // copy data
+    copyData = &udp->data;
+    for (i = 0; i < udpSize; i++)
+        copyData[i] = udpData[i];
+    // 32-bit sum over pseudo-header
+    sum = etherSumPseudoHeader(ip, 8 + udpSize);
+    // add udp header except crc
+    sum = etherSumWords(sum, udp, 6);
+    sum = etherSumWords(sum, &udp->data, udpSize);
+    udp->check = getEtherChecksum(sum);
+
+    // send packet with size = ether + udp hdr + ip header + udp_size
+    etherPutPacket(packet->data, packet->l4Offset + 8 + udpSize);
+}
+
+uint16_t etherGetId()
+{
+    return htons(sequenceId);
+}
+
+void etherIncId()
+{
+    sequenceId++;
+}
+
+// Enable or disable DHCP mode
+void etherEnableDhcpMode()
+{
+    writeEeprom(0, DHCP_ENABLED);
+    etherSetIpAddress(0,0,0,0);
+    etherSetIpSubnetMask(0,0,0, 0);
+    etherSetIpGatewayAddress(0,0,0,0);
+    etherSetIpDnsServer(0,0,0,0);
+}
+
+void etherDisableDhcpMode()
+{
+    writeEeprom(0, DHCP_DISABLED);
+    etherSetIpAddress(0,0,0,0);
+    etherSetIpSubnetMask(0,0,0, 0);
+    etherSetIpGatewayAddress(0,0,0,0);
+    etherSetIpDnsServer(0,0,0,0);
+}
+
+bool etherIsDhcpEnabled()
+{
+    //read eeprom and check for either 0xFFFFFFFF
+    uint32_t result;
+    result = readEeprom(FIRST_BLOCK_NO_OFFSET);
+
+    if (result == DHCP_ENABLED)
+        return true;
+    else
+        return false;
+}
+// Determines if the IP address is valid
+bool etherIsIpValid()
+{
+    return ipAddress[0] || ipAddress[1] || ipAddress[2] || ipAddress[3];
+}
+
+// Sets IP address
+void etherSetIpAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    ipAddress[0] = ip0;
+    ipAddress[1] = ip1;
+    ipAddress[2] = ip2;
+    ipAddress[3] = ip3;
+}
+
+// Gets IP address
+void etherGetIpAddress(uint8_t ip[4])
+{
+    uint8_t i;
+    for (i = 0; i < 4; i++)
+        ip[i] = ipAddress[i];
+}
+
+// Sets IP subnet mask
+void etherSetIpSubnetMask(uint8_t mask0, uint8_t mask1, uint8_t mask2, uint8_t mask3)
+{
+    ipSubnetMask[0] = mask0;
+    ipSubnetMask[1] = mask1;
+    ipSubnetMask[2] = mask2;
+    ipSubnetMask[3] = mask3;
+}
+
+// Gets IP subnet mask
+void etherGetIpSubnetMask(uint8_t mask[4])
+{
+    uint8_t i;
+    for (i = 0; i < 4; i++)
+        mask[i] = ipSubnetMask[i];
+}
+void etherSetIpDnsServer(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    ipDnsServer[0] = ip0;
+    ipDnsServer[1] = ip1;
+    ipDnsServer[2] = ip2;
+    ipDnsServer[3] = ip3;
+}
+void etherGetIpDnsServer(uint8_t ip[4])
+{
+    uint8_t i;
+    for (i = 0; i < 4; i++)
+        ip[i] = ipDnsServer[i];
+}
+// Sets IP gateway address
+void etherSetIpGatewayAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+{
+    ipGwAddress[0] = ip0;
+    ipGwAddress[1] = ip1;
+    ipGwAddress[2] = ip2;
+    ipGwAddress[3] = ip3;
+}
+
+// Gets IP gateway address
+void etherGetIpGatewayAddress(uint8_t ip[4])
+{
+    uint8_t i;
+    for (i = 0; i < 4; i++)
+        ip[i] = ipGwAddress[i];
+}
+
+// Sets MAC address
+void etherSetMacAddress(uint8_t mac0, uint8_t mac1, uint8_t mac2, uint8_t mac3, uint8_t mac4, uint8_t mac5)
+{
+    macAddress[0] = mac0;
+    macAddress[1] = mac1;
+    macAddress[2] = mac2;
+    macAddress[3] = mac3;
+    macAddress[4] = mac4;
+    macAddress[5] = mac5;
+}
+
+// Gets MAC address
+void etherGetMacAddress(uint8_t mac[6])
+{
+    uint8_t i;
+    for (i = 0; i < 6; i++)
+        mac[i] = macAddress[i];
+}
+bool matchesXid(etherPacket* packet)
+{
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    return dhcp->xid == transaction_id;
+}
+// Returns a pseudo-random number for xids and retransmit jitter
+// There is no rng, so the sequence is seeded from the mac address and clock
+uint32_t dhcpRandom()
+{
+    dhcpSeed = dhcpSeed * 1664525 + 1013904223 + getTimerMs();
+    return dhcpSeed >> 8;
+}
+
+// Advances the seconds clock that times the lease, which outlasts the
+// wrap of the ms timer
+void dhcpTick()
+{
+    uint32_t now = getTimerMs();
+    while (now - dhcpTickMs >= 1000)
+    {
+        dhcpTickMs += 1000;
+        dhcpSeconds++;
+    }
+}
+
+// Appends an option to a message being built, leaving room for END
+// Returns false, adding nothing, if it does not fit
+bool dhcpPutOption(uint8_t options[], uint16_t* size, uint8_t code, const void* data, uint8_t length)
+{
+    uint8_t i;
+    if (*size + 2 + length > DHCP_OPTIONS_SIZE - 1)
+        return false;
+    options[(*size)++] = code;
+    options[(*size)++] = length;
+    for (i = 0; i < length; i++)
+        options[(*size)++] = ((const uint8_t*)data)[i];
+    return true;
+}
+
+// Copies a 4-byte option value, as an address or a big-endian time
+void dhcpGetOptionValue(uint8_t value[], const uint8_t data[], uint8_t length)
+{
+    uint8_t i;
+    if (length >= 4)
+        for (i = 0; i < 4; i++)
+            value[i] = data[i];
+}
+
+// Decodes the options the client uses from a received message in one pass
+// over the tlvs; pads are skipped, and the walk stops at END or at an option
+// that would run past the end of the datagram
+void dhcpParseOptions(etherPacket* packet, dhcpOptions* parsed)
+{
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    uint8_t* options = dhcp->options;
+    int16_t length = dhcpOptionsLength(packet);
+    uint8_t* data;
+    uint8_t time[4];
+    uint16_t i = 0;
+    uint8_t code, size;
+    dhcpOptions none = {0};
+
+    *parsed = none;
+    while (i < length && options[i] != END)
+    {
+        code = options[i++];
+        if (code == 0)
+            continue;
+        if (i >= length || i + 1 + options[i] > length)
+            break;
+        size = options[i++];
+        data = &options[i];
+        i += size;
+        switch (code)
+        {
+        case DHCPMESSAGE:
+            if (size >= 1)
+                parsed->type = data[0];
+            break;
+        case RAPID_COMMIT:
+            parsed->rapidCommit = true;
+            break;
+        case SERVERID:
+            dhcpGetOptionValue(parsed->serverId, data, size);
+            break;
+        case SN_MASK_CODE:
+            dhcpGetOptionValue(parsed->mask, data, size);
+            break;
+        case GW_CODE:
+            dhcpGetOptionValue(parsed->router, data, size);
+            break;
+        case DNS_CODE:
+            dhcpGetOptionValue(parsed->dns, data, size);
+            break;
+        case IP_LEASE_CODE:
+        case T1_CODE:
+        case T2_CODE:
+            if (size < 4)
+                break;
+            dhcpGetOptionValue(time, data, size);
+            *(code == IP_LEASE_CODE ? &parsed->lease : code == T1_CODE ? &parsed->t1 : &parsed->t2) =
+                (uint32_t)time[0] << 24 | (uint32_t)time[1] << 16 | time[2] << 8 | time[3];
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// Builds a client message for the current state and sends it
+// REQUESTING asks for the offered address from the chosen server; RENEWING
+// unicasts to the server holding the lease and REBINDING broadcasts to any,
+// both from the leased address (RFC 2131 4.3.2 and table 5)
+// A discover offers rapid commit (RFC 4039) when DHCP_RAPID_COMMIT is set
+void dhcpSendMessage(uint8_t type)
+{
+    uint32_t buffer[(sizeof(dhcpFrame) + DHCP_OPTIONS_SIZE + 3) / 4];
+    dhcpFrame* dhcp = (dhcpFrame*)buffer;
+    uint8_t* options = dhcp->options;
+    const uint8_t broadcast[IP_ADD_LENGTH] = {255, 255, 255, 255};
+    const uint8_t* dest = broadcast;
+    bool leased = (dhcpClientState == DHCP_BOUND || dhcpClientState == DHCP_RENEWING || dhcpClientState == DHCP_REBINDING);
+    uint16_t size = 0;
+    uint8_t i;
+
+    dhcp->op = 1;
+    dhcp->htype = TEN_Mb_ETHERNET;
+    dhcp->hlen = SIX_BYTES;
+    dhcp->hops = 0;
+    dhcp->xid = transaction_id;
+    dhcp->secs = htons(dhcpSeconds - dhcpStartSeconds);
+    // without an address the server must broadcast its replies
+    dhcp->flags = leased ? 0 : htons(0x8000);
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        dhcp->ciaddr[i] = leased ? ipAddress[i] : 0;
+        dhcp->yiaddr[i] = dhcp->siaddr[i] = dhcp->giaddr[i] = 0;
+    }
+    for (i = 0; i < sizeof(dhcp->chaddr); i++)
+        dhcp->chaddr[i] = i < HW_ADD_LENGTH ? macAddress[i] : 0;
+    for (i = 0; i < sizeof(dhcp->data); i++)
+        dhcp->data[i] = 0;
+    dhcp->magicCookie = 0x63538263;
+
+    dhcpPutOption(options, &size, DHCPMESSAGE, &type, 1);
+    if (type == DHCPREQUEST && (dhcpClientState == DHCP_REQUESTING || dhcpClientState == DHCP_REBOOTING))
+        dhcpPutOption(options, &size, REQ_IP_MSG, yiaddr, 4);
+    if ((type == DHCPREQUEST && dhcpClientState == DHCP_REQUESTING) || type == DHCPRELEASE)
+        dhcpPutOption(options, &size, SERVERID, ipDhcpServer, 4);
+    if (type == DHCPDISCOVER && DHCP_RAPID_COMMIT)
+        dhcpPutOption(options, &size, RAPID_COMMIT, 0, 0);
+    if (type == DHCPDISCOVER || type == DHCPREQUEST)
+        dhcpPutOption(options, &size, PARAMETER_REQUEST, dhcpRequestList, sizeof(dhcpRequestList));
+    options[size++] = END;
+    // pad to the 300-byte minimum bootp message (RFC 1542 2.1)
+    while (size < DHCP_OPTIONS_SIZE)
+        options[size++] = 0;
+
+    if ((type == DHCPREQUEST && dhcpClientState == DHCP_RENEWING) || type == DHCPRELEASE)
+        dest = ipDhcpServer;
+    etherSendUdp(dest, 68, 67, buffer, sizeof(dhcpFrame) + size);
+}
+
+// Sends the message of the current state and sets the time of the next
+// retransmission
+// Before a lease, the wait doubles from DHCP_RETRY_MIN to DHCP_RETRY_MAX with
+// a second of jitter (RFC 2131 4.1); while renewing or rebinding it is half
+// the time left until T2 or the lease expires, but at least DHCP_RENEW_MIN s
+void dhcpTransmit()
+{
+    uint32_t left;
+    dhcpRetryStart = getTimerMs();
+    switch (dhcpClientState)
+    {
+    case DHCP_SELECTING:
+    case DHCP_REQUESTING:
+    case DHCP_REBOOTING:
+        if (dhcpTries == 0)
+            dhcpRequestSeconds = dhcpSeconds;
+        dhcpSendMessage(dhcpClientState == DHCP_SELECTING ? DHCPDISCOVER : DHCPREQUEST);
+        dhcpRetryTimeout = dhcpTries < 4 ? DHCP_RETRY_MIN << dhcpTries : DHCP_RETRY_MAX;
+        dhcpRetryTimeout += dhcpRandom() % 2001;
+        dhcpRetryTimeout -= 1000;
+        break;
+    case DHCP_RENEWING:
+    case DHCP_REBINDING:
+        dhcpRequestSeconds = dhcpSeconds;
+        dhcpSendMessage(DHCPREQUEST);
+        left = (dhcpClientState == DHCP_RENEWING ? dhcpT2 : lease_time) - (dhcpSeconds - dhcpLeaseStart);
+        left /= 2;
+        dhcpRetryTimeout = (left < DHCP_RENEW_MIN ? DHCP_RENEW_MIN : left > 3600 ? 3600 : left) * 1000;
+        break;
+    default:
+        break;
+    }
+}
+
+// Moves to a state and sends its first message
+void dhcpEnterState(uint8_t state)
+{
+    dhcpClientState = state;
+    dhcpTries = 0;
+    dhcpTransmit();
+}
+
+// Packs an ip address into an eeprom word
+uint32_t dhcpPackIp(const uint8_t ip[])
+{
+    return ip[0] | ip[1] << 8 | ip[2] << 16 | (uint32_t)ip[3] << 24;
+}
+
+void dhcpUnpackIp(uint32_t word, uint8_t ip[])
+{
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        ip[i] = word >> (8 * i);
+}
+
+// Saves the bound lease so the next boot can confirm it with a single
+// request; an unchanged lease, as after most renewals, writes nothing
+void dhcpSaveLease()
+{
+    uint32_t record[DHCP_LEASE_WORDS];
+    record[0] = dhcpPackIp(ipAddress);
+    record[1] = dhcpPackIp(ipDhcpServer);
+    record[2] = dhcpPackIp(ipSubnetMask);
+    record[3] = dhcpPackIp(ipGwAddress);
+    record[4] = dhcpPackIp(ipDnsServer);
+    record[5] = lease_time;
+    writeEepromRecord(DHCP_LEASE_ADDRESS, record, DHCP_LEASE_WORDS);
+}
+
+// Loads the saved lease as the address to request, with the configuration
+// it came with
+// Returns false if there is none, or its crc fails
+bool dhcpLoadLease()
+{
+    uint32_t record[DHCP_LEASE_WORDS];
+    if (!readEepromRecord(DHCP_LEASE_ADDRESS, record, DHCP_LEASE_WORDS) || record[0] == 0)
+        return false;
+    dhcpUnpackIp(record[0], yiaddr);
+    dhcpUnpackIp(record[1], ipDhcpServer);
+    dhcpUnpackIp(record[2], ipSubnetMask);
+    dhcpUnpackIp(record[3], ipGwAddress);
+    dhcpUnpackIp(record[4], ipDnsServer);
+    lease_time = record[5];
+    return true;
+}
+
+// Invalidates the saved lease
+void dhcpForgetLease()
+{
+    if (readEeprom(DHCP_LEASE_ADDRESS) != 0)
+        writeEeprom(DHCP_LEASE_ADDRESS, 0);
+}
+
+// Gives up the address and its saved lease, and starts over with a discover
+void dhcpRestart()
+{
+    dhcpForgetLease();
+    etherSetIpAddress(0, 0, 0, 0);
+    dhcpClientState = DHCP_INIT;
+}
+
+// Reads an ack into the ip configuration and lease timers
+// T1 and T2 default to 1/2 and 7/8 of the lease (RFC 2131 4.4.5)
+void dhcpStoreVars(etherPacket* packet, const dhcpOptions* options)
+{
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    uint8_t i;
+
+    etherSetIpAddress(dhcp->yiaddr[0], dhcp->yiaddr[1], dhcp->yiaddr[2], dhcp->yiaddr[3]);
+    etherSetIpSubnetMask(options->mask[0], options->mask[1], options->mask[2], options->mask[3]);
+    etherSetIpGatewayAddress(options->router[0], options->router[1], options->router[2], options->router[3]);
+    etherSetIpDnsServer(options->dns[0], options->dns[1], options->dns[2], options->dns[3]);
+    if (options->serverId[0] != 0)
+        for (i = 0; i < IP_ADD_LENGTH; i++)
+            ipDhcpServer[i] = options->serverId[i];
+    lease_time = options->lease != 0 ? options->lease : DHCP_INFINITE;
+    dhcpT1 = options->t1;
+    dhcpT2 = options->t2;
+    if (lease_time == DHCP_INFINITE)
+        dhcpT1 = dhcpT2 = DHCP_INFINITE;
+    if (dhcpT2 == 0 || dhcpT2 > lease_time)
+        dhcpT2 = lease_time - lease_time / 8;
+    if (dhcpT1 == 0 || dhcpT1 > dhcpT2)
+        dhcpT1 = lease_time / 2;
+}
+uint32_t getLeaseTime()
+{
+    return lease_time;
+}
+
+// Handles an offer, ack or nak for the current transaction
+// The first offer is taken; an ack binds the address and announces it with a
+// gratuitous arp, and a nak sends the client back to INIT
+// With rapid commit, an ack can answer the discover itself, binding in two
+// messages rather than four
+void dhcpProcessMessage(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    udpFrame* udp = (udpFrame*)(packet->data + packet->l4Offset);
+    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    dhcpOptions options;
+    uint8_t i;
+    bool requesting = (dhcpClientState == DHCP_REQUESTING || dhcpClientState == DHCP_RENEWING
+                       || dhcpClientState == DHCP_REBINDING || dhcpClientState == DHCP_REBOOTING);
+
+    dhcpTick();
+    dhcpParseOptions(packet, &options);
+    if (options.type == DHCPACK && options.rapidCommit && dhcpClientState == DHCP_SELECTING && DHCP_RAPID_COMMIT)
+        requesting = true;
+    if (options.type == DHCPOFFER && dhcpClientState == DHCP_SELECTING)
+    {
+        for (i = 0; i < IP_ADD_LENGTH; i++)
+        {
+            yiaddr[i] = dhcp->yiaddr[i];
+            ipDhcpServer[i] = options.serverId[0] != 0 ? options.serverId[i] : ip->sourceIp[i];
+        }
+        dhcpEnterState(DHCP_REQUESTING);
+    }
+    else if (options.type == DHCPACK && requesting)
+    {
+        // the lease runs from when the request (or rapid discover) was first sent
+        dhcpLeaseStart = dhcpRequestSeconds;
+        for (i = 0; i < IP_ADD_LENGTH; i++)
+            ipDhcpServer[i] = ip->sourceIp[i];
+        dhcpStoreVars(packet, &options);
+        dhcpClientState = DHCP_BOUND;
+        dhcpSaveLease();
+        etherSendGratuitousArpResponse(packet, ipAddress);
+    }
+    else if (options.type == DHCPNAK && requesting)
+        dhcpRestart();
+}
+
+// Runs the client's timers: retransmissions, the move to RENEWING at T1 and
+// to REBINDING at T2, and the loss of the address when the lease expires
+// Runs from the timer wheel every DHCP_SERVICE_INTERVAL ms
+void dhcpService()
+{
+    uint32_t elapsed;
+    uint32_t seconds = dhcpSeconds;
+    uint16_t status;
+    bool up;
+    uint8_t i;
+    dhcpTick();
+    elapsed = dhcpSeconds - dhcpLeaseStart;
+    // the link is checked once a second; when it comes back the client may
+    // have moved, so a bound lease is confirmed at once with a single request
+    // (INIT-REBOOT) and an acquisition restarts without waiting out its backoff
+    // The phy read is started on one run and collected on the next, so the
+    // service never waits on the MII
+    if (dhcpLinkPending && etherGetPhyResult(&status))
+    {
+        dhcpLinkPending = false;
+        up = (status & LSTAT) != 0;
+        if (up && !dhcpLinkUp && dhcpClientState != DHCP_OFF)
+        {
+            if (dhcpClientState == DHCP_BOUND || dhcpClientState == DHCP_RENEWING
+                || dhcpClientState == DHCP_REBINDING)
+            {
+                for (i = 0; i < IP_ADD_LENGTH; i++)
+                    yiaddr[i] = ipAddress[i];
+                etherSetIpAddress(0, 0, 0, 0);
+                dhcpClientState = DHCP_INIT_REBOOT;
+            }
+            else if (dhcpClientState != DHCP_INIT && dhcpClientState != DHCP_INIT_REBOOT)
+            {
+                dhcpClientState = DHCP_INIT;
+            }
+        }
+        dhcpLinkUp = up;
+    }
+    if (dhcpSeconds != seconds && dhcpClientState != DHCP_OFF)
+    {
+        etherStartReadPhy(PHSTAT1);
+        dhcpLinkPending = true;
+    }
+    switch (dhcpClientState)
+    {
+    case DHCP_INIT:
+    case DHCP_INIT_REBOOT:
+        transaction_id = dhcpRandom();
+        dhcpStartSeconds = dhcpSeconds;
+        dhcpEnterState(dhcpClientState == DHCP_INIT ? DHCP_SELECTING : DHCP_REBOOTING);
+        return;
+    case DHCP_BOUND:
+        if (lease_time != DHCP_INFINITE && elapsed >= dhcpT1)
+        {
+            transaction_id = dhcpRandom();
+            dhcpStartSeconds = dhcpSeconds;
+            dhcpEnterState(DHCP_RENEWING);
+        }
+        return;
+    case DHCP_RENEWING:
+        if (elapsed >= dhcpT2)
+        {
+            dhcpEnterState(DHCP_REBINDING);
+            return;
+        }
+        break;
+    case DHCP_REBINDING:
+        if (elapsed >= lease_time)
+        {
+            dhcpRestart();
+            return;
+        }
+        break;
+    case DHCP_SELECTING:
+    case DHCP_REQUESTING:
+    case DHCP_REBOOTING:
+        break;
+    default:
+        return;
+    }
+    if (getTimerMs() - dhcpRetryStart < dhcpRetryTimeout)
+        return;
+    // an offer or saved lease that is not confirmed is given up for a fresh
+    // discover
+    if ((dhcpClientState == DHCP_REQUESTING || dhcpClientState == DHCP_REBOOTING) && dhcpTries >= DHCP_REQUEST_TRIES)
+    {
+        dhcpClientState = DHCP_INIT;
+        return;
+    }
+    dhcpTries++;
+    dhcpTransmit();
+}
+
+// Starts acquiring an address, unless a lease is already held or sought
+// A lease saved before a reboot is confirmed first (INIT-REBOOT, RFC 2131
+// 3.2), which takes one request instead of a discover and a request
+void dhcpStart()
+{
+    if (dhcpClientState == DHCP_OFF)
+    {
+        dhcpSeed ^= macAddress[5] << 24 | macAddress[4] << 16 | macAddress[3] << 8 | macAddress[2];
+        dhcpTickMs = getTimerMs();
+        dhcpLinkUp = etherIsLinkUp();
+        dhcpClientState = dhcpLoadLease() ? DHCP_INIT_REBOOT : DHCP_INIT;
+    }
+}
+
+// Renews a held lease at once, or restarts acquisition
+void dhcpRefresh()
+{
+    dhcpTick();
+    if (dhcpClientState == DHCP_BOUND || dhcpClientState == DHCP_RENEWING || dhcpClientState == DHCP_REBINDING)
+    {
+        transaction_id = dhcpRandom();
+        dhcpStartSeconds = dhcpSeconds;
+        dhcpEnterState(DHCP_RENEWING);
+    }
+    else if (dhcpClientState != DHCP_OFF)
+        dhcpClientState = DHCP_INIT;
+    else
+        dhcpStart();
+}
+
+// Gives a held lease back to its server and stops the client, leaving the
+// interface without an address
+void dhcpRelease()
+{
+    if (dhcpClientState == DHCP_BOUND || dhcpClientState == DHCP_RENEWING || dhcpClientState == DHCP_REBINDING)
+    {
+        transaction_id = dhcpRandom();
+        dhcpSendMessage(DHCPRELEASE);
+    }
+    dhcpForgetLease();
+    dhcpClientState = DHCP_OFF;
+    etherSetIpAddress(0, 0, 0, 0);
+    etherSetIpSubnetMask(0, 0, 0, 0);
+    etherSetIpGatewayAddress(0, 0, 0, 0);
+    etherSetIpDnsServer(0, 0, 0, 0);
+}
+
+dhcpState dhcpGetState()
+{
+    return (dhcpState)dhcpClientState;
+}
+
+// Determines whether packet is a TCP segment for the telnet port
+// Must be an IP packet
+bool etherIsTcp(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)(packet->data + packet->l4Offset);
+    return ip->protocol == ip_tcp && ntohs(tcp->destPort) == 23;
+}
+
+// Parses a frame once and tags it with the protocol it carries
+// ARP is tagged only when addressed to this ip, ICMP and TCP only when
+// unicast to this ip, and UDP also when broadcast (eg. DHCP offers)
+// Frames that fail their ip or udp checksum are ETHER_UNKNOWN; frames checked
+// by the ENC28J60 (ETHER_RXCHECKSUM) are not summed again
+etherProtocol etherClassifyPacket(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    icmpFrame* icmp;
+    udpFrame* udp;
+    tcpFrame* tcp;
+    bool unicast, broadcast;
+    uint8_t i;
+
+    etherParsePacket(packet);
+    packet->protocol = ETHER_UNKNOWN;
+    packet->tcpFlags = 0;
+    packet->port = 0;
+
+    if (etherIsArpRequest(packet))
+        packet->protocol = ETHER_ARP_REQUEST;
+    else if (etherIsArpResponse(packet))
+        packet->protocol = ETHER_ARP_RESPONSE;
+    else if (packet->verified ? ether->frameType == htons(IPv4_frame) : etherIsIp(packet))
+    {
+        unicast = broadcast = true;
+        for (i = 0; i < IP_ADD_LENGTH; i++)
+        {
+            unicast &= (ip->destIp[i] == ipAddress[i]);
+            broadcast &= (ip->destIp[i] == 0xFF);
+        }
+        switch (ip->protocol)
+        {
+        case 0x01:
+            icmp = (icmpFrame*)(packet->data + packet->l4Offset);
+            if (unicast && icmp->type == 8)
+                packet->protocol = ETHER_ICMP_ECHO;
+            break;
+        case 0x11:
+            udp = (udpFrame*)(packet->data + packet->l4Offset);
+            if ((unicast || broadcast) && (packet->verified || etherIsUdp(packet)))
+            {
+                packet->port = ntohs(udp->destPort);
+                if (etherIsDhcp(packet))
+                    packet->protocol = ETHER_DHCP;
+                else
+                    packet->protocol = ETHER_UDP;
+            }
+            break;
+        case 0x06:
+            tcp = (tcpFrame*)(packet->data + packet->l4Offset);
+            if (unicast)
+            {
+                packet->port = ntohs(tcp->destPort);
+                packet->tcpFlags = ntohs(tcp->offsetAndFlags) & 0x00FF;
+                packet->protocol = ETHER_TCP;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return (etherProtocol)packet->protocol;
+}
+uint32_t htonl(const uint32_t value)
+{
+    return htons(value >> 16) | (htons((uint16_t) value) << 16);
+}
+
+// Empties the connection table
+void tcpInit()
+{
+    uint8_t i;
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        tcpConnections[i].state = TCP_CLOSED;
+        tcpConnections[i].hashNext = TCP_NO_CONNECTION;
+    }
+    for (i = 0; i < TCP_HASH_SIZE; i++)
+        tcpHashHead[i] = TCP_NO_CONNECTION;
+    tcpReclaim.inUse = 0;
+}
+
+// Returns the hash bucket of a connection
+uint8_t tcpHash(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort)
+{
+    uint32_t h;
+    h = remoteIp[0] | (remoteIp[1] << 8) | (remoteIp[2] << 16) | ((uint32_t)remoteIp[3] << 24);
+    h ^= ((uint32_t)remotePort << 16) | localPort;
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (TCP_HASH_SIZE - 1);
+}
+
+// Looks up the control block of a connection
+// Only the connections sharing a bucket are compared, so the cost per segment
+// does not grow with the table
+// Returns 0 if no connection matches
+tcpConnection* tcpFind(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort)
+{
+    uint8_t index = tcpHashHead[tcpHash(remoteIp, remotePort, localPort)];
+    tcpConnection* conn;
+    uint8_t i;
+    bool ok;
+    while (index != TCP_NO_CONNECTION)
+    {
+        conn = &tcpConnections[index];
+        ok = (conn->remotePort == remotePort && conn->localPort == localPort);
+        for (i = 0; ok && i < IP_ADD_LENGTH; i++)
+            ok = (conn->remoteIp[i] == remoteIp[i]);
+        if (ok)
+            return conn;
+        index = conn->hashNext;
+    }
+    return 0;
+}
+
+// Unlinks a control block from its hash bucket and marks it free
+void tcpFree(tcpConnection* conn)
+{
+    uint8_t* link = &tcpHashHead[tcpHash(conn->remoteIp, conn->remotePort, conn->localPort)];
+    uint8_t index = conn - tcpConnections;
+    while (*link != TCP_NO_CONNECTION)
+    {
+        if (*link == index)
+        {
+            *link = conn->hashNext;
+            break;
+        }
+        link = &tcpConnections[*link].hashNext;
+    }
+    conn->state = TCP_CLOSED;
+    conn->hashNext = TCP_NO_CONNECTION;
+    tcpReclaim.inUse--;
+}
+
+// Takes a free control block in SYN_RCVD and links it into its hash bucket
+// When the table is full, the oldest connection in TIME_WAIT is recycled
+// Returns 0 if every connection is in use
+tcpConnection* tcpAlloc(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort)
+{
+    tcpConnection* conn = 0;
+    uint32_t now = getTimerMs();
+    uint8_t i, bucket;
+    for (i = 0; conn == 0 && i < TCP_MAX_CONNECTIONS; i++)
+        if (tcpConnections[i].state == TCP_CLOSED)
+            conn = &tcpConnections[i];
+    if (conn == 0)
+    {
+        for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+            if (tcpConnections[i].state == TCP_TIME_WAIT
+                && (conn == 0 || now - tcpConnections[i].rxTime > now - conn->rxTime))
+                conn = &tcpConnections[i];
+        if (conn == 0)
+        {
+            tcpReclaim.refused++;
+            return 0;
+        }
+        tcpReclaim.recycled++;
+        tcpFree(conn);
+    }
+    if (++tcpReclaim.inUse > tcpReclaim.peak)
+        tcpReclaim.peak = tcpReclaim.inUse;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        conn->remoteIp[i] = remoteIp[i];
+    conn->remotePort = remotePort;
+    conn->localPort = localPort;
+    conn->state = TCP_SYN_RCVD;
+    conn->commandLength = 0;
+    conn->commandPending = false;
+    conn->txCount = 0;
+    conn->txStart = conn->txBuffered = 0;
+    conn->txChunkHead = conn->txChunkCount = 0;
+    conn->rxRangeCount = 0;
+    conn->rto = TCP_RTO_INITIAL;
+    conn->srtt = conn->rttvar = 0;
+    conn->rttValid = false;
+    conn->rttTiming = false;
+    conn->finSent = false;
+    conn->ackPending = false;
+    conn->retries = 0;
+    conn->retransmits = 0;
+    conn->rxTime = now;
+    conn->probes = 0;
+    bucket = tcpHash(remoteIp, remotePort, localPort);
+    conn->hashNext = tcpHashHead[bucket];
+    tcpHashHead[bucket] = conn - tcpConnections;
+    return conn;
+}
+
+// Finds queued data at an offset from sndUna
+// Returns the number of contiguous bytes at piece
+uint16_t tcpGetPiece(tcpConnection* conn, uint32_t offset, const uint8_t** piece)
+{
+    tcpChunk* chunk;
+    uint16_t ring = conn->txStart, size;
+    uint8_t i;
+    for (i = 0; i < conn->txChunkCount; i++)
+    {
+        chunk = &conn->txChunks[(conn->txChunkHead + i) % TCP_TX_CHUNKS];
+        if (offset < chunk->size)
+        {
+            if (chunk->data != 0)
+            {
+                *piece = chunk->data + offset;
+                return chunk->size - offset;
+            }
+            // copied data may wrap around the end of the ring
+            ring = (ring + offset) % TCP_TX_BUFFER;
+            *piece = &conn->txBuffer[ring];
+            size = chunk->size - offset;
+            if (size > TCP_TX_BUFFER - ring)
+                size = TCP_TX_BUFFER - ring;
+            return size;
+        }
+        offset -= chunk->size;
+        if (chunk->data == 0)
+            ring = (ring + chunk->size) % TCP_TX_BUFFER;
+    }
+    return 0;
+}
+
+// Builds the ether, ip and tcp headers of a segment in tcpTxData
+// An mss option is added when mss is not zero; size bytes of data, whose
+// folded sum is dataSum, are written after the headers by the caller
+// Returns the size of the headers
+uint16_t tcpBuildHeaders(const uint8_t remoteMac[], const uint8_t remoteIp[], uint16_t remotePort,
+                         uint16_t localPort, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t mss,
+                         uint16_t size, uint32_t dataSum)
+{
+    etherFrame* ether = (etherFrame*)tcpTxData;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ipHeaderLength);
+    uint8_t i, lenOpts = 0;
+    uint16_t tcpSize;
+    uint32_t sum;
+
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        ether->destAddress[i] = remoteMac[i];
+        ether->sourceAddress[i] = macAddress[i];
+    }
+    ether->frameType = htons(IPv4_frame);
+
+    if (mss != 0)
+    {
+        tcp->optionsPaddingData[0] = 2;
+        tcp->optionsPaddingData[1] = 4;
+        tcp->optionsPaddingData[2] = HIBYTE(mss);
+        tcp->optionsPaddingData[3] = LOBYTE(mss);
+        lenOpts = 4;
+    }
+    tcpSize = sizeof(tcpFrame) + lenOpts + size;
+
+    ip->revSize = 0x45;
+    ip->typeOfService = 0x00;
+    ip->length = htons(ipHeaderLength + tcpSize);
+    ip->id = htons(ipId++);
+    ip->flagsAndOffset = 0x0000;
+    ip->ttl = 64;
+    ip->protocol = ip_tcp;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ip->destIp[i] = remoteIp[i];
+        ip->sourceIp[i] = ipAddress[i];
+    }
+    etherCalcIpChecksum(ip);
+
+    tcp->sourcePort = htons(localPort);
+    tcp->destPort = htons(remotePort);
+    tcp->sequenceNum = htonl(seq);
+    tcp->ackNum = (flags & TCP_ACK) != 0 ? htonl(ack) : 0;
+    tcp->offsetAndFlags = htons((((sizeof(tcpFrame) + lenOpts) / 4) << 12) | flags);
+    tcp->windowSize = htons(TCP_WINDOW);
+    tcp->check = 0;
+    tcp->urgentPointer = 0;
+    sum = etherSumPseudoHeader(ip, tcpSize);
+    sum = etherSumWords(sum, tcp, tcpSize - size);
+    tcp->check = getEtherChecksum(sum + dataSum);
+    return etherHeaderLength + ipHeaderLength + tcpSize - size;
+}
+
+// Builds a segment for a connection and sends it
+// The headers are built in tcpTxData and the data is streamed from the
+// connection's queue at sndNxt straight into the ENC28J60, so a segment is
+// never assembled in SRAM; the data is summed from the same pieces first, as
+// patching the checksum into the transmit buffer afterwards costs more SPI
+// traffic than a second pass over memory
+// Sequence space used by the data, SYN and FIN is consumed from sndNxt
+// The retransmit timer is started if nothing else was outstanding, and a
+// segment carrying new data is timed when no rtt sample is in progress
+void tcpSendSegment(tcpConnection* conn, uint8_t flags, uint16_t size)
+{
+    const uint8_t* piece;
+    uint16_t headerSize, pieceSize, done;
+    uint32_t sum, dataSum = 0;
+
+    if (size > TCP_TX_MSS)
+        size = TCP_TX_MSS;
+
+    // a piece starting at an odd offset has its bytes swapped within words
+    for (done = 0; done < size; done += pieceSize)
+    {
+        pieceSize = tcpGetPiece(conn, conn->sndNxt - conn->sndUna + done, &piece);
+        if (pieceSize > size - done)
+            pieceSize = size - done;
+        sum = etherFoldSum(etherSumWords(0, piece, pieceSize));
+        if ((done & 1) != 0)
+            sum = ((sum & 0xFF) << 8) | (sum >> 8);
+        dataSum += sum;
+    }
+
+    // advertise our mss on syn
+    headerSize = tcpBuildHeaders(conn->remoteMac, conn->remoteIp, conn->remotePort, conn->localPort,
+                                 conn->sndNxt, conn->rcvNxt, flags,
+                                 (flags & TCP_SYN) != 0 ? TCP_RX_MSS : 0, size, dataSum);
+
+    etherOpenPacket();
+    etherWritePacket(tcpTxData, headerSize);
+    for (done = 0; done < size; done += pieceSize)
+    {
+        pieceSize = tcpGetPiece(conn, conn->sndNxt - conn->sndUna + done, &piece);
+        if (pieceSize > size - done)
+            pieceSize = size - done;
+        etherWritePacket(piece, pieceSize);
+    }
+    etherClosePacket();
+
+    if ((flags & TCP_ACK) != 0)
+        conn->ackPending = false;
+    if (size > 0 || (flags & (TCP_SYN | TCP_FIN)) != 0)
+    {
+        if (conn->sndUna == conn->sndMax)
+            conn->rtoStart = getTimerMs();
+        if (!conn->rttTiming && conn->sndNxt == conn->sndMax)
+        {
+            conn->rttTiming = true;
+            conn->rttSeq = conn->sndNxt;
+            conn->rttStart = getTimerMs();
+        }
+        conn->sndNxt += size;
+        if ((flags & TCP_SYN) != 0)
+            conn->sndNxt++;
+        if ((flags & TCP_FIN) != 0)
+        {
+            conn->sndNxt++;
+            conn->finSent = true;
+        }
+        if (SEQ_GT(conn->sndNxt, conn->sndMax))
+            conn->sndMax = conn->sndNxt;
+    }
+}
+
+// Sends a segment without data to the sender of a segment, for replies sent
+// without a connection
+void tcpSendReply(etherPacket* packet, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t mss)
+{
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)(packet->data + packet->l4Offset);
+    uint16_t size;
+    size = tcpBuildHeaders(ether->sourceAddress, ip->sourceIp, ntohs(tcp->sourcePort), ntohs(tcp->destPort),
+                           seq, ack, flags, mss, 0, 0);
+    etherPutPacket(tcpTxData, size);
+}
+
+// Answers a segment that has no connection with a reset (RFC 793 p. 36)
+void tcpSendReset(etherPacket* packet, uint16_t dataSize)
+{
+    tcpFrame* tcp = (tcpFrame*)(packet->data + packet->l4Offset);
+    uint32_t ack;
+    if ((packet->tcpFlags & TCP_ACK) != 0)
+        tcpSendReply(packet, ntohl(tcp->ackNum), 0, TCP_RST, 0);
+    else
+    {
+        ack = ntohl(tcp->sequenceNum) + dataSize;
+        if ((packet->tcpFlags & TCP_SYN) != 0)
+            ack++;
+        if ((packet->tcpFlags & TCP_FIN) != 0)
+            ack++;
+        tcpSendReply(packet, 0, ack, TCP_RST | TCP_ACK, 0);
+    }
+}
+
+// Sends the queued data that has not been sent yet, followed by a FIN once
+// the connection is closing
+// Segments of up to the peer's mss are sent back to back until the peer's
+// window is full; a short segment is held back while others are in flight
+// (RFC 1122 sender sws avoidance), and a closed window is probed with one
+// byte that is then retransmitted on the RTO timer
+// Nothing but the SYN is sent until the SYN has been acknowledged
+void tcpOutput(tcpConnection* conn)
+{
+    uint32_t unsent;
+    uint16_t sent, size;
+    uint8_t flags;
+    bool fin = conn->state == TCP_FIN_WAIT_1 || conn->state == TCP_CLOSING || conn->state == TCP_LAST_ACK;
+    if (conn->sndUna == conn->iss)
+        return;
+    // an acknowledged fin is not sent again
+    if (conn->finSent && conn->sndUna == conn->sndMax)
+        return;
+    sent = conn->sndNxt - conn->sndUna;
+    // sent is past the data once the fin is out
+    while (sent < conn->txCount || (fin && sent == conn->txCount))
+    {
+        unsent = conn->txCount - sent;
+        size = unsent > conn->mss ? conn->mss : unsent;
+        if (sent + size > conn->sndWnd)
+            size = sent < conn->sndWnd ? conn->sndWnd - sent : 0;
+        if (size == 0 && unsent > 0)
+        {
+            if (conn->sndWnd != 0 || sent != 0)
+                break;
+            size = 1;
+        }
+        else if (size < unsent && size < conn->mss && sent != 0)
+            break;
+        flags = TCP_ACK;
+        if (size > 0)
+            flags |= TCP_PSH;
+        if (fin && size == unsent)
+            flags |= TCP_FIN;
+        tcpSendSegment(conn, flags, size);
+        sent = conn->sndNxt - conn->sndUna;
+    }
+}
+
+// Adds a run to the end of a connection's queue, extending the last one when
+// it is copied data too
+// Returns false if there is no room for another run
+bool tcpAddChunk(tcpConnection* conn, const uint8_t data[], uint16_t size)
+{
+    tcpChunk* last = 0;
+    if (conn->txChunkCount > 0)
+        last = &conn->txChunks[(conn->txChunkHead + conn->txChunkCount - 1) % TCP_TX_CHUNKS];
+    if (data == 0 && last != 0 && last->data == 0 && last->size <= 0xFFFF - size)
+        last->size += size;
+    else if (conn->txChunkCount == TCP_TX_CHUNKS)
+        return false;
+    else
+    {
+        last = &conn->txChunks[(conn->txChunkHead + conn->txChunkCount) % TCP_TX_CHUNKS];
+        last->data = data;
+        last->size = size;
+        conn->txChunkCount++;
+    }
+    conn->txCount += size;
+    return true;
+}
+
+// Copies data to the end of a connection's queue
+// Returns the number of bytes that fit
+uint16_t tcpQueue(tcpConnection* conn, const uint8_t data[], uint16_t size)
+{
+    uint16_t i, index;
+    if (size > TCP_TX_BUFFER - conn->txBuffered)
+        size = TCP_TX_BUFFER - conn->txBuffered;
+    if (size == 0 || !tcpAddChunk(conn, 0, size))
+        return 0;
+    index = (conn->txStart + conn->txBuffered) % TCP_TX_BUFFER;
+    for (i = 0; i < size; i++)
+    {
+        conn->txBuffer[index] = data[i];
+        if (++index == TCP_TX_BUFFER)
+            index = 0;
+    }
+    conn->txBuffered += size;
+    return size;
+}
+
+// Drops acknowledged data from the front of a connection's queue
+void tcpDropQueue(tcpConnection* conn, uint32_t size)
+{
+    tcpChunk* chunk;
+    uint16_t n;
+    while (size > 0 && conn->txChunkCount > 0)
+    {
+        chunk = &conn->txChunks[conn->txChunkHead];
+        n = size < chunk->size ? size : chunk->size;
+        if (chunk->data == 0)
+        {
+            conn->txStart = (conn->txStart + n) % TCP_TX_BUFFER;
+            conn->txBuffered -= n;
+        }
+        else
+            chunk->data += n;
+        chunk->size -= n;
+        conn->txCount -= n;
+        size -= n;
+        if (chunk->size == 0)
+        {
+            conn->txChunkHead = (conn->txChunkHead + 1) % TCP_TX_CHUNKS;
+            conn->txChunkCount--;
+        }
+    }
+}
+
+// Updates the retransmission timeout with an rtt sample (Jacobson/Karels,
+// RFC 6298), keeping srtt scaled by 8 and rttvar by 4 as in BSD
+void tcpUpdateRtt(tcpConnection* conn, uint32_t rtt)
+{
+    int32_t delta;
+    uint32_t rto;
+    if (!conn->rttValid)
+    {
+        conn->srtt = rtt << 3;
+        conn->rttvar = rtt << 1;
+        conn->rttValid = true;
+    }
+    else
+    {
+        delta = rtt - (conn->srtt >> 3);
+        conn->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        delta -= conn->rttvar >> 2;
+        conn->rttvar += delta;
+    }
+    rto = (conn->srtt >> 3) + conn->rttvar;
+    if (rto < TCP_RTO_MIN)
+        rto = TCP_RTO_MIN;
+    if (rto > TCP_RTO_MAX)
+        rto = TCP_RTO_MAX;
+    conn->rto = rto;
+}
+
+// Handles an acknowledgment number and window
+// Acknowledged data is dropped from the queue, the rtt sample is taken if its
+// segment was covered (Karn's rule: retransmissions are never timed), and the
+// retransmit timer restarts for whatever is still outstanding
+// A window probe answered with a closed window does not count toward
+// TCP_MAX_RETRIES, so the peer is probed for as long as it answers
+void tcpProcessAck(tcpConnection* conn, uint32_t ack, uint16_t window)
+{
+    uint32_t acked;
+    if (SEQ_LT(ack, conn->sndUna) || SEQ_GT(ack, conn->sndMax))
+        return;
+    conn->sndWnd = window;
+    if (ack == conn->sndUna)
+    {
+        if (window == 0)
+            conn->retries = 0;
+        return;
+    }
+    acked = ack - conn->sndUna;
+    // the syn and fin take no room in the queue
+    if (conn->sndUna == conn->iss)
+        acked--;
+    tcpDropQueue(conn, acked);
+    if (conn->rttTiming && SEQ_GT(ack, conn->rttSeq))
+    {
+        conn->rttTiming = false;
+        tcpUpdateRtt(conn, getTimerMs() - conn->rttStart);
+    }
+    conn->sndUna = ack;
+    if (SEQ_LT(conn->sndNxt, ack))
+        conn->sndNxt = ack;
+    conn->retries = 0;
+    conn->rtoStart = getTimerMs();
+}
+
+// Runs one event through the state machine table
+void tcpApplyEvent(tcpConnection* conn, uint8_t event)
+{
+    const tcpTransition* t = &tcpTransitions[conn->state][event];
+    conn->state = t->next;
+    switch (t->action)
+    {
+    case TCP_SEND_SYNACK:
+        // a repeated syn gets the same syn/ack again, which is not timed
+        conn->sndNxt = conn->sndUna;
+        conn->rttTiming = false;
+        tcpSendSegment(conn, TCP_SYN | TCP_ACK, 0);
+        break;
+    case TCP_SEND_ACK:
+        tcpSendSegment(conn, TCP_ACK, 0);
+        break;
+    case TCP_SEND_FIN:
+        tcpOutput(conn);
+        break;
+    case TCP_FREE:
+        tcpFree(conn);
+        break;
+    default:
+        break;
+    }
+}
+
+// Handles telnet data received on a connection
+// Option requests are refused, except suppress go ahead, and the data is
+// echoed back with the replies in place; text is collected into a command
+// that is reported by telnetGetCommand() once a carriage return arrives
+void telnetReceive(tcpConnection* conn, uint8_t data[], uint16_t size)
+{
+    uint16_t i = 0;
+    while (i < size)
+    {
+        if (data[i] == 0xFF && i + 1 < size && data[i + 1] == 0xFA)
+        {
+            // suboption; skip to IAC SE
+            i += 2;
+            while (i < size && !(data[i - 1] == 0xFF && data[i] == 0xF0))
+                i++;
+            i++;
+        }
+        else if (data[i] == 0xFF && i + 2 < size)
+        {
+            /*
+             * WILL = 0xfb
+             * WONT = 0xfc
+             * DO   = 0xfd
+             * DONT = 0xfe
+             */
+            if (data[i + 2] == 0x03)       // suppress go ahead option
+                data[i + 1] = will_wont(data[i + 1]) ? 0xfd : 0xfb;
+            else
+                data[i + 1] = will_wont(data[i + 1]) ? 0xfe : 0xfc;
+            i += 3;
+        }
+        else
+        {
+            putcUart0(data[i]);
+            if (data[i] == '\r')
+            {
+                conn->command[conn->commandLength] = '\0';
+                conn->commandPending = true;
+                conn->commandLength = 0;
+            }
+            else if (data[i] != '\n' && data[i] != '\0' && conn->commandLength < TCP_COMMAND_LENGTH - 1)
+                conn->command[conn->commandLength++] = data[i];
+            i++;
+        }
+    }
+    tcpQueue(conn, data, size);
+    tcpOutput(conn);
+}
+
+// Returns the mss option of a syn, limited to TCP_TX_MSS
+// A missing or zero mss gives the RFC 1122 default
+uint16_t tcpGetMss(tcpFrame* tcp, uint16_t headerSize)
+{
+    uint8_t* option = tcp->optionsPaddingData;
+    uint8_t* end = (uint8_t*)tcp + headerSize;
+    uint16_t mss = TCP_DEFAULT_MSS;
+    while (option < end && *option != 0)
+    {
+        if (*option == 1)
+        {
+            option++;
+            continue;
+        }
+        if (option + 1 >= end || option[1] < 2)
+            break;
+        if (*option == 2 && option[1] == 4 && option + 4 <= end)
+            mss = (option[2] << 8) | option[3];
+        option += option[1];
+    }
+    if (mss == 0)
+        mss = TCP_DEFAULT_MSS;
+    if (mss > TCP_TX_MSS)
+        mss = TCP_TX_MSS;
+    return mss;
+}
+
+// Holds a segment that arrived ahead of rcvNxt
+// The data is stored at its sequence number modulo TCP_RX_BUFFER and its run
+// is merged with any it overlaps or touches; data past the window, or a new
+// run when TCP_RX_RANGES are already held, is dropped for the peer to resend
+void tcpHoldSegment(tcpConnection* conn, uint32_t seq, const uint8_t data[], uint16_t size)
+{
+    tcpRange* range;
+    uint32_t end, limit = conn->rcvNxt + TCP_RX_BUFFER;
+    uint16_t i;
+    uint8_t r = 0, first, last;
+    if (!SEQ_LT(seq, limit))
+        return;
+    if (SEQ_GT(seq + size, limit))
+        size = limit - seq;
+    end = seq + size;
+
+    // runs before the new one, then those it overlaps or touches
+    while (r < conn->rxRangeCount && SEQ_LT(conn->rxRanges[r].seq + conn->rxRanges[r].size, seq))
+        r++;
+    first = last = r;
+    while (last < conn->rxRangeCount && SEQ_LEQ(conn->rxRanges[last].seq, end))
+        last++;
+    if (first == last && conn->rxRangeCount == TCP_RX_RANGES)
+        return;
+
+    for (i = 0; i < size; i++)
+        conn->rxBuffer[(seq + i) & (TCP_RX_BUFFER - 1)] = data[i];
+
+    if (first < last)
+    {
+        if (SEQ_LT(conn->rxRanges[first].seq, seq))
+            seq = conn->rxRanges[first].seq;
+        range = &conn->rxRanges[last - 1];
+        if (SEQ_GT(range->seq + range->size, end))
+            end = range->seq + range->size;
+        // collapse the merged runs into the first
+        for (r = last; r < conn->rxRangeCount; r++)
+            conn->rxRanges[r - (last - first - 1)] = conn->rxRanges[r];
+        conn->rxRangeCount -= last - first - 1;
+    }
+    else
+    {
+        for (r = conn->rxRangeCount; r > first; r--)
+            conn->rxRanges[r] = conn->rxRanges[r - 1];
+        conn->rxRangeCount++;
+    }
+    conn->rxRanges[first].seq = seq;
+    conn->rxRanges[first].size = end - seq;
 }
 
-void etherDisableDhcpMode()
+// Takes in-order data and any held data it makes contiguous
+// rcvNxt is advanced past all of it before the data is passed on, so the
+// echo carries the full cumulative ack
+void tcpReceiveData(tcpConnection* conn, uint8_t data[], uint16_t size)
 {
-    writeEeprom(0, DHCP_DISABLED);
-    etherSetIpAddress(0,0,0,0);
-    etherSetIpSubnetMask(0,0,0, 0);
-    etherSetIpGatewayAddress(0,0,0,0);
-    etherSetIpDnsServer(0,0,0,0);
-}
+    uint32_t next = conn->rcvNxt + size, end;
+    uint16_t n, index;
+    bool filled = false;
 
-bool etherIsDhcpEnabled()
-{
-    //read eeprom and check for either 0xFFFFFFFF
-    uint32_t result;
-    result = readEeprom(FIRST_BLOCK_NO_OFFSET);
+    while (conn->rxRangeCount > 0 && SEQ_LEQ(conn->rxRanges[0].seq, next))
+    {
+        end = conn->rxRanges[0].seq + conn->rxRanges[0].size;
+        if (SEQ_GT(end, next))
+            next = end;
+        conn->rxRangeCount--;
+        for (n = 0; n < conn->rxRangeCount; n++)
+            conn->rxRanges[n] = conn->rxRanges[n + 1];
+        filled = true;
+    }
 
-    if (result == DHCP_ENABLED)
-        return true;
+    // the ack is delayed so it can ride on the echo; every second segment
+    // is acked at once (RFC 1122 4.2.3.2), as is one that fills a gap
+    // (RFC 5681 4.2) if the echo did not carry it
+    end = conn->rcvNxt + size;
+    conn->rcvNxt = next;
+    if (conn->ackPending)
+        tcpSendSegment(conn, TCP_ACK, 0);
     else
-        return false;
-}
-// Determines if the IP address is valid
-bool etherIsIpValid()
-{
-    return ipAddress[0] || ipAddress[1] || ipAddress[2] || ipAddress[3];
-}
+    {
+        conn->ackPending = true;
+        conn->ackStart = getTimerMs();
+    }
+    telnetReceive(conn, data, size);
 
-// Sets IP address
-void etherSetIpAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
-{
-    ipAddress[0] = ip0;
-    ipAddress[1] = ip1;
-    ipAddress[2] = ip2;
-    ipAddress[3] = ip3;
+    // held data, in at most two pieces as the buffer wraps
+    while (SEQ_LT(end, next) && conn->state != TCP_CLOSED)
+    {
+        index = end & (TCP_RX_BUFFER - 1);
+        n = next - end;
+        if (n > TCP_RX_BUFFER - index)
+            n = TCP_RX_BUFFER - index;
+        telnetReceive(conn, &conn->rxBuffer[index], n);
+        end += n;
+    }
+    if (filled && conn->ackPending)
+        tcpSendSegment(conn, TCP_ACK, 0);
 }
 
-// Gets IP address
-void etherGetIpAddress(uint8_t ip[4])
+// Mixes a value into the pool the cookie keys are drawn from
+// The part has no random number generator, so the pool is fed the arrival
+// time in us of every received frame; the jitter of the peers and the wire
+// makes it differ from boot to boot and from what an attacker can predict
+void tcpCookieStir(uint32_t value)
 {
-    uint8_t i;
-    for (i = 0; i < 4; i++)
-        ip[i] = ipAddress[i];
+    tcpCookiePool = (tcpCookiePool ^ value) * 0x9E3779B1;
+    tcpCookiePool ^= tcpCookiePool >> 15;
 }
 
-// Sets IP subnet mask
-void etherSetIpSubnetMask(uint8_t mask0, uint8_t mask1, uint8_t mask2, uint8_t mask3)
+// Returns the key for a time slot, drawing a new one the first time the slot
+// is seen
+const uint32_t* tcpCookieKey(uint32_t slot)
 {
-    ipSubnetMask[0] = mask0;
-    ipSubnetMask[1] = mask1;
-    ipSubnetMask[2] = mask2;
-    ipSubnetMask[3] = mask3;
+    uint8_t i = slot & 1;
+    if (!tcpCookieKeyValid[i] || tcpCookieKeySlot[i] != slot)
+    {
+        tcpCookieStir(getTimerUs());
+        tcpCookieKeys[i][0] = tcpCookiePool;
+        tcpCookieStir(slot);
+        tcpCookieKeys[i][1] = tcpCookiePool;
+        tcpCookieKeySlot[i] = slot;
+        tcpCookieKeyValid[i] = true;
+    }
+    return tcpCookieKeys[i];
 }
 
-// Gets IP subnet mask
-void etherGetIpSubnetMask(uint8_t mask[4])
-{
-    uint8_t i;
-    for (i = 0; i < 4; i++)
-        mask[i] = ipSubnetMask[i];
-}
-void etherSetIpDnsServer(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
+// Draws the key of each slot as it starts, so keys are replaced on time even
+// when no SYN arrives and cookies of older slots stop matching
+void tcpCookieRekey()
 {
-    ipDnsServer[0] = ip0;
-    ipDnsServer[1] = ip1;
-    ipDnsServer[2] = ip2;
-    ipDnsServer[3] = ip3;
+    tcpCookieKey(getTimerMs() >> TCP_COOKIE_SHIFT);
 }
-void etherGetIpDnsServer(uint8_t ip[4])
+
+// Returns the keyed hash of a connection's addresses, the peer's initial
+// sequence number and a time slot
+// This is a multiply-xorshift mix rather than a cryptographic mac, which is
+// enough to keep a blind flood from guessing valid cookies
+uint32_t tcpCookieHash(const uint32_t key[], const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort,
+                       uint32_t peerIss, uint32_t slot)
 {
+    uint32_t words[4], h = key[0];
     uint8_t i;
+    words[0] = remoteIp[0] | (remoteIp[1] << 8) | (remoteIp[2] << 16) | ((uint32_t)remoteIp[3] << 24);
+    words[1] = ((uint32_t)remotePort << 16) | localPort;
+    words[2] = peerIss;
+    words[3] = slot;
     for (i = 0; i < 4; i++)
-        ip[i] = ipDnsServer[i];
-}
-// Sets IP gateway address
-void etherSetIpGatewayAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
-{
-    ipGwAddress[0] = ip0;
-    ipGwAddress[1] = ip1;
-    ipGwAddress[2] = ip2;
-    ipGwAddress[3] = ip3;
+    {
+        h ^= words[i];
+        h *= 0x9E3779B1;
+        h ^= h >> 15;
+        h += key[1];
+    }
+    h ^= h >> 13;
+    h *= 0x85EBCA6B;
+    h ^= h >> 16;
+    return h;
 }
 
-// Gets IP gateway address
-void etherGetIpGatewayAddress(uint8_t ip[4])
+// Answers a SYN to the listening port without creating any state
+// The initial sequence number is the cookie: a 5-bit time slot, a 3-bit index
+// into tcpCookieMss and 24 bits of keyed hash (as in Linux syncookies)
+void tcpSendCookie(etherPacket* packet, uint32_t peerIss, uint16_t mss)
 {
-    uint8_t i;
-    for (i = 0; i < 4; i++)
-        ip[i] = ipGwAddress[i];
+    ipFrame* ip = (ipFrame*)(packet->data + packet->l3Offset);
+    tcpFrame* tcp = (tcpFrame*)(packet->data + packet->l4Offset);
+    uint32_t slot = getTimerMs() >> TCP_COOKIE_SHIFT, iss;
+    uint8_t index = 7;
+    while (index > 0 && tcpCookieMss[index] > mss)
+        index--;
+    iss = ((slot & 0x1F) << 27) | ((uint32_t)index << 24)
+        | (tcpCookieHash(tcpCookieKey(slot), ip->sourceIp, ntohs(tcp->sourcePort), ntohs(tcp->destPort),
+                         peerIss, slot) & 0xFFFFFF);
+    tcpSendReply(packet, iss, peerIss + 1, TCP_SYN | TCP_ACK, TCP_RX_MSS);
 }
 
-// Sets MAC address
-void etherSetMacAddress(uint8_t mac0, uint8_t mac1, uint8_t mac2, uint8_t mac3, uint8_t mac4, uint8_t mac5)
+// Checks the ack of a segment with no connection against the cookie that
+// would have been sent for it in the current or previous time slot
+// Returns the peer's mss, or 0 if the ack is not a valid cookie
+uint16_t tcpCheckCookie(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort, uint32_t seq, uint32_t ack)
 {
-    macAddress[0] = mac0;
-    macAddress[1] = mac1;
-    macAddress[2] = mac2;
-    macAddress[3] = mac3;
-    macAddress[4] = mac4;
-    macAddress[5] = mac5;
+    uint32_t cookie = ack - 1;
+    uint32_t slot = getTimerMs() >> TCP_COOKIE_SHIFT;
+    uint32_t age = (slot - (cookie >> 27)) & 0x1F;
+    if (age > 1)
+        return 0;
+    slot -= age;
+    // no key means no cookie was sent in that slot
+    if (!tcpCookieKeyValid[slot & 1] || tcpCookieKeySlot[slot & 1] != slot)
+        return 0;
+    if (((tcpCookieHash(tcpCookieKeys[slot & 1], remoteIp, remotePort, localPort, seq - 1, slot) ^ cookie)
+         & 0xFFFFFF) != 0)
+        return 0;
+    return tcpCookieMss[(cookie >> 24) & 7];
 }
 
-// Gets MAC address
-void etherGetMacAddress(uint8_t mac[6])
+// Accepts connections on a local port (0 to stop listening)
+// Connections are only created once the handshake completes, so a flood of
+// SYNs costs no connection state; the cookie keys are redrawn every time slot
+void tcpListen(uint16_t port)
 {
     uint8_t i;
-    for (i = 0; i < 6; i++)
-        mac[i] = macAddress[i];
+    tcpListenPort = port;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        tcpCookieStir(macAddress[i]);
+    if (port != 0)
+        startTimer(&tcpCookieTimer, 1UL << TCP_COOKIE_SHIFT, 1UL << TCP_COOKIE_SHIFT, tcpCookieRekey);
+    else
+        stopTimer(&tcpCookieTimer);
 }
-void dhcpSendMessage(uint8_t packet[], uint8_t type, uint8_t ipAdd[])
+
+// Handles a received tcp segment
+// Flags are turned into events in RFC 793 order (rst, syn, ack, fin) and run
+// through tcpTransitions; in-order data is passed to telnetReceive()
+void tcpProcessSegment(etherPacket* packet)
 {
-    uint8_t i = 0;
-    uint16_t initial_id = 0x7147;
-    /*initialize pointers*/
-    //ether frame
-    etherFrame* ether = (etherFrame*)packet;
-//    if (type == DHCPREQUEST && ipAdd[0] == 255)
-//    {
-//        for (i = 0; i < HW_ADD_LENGTH; i++)
-//            macDhcpServer[i] = ether->sourceAddress[i];
-//
-//    }
-    while ( i < HW_ADD_LENGTH )
-    {
-        ether->destAddress[i] = broadcast_mac[i];
-        ether->sourceAddress[i] = macAddress[i];
-        i++;
-    }
-    i = 0;
-    ether->frameType = htons(IPv4_frame);
+    etherFrame* ether = (etherFrame*)packet->data;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)(packet->data + packet->l4Offset);
+    tcpConnection* conn;
+    uint8_t flags = packet->tcpFlags;
+    uint16_t ipSize, ipLength, headerSize, dataSize, size, mss;
+    uint32_t seq, ack, start;
+    uint8_t* data;
+    uint8_t i;
 
+    // a segment that is not checksummed (a fragment, or one read without the
+    // dma checksum) may claim sizes past the frame, and its data is rewritten
+    // in place, so the sizes are checked before anything uses them
+    ipSize = packet->l4Offset - packet->l3Offset;
+    ipLength = ntohs(ip->length);
+    if (packet->l3Offset + ipLength > packet->size || ipLength < ipSize + sizeof(tcpFrame))
+        return;
+    headerSize = (ntohs(tcp->offsetAndFlags) >> 12) * 4;
+    if (headerSize < sizeof(tcpFrame) || headerSize > ipLength - ipSize)
+        return;
+    dataSize = ipLength - ipSize - headerSize;
+    seq = ntohl(tcp->sequenceNum);
+    ack = ntohl(tcp->ackNum);
 
-    //ip packet
-    ipFrame* ip = (ipFrame*)&ether->data;
-    ip->revSize = 0x45 ;
-    ip->typeOfService = 0x00;
-    ip->id = htons(initial_id++);
-    ip->flagsAndOffset = 0x0000;
-    ip->ttl = 64;
-    ip->protocol = ip_udp;
-    ip->headerChecksum = 0;
-    while ( i < IP_ADD_LENGTH )
+    conn = tcpFind(ip->sourceIp, ntohs(tcp->sourcePort), packet->port);
+    if (conn == 0)
     {
-        ip->sourceIp[i] = ipAddress[i];
-        ip->destIp[i] = ipAdd[i];
-        i++;
+        if ((flags & TCP_RST) != 0)
+            return;
+        // a SYN gets a cookie; the connection is made in SYN_RCVD once an ack
+        // returns a valid one, and the ack below completes the handshake
+        if (tcpListenPort != 0 && packet->port == tcpListenPort)
+        {
+            if ((flags & (TCP_SYN | TCP_ACK)) == TCP_SYN)
+            {
+                tcpSendCookie(packet, seq, tcpGetMss(tcp, headerSize));
+                return;
+            }
+            if ((flags & (TCP_SYN | TCP_ACK)) == TCP_ACK)
+            {
+                mss = tcpCheckCookie(ip->sourceIp, ntohs(tcp->sourcePort), packet->port, seq, ack);
+                if (mss != 0)
+                    conn = tcpAlloc(ip->sourceIp, ntohs(tcp->sourcePort), packet->port);
+            }
+        }
+        if (conn == 0)
+        {
+            tcpSendReset(packet, dataSize);
+            return;
+        }
+        for (i = 0; i < HW_ADD_LENGTH; i++)
+            conn->remoteMac[i] = ether->sourceAddress[i];
+        conn->iss = conn->sndUna = ack - 1;
+        conn->sndNxt = conn->sndMax = ack;
+        conn->rcvNxt = seq;
+        conn->mss = mss;
     }
+    conn->rxTime = getTimerMs();
+    conn->probes = 0;
 
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    //udp segment
-    udp->sourcePort = htons(68);
-    udp->destPort = htons(67);
-    udp->check = 0;
-
-
-    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
-
-
-    //dhcp datafields
-    dhcp->op = 1;
-    dhcp->htype = TEN_Mb_ETHERNET;
-    dhcp->hlen = SIX_BYTES;
-    dhcp->hops = 0; //no hops since network is local
-    dhcp->xid = transaction_id; //number i got from wireshark
-    dhcp->secs = 0; //seconds since client requested an ip address
-    dhcp->flags = 0;
-
-
-    i = 0;
-
-    while ( i < sizeof(dhcp->chaddr)/sizeof(uint8_t))
+    if ((flags & TCP_RST) != 0)
     {
-        if (i < HW_ADD_LENGTH)
-            dhcp->chaddr[i] = macAddress[i];
-        else
-            dhcp->chaddr[i] = 0;
-        i++;
+        tcpApplyEvent(conn, TCP_EVENT_RST);
+        return;
+    }
+    if ((flags & TCP_SYN) != 0)
+    {
+        tcpApplyEvent(conn, TCP_EVENT_SYN);
+        return;
     }
-    i = 0;
-    while ( i < sizeof(dhcp->data)/sizeof(uint8_t))
-        dhcp->data[i++] = 0;
-    dhcp->magicCookie = 0x63538263; //taken from wireshark
-    uint8_t lenOpts;
-    i = 0;
-    switch (type)
+    if ((flags & TCP_ACK) == 0)
+        return;
+
+    // acknowledgment; an event once everything sent, including syn or fin,
+    // has been acknowledged
+    tcpProcessAck(conn, ack, ntohs(tcp->windowSize));
+    tcpOutput(conn);
+    if (conn->sndUna == conn->sndMax)
+        tcpApplyEvent(conn, TCP_EVENT_ACK);
+    if (conn->state == TCP_CLOSED)
+        return;
+
+    // in-order data is taken along with any held data it joins up with;
+    // data ahead of rcvNxt is held and answered with a duplicate ack at once,
+    // so the peer can retransmit just the missing segment
+    if (dataSize > 0)
     {
-      case DHCPDISCOVER:
-        while ( i < IP_ADD_LENGTH)
+        data = (uint8_t*)tcp + headerSize;
+        size = dataSize;
+        start = seq;
+        if (SEQ_LT(start, conn->rcvNxt) && SEQ_GT(start + size, conn->rcvNxt))
         {
-            dhcp->ciaddr[i] = dhcp->yiaddr[i] = dhcp->siaddr[i] = dhcp->giaddr[i] = 0;
-            i++;
+            // a retransmission that also carries new data
+            data += conn->rcvNxt - start;
+            size -= conn->rcvNxt - start;
+            start = conn->rcvNxt;
         }
-          dhcp->flags = htons(0x8000);
-          dhcp->options[0] = DHCPMESSAGE;
-          dhcp->options[1] = 1;
-          dhcp->options[2] = type;
-          dhcp->options[3] = END;
-          lenOpts = 4;
-          break;
-      case DHCPREQUEST:
-        while ( i < IP_ADD_LENGTH)
+        if (conn->state != TCP_ESTABLISHED && conn->state != TCP_FIN_WAIT_1 && conn->state != TCP_FIN_WAIT_2)
+            tcpSendSegment(conn, TCP_ACK, 0);
+        else if (start == conn->rcvNxt)
+            tcpReceiveData(conn, data, size);
+        else
         {
-            dhcp->ciaddr[i] = dhcp->giaddr[i] = 0;
-            if (si_yi_clear)
-            {
-                yiaddr[i] = dhcp->yiaddr[i];
-                siaddr[i] = dhcp->siaddr[i];
-            }
-            i++;
+            if (SEQ_GT(start, conn->rcvNxt))
+                tcpHoldSegment(conn, start, data, size);
+            tcpSendSegment(conn, TCP_ACK, 0);
         }
-        si_yi_clear = false;
-          dhcp->options[0] = DHCPMESSAGE;
-          dhcp->options[1] = 1; //length
-          dhcp->options[2] = type;
-          dhcp->options[3] = REQ_IP_MSG;
-          dhcp->options[4] = 4; //length
-          dhcp->options[5] = yiaddr[0];
-          dhcp->options[6] = yiaddr[1];
-          dhcp->options[7] = yiaddr[2];
-          dhcp->options[8] = yiaddr[3];
-          dhcp->options[9] = SERVERID;
-          dhcp->options[10] = 4;
-          dhcp->options[11] = siaddr[0];
-          dhcp->options[12] = siaddr[1];
-          dhcp->options[13] = siaddr[2];
-          dhcp->options[14] = siaddr[3];
-          dhcp->options[15] = PARAMETER_REQUEST;
-          dhcp->options[16] = 3;
-          dhcp->options[17] = SN_MASK_CODE;//subnet mask
-          dhcp->options[18] = GW_CODE;//router
-          dhcp->options[19] = DNS_CODE;//dns
-          dhcp->options[20] = END;
-          dhcp->options[21] = END;
-          lenOpts = 22;
-          break;
-      case DHCPDECLINE:
-
-          break;
-      case DHCPACK:
-          break;
-      case DHCPNAK:
-          break;
-      case DHCPRELEASE:
-            dhcp->options[0] = DHCPMESSAGE;
-            dhcp->options[1] = 1;
-            dhcp->options[2] = type;
-            dhcp->options[3] = END;
-            lenOpts = 4;
-          break;
-      case DHCPINFORM:
-          break;
-      default:
-          break;
-    }
-    ip->length = htons( ipHeaderLength + udpHeaderLength + dhcpSize + lenOpts ); /*20 + 8 + dhcpSize + options*/;
-    udp->length = htons( udpHeaderLength + dhcpSize + lenOpts );
-    //options all populated -> make checksums
-
-    etherCalcIpChecksum(ip);
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    uint16_t tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    etherSumWords(&udp->length, 2);
-    // add udp header except crc
-    etherSumWords(udp, 6);
-    etherSumWords(&udp->data, dhcpSize + lenOpts);
-    udp->check = getEtherChecksum();
-    etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + 8 + dhcpSize + lenOpts);
-}
-bool matchesXid(uint8_t packet[])
-{
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
-    return dhcp->xid == transaction_id;
-}
-void dhcpStoreVars(uint8_t packet[])
-{
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+        if (conn->state == TCP_CLOSED)
+            return;
+    }
 
-    etherSetIpAddress(dhcp->yiaddr[0], dhcp->yiaddr[1], dhcp->yiaddr[2], dhcp->yiaddr[3]);
-    uint8_t length = htons(ip->length) - ipHeaderLength - udpHeaderLength - dhcpSize;
-    uint8_t i;
-    bool msg_accounted, si_accounted, lease_accounted, sn_accounted, router_accounted, dns_accounted;
-    msg_accounted = si_accounted = lease_accounted = sn_accounted = router_accounted = dns_accounted = false;
-    for (i = 0; i < length; i++)
+    // a fin is taken in order only, after its data
+    if ((flags & TCP_FIN) != 0)
     {
-        if (dhcp->options[i] == DHCPMESSAGE && msg_accounted == false)
+        if (seq + dataSize == conn->rcvNxt)
         {
-            i+=dhcp->options[i+1] + 1; msg_accounted = true; continue;
+            conn->rcvNxt++;
+            tcpApplyEvent(conn, TCP_EVENT_FIN);
         }
-        if (dhcp->options[i] == SERVERID && si_accounted == false)
+        else if (seq + dataSize + 1 == conn->rcvNxt)
+            tcpSendSegment(conn, TCP_ACK, 0);        // our ack of the fin was lost
+    }
+}
+
+// Reclaims a connection whose timers have run out while nothing was in
+// flight: TIME_WAIT after 2 MSL, FIN_WAIT_2 when the peer never closes, and
+// an idle connection whose peer no longer answers keepalive probes
+// A probe is an ack of sndUna - 1, which the peer must answer (RFC 1122
+// 4.2.3.6); any segment from the peer restarts the timers
+void tcpIdle(tcpConnection* conn, uint32_t now)
+{
+    uint32_t idle = now - conn->rxTime;
+    switch (conn->state)
+    {
+    case TCP_TIME_WAIT:
+        if (idle >= TCP_TIME_WAIT_TIMEOUT)
         {
-            i+=dhcp->options[i+1] + 1; si_accounted = true; continue;
+            tcpReclaim.timeWaits++;
+            tcpFree(conn);
         }
-        if (dhcp->options[i] == IP_LEASE_CODE && lease_accounted == false)
+        break;
+    case TCP_FIN_WAIT_2:
+        if (idle >= TCP_FIN_WAIT_TIMEOUT)
         {
-            lease_time = dhcp->options[i+2] << 24 | dhcp->options[i+3] << 16 | dhcp->options[i+4] << 8 | dhcp->options[i+5] << 0;
-            i+=dhcp->options[i+1] + 1; lease_accounted = true;
-            continue;
+            tcpReclaim.finWaits++;
+            tcpSendSegment(conn, TCP_RST | TCP_ACK, 0);
+            tcpFree(conn);
         }
-        if (dhcp->options[i] == SN_MASK_CODE && sn_accounted == false)
+        break;
+    case TCP_ESTABLISHED:
+    case TCP_CLOSE_WAIT:
+        if (tcpKeepaliveIdle == 0 || idle < tcpKeepaliveIdle + conn->probes * tcpKeepaliveInterval)
+            break;
+        if (conn->probes >= tcpKeepaliveProbes)
         {
-            etherSetIpSubnetMask(dhcp->options[i+2],dhcp->options[i+3],dhcp->options[i+4],dhcp->options[i+5]);
-            i+=dhcp->options[i+1] + 1; sn_accounted = true; continue;
+            tcpReclaim.keepalives++;
+            tcpSendSegment(conn, TCP_RST | TCP_ACK, 0);
+            tcpFree(conn);
+            break;
         }
-        if (dhcp->options[i] == GW_CODE && router_accounted == false)
+        conn->probes++;
+        conn->sndNxt--;
+        tcpSendSegment(conn, TCP_ACK, 0);
+        conn->sndNxt++;
+        break;
+    }
+}
+
+// Sends delayed acks that found no data to ride on within TCP_ACK_DELAY,
+// retransmits on connections whose retransmit timer has expired and runs
+// the idle timers of connections with nothing in flight
+// The timeout doubles on each expiry; after TCP_MAX_RETRIES the connection
+// is reset
+// Runs from the timer wheel every TCP_SERVICE_INTERVAL ms
+void tcpService()
+{
+    tcpConnection* conn;
+    uint32_t now = getTimerMs();
+    uint8_t i;
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
+    {
+        conn = &tcpConnections[i];
+        if (conn->state == TCP_CLOSED)
+            continue;
+        if (conn->ackPending && now - conn->ackStart >= TCP_ACK_DELAY)
+            tcpSendSegment(conn, TCP_ACK, 0);
+        if (conn->sndUna == conn->sndMax)
         {
-            etherSetIpGatewayAddress(dhcp->options[i+2],dhcp->options[i+3],dhcp->options[i+4],dhcp->options[i+5]);
-            i+=dhcp->options[i+1] + 1; router_accounted = true; continue;
+            tcpIdle(conn, now);
+            continue;
         }
-        if (dhcp->options[i] == DNS_CODE && dns_accounted == false)
+        if (now - conn->rtoStart < conn->rto)
+            continue;
+        if (++conn->retries > TCP_MAX_RETRIES)
         {
-            etherSetIpDnsServer(dhcp->options[i+2],dhcp->options[i+3],dhcp->options[i+4],dhcp->options[i+5]);
-            i+=dhcp->options[i+1] + 1; dns_accounted = true; continue;
+            tcpReclaim.timeouts++;
+            tcpSendSegment(conn, TCP_RST | TCP_ACK, 0);
+            tcpFree(conn);
+            continue;
         }
+        conn->rto = conn->rto > TCP_RTO_MAX / 2 ? TCP_RTO_MAX : conn->rto * 2;
+        conn->rttTiming = false;
+        conn->retransmits++;
+        tcpRetransmitCount++;
+        // go back to the oldest unacknowledged segment
+        conn->sndNxt = conn->sndUna;
+        conn->rtoStart = now;
+        if (conn->sndUna == conn->iss)
+            tcpSendSegment(conn, TCP_SYN | TCP_ACK, 0);
+        else
+            tcpOutput(conn);
     }
 }
-uint32_t getLeaseTime()
+
+// Queues data on an established connection and sends it
+// Data stays queued until it is acknowledged
+// Returns the number of bytes queued, which is less than size when the queue
+// is full
+uint16_t tcpSend(uint8_t connection, const uint8_t data[], uint16_t size)
 {
-    return lease_time;
+    tcpConnection* conn;
+    if (connection >= TCP_MAX_CONNECTIONS)
+        return 0;
+    conn = &tcpConnections[connection];
+    if (conn->state != TCP_ESTABLISHED && conn->state != TCP_CLOSE_WAIT)
+        return 0;
+    size = tcpQueue(conn, data, size);
+    tcpOutput(conn);
+    return size;
 }
 
-bool etherIsTcp(uint8_t packet[])
+// Queues data of any length on an established connection without copying it
+// and sends it, segmented to fit the peer's mss and window
+// The data must stay unchanged until it is acknowledged, as constants in
+// flash do
+// Returns false, queueing nothing, if the queue has too few free runs
+bool tcpSendConst(uint8_t connection, const void* data, uint32_t size)
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    uint8_t port_num = htons(tcp->destPort);
-    tcp_flags = htons(tcp->offsetAndFlags) & 0x00FF;
-    if (ip->protocol == 0x06 && port_num == 23)
-        return true;
-    else
+    tcpConnection* conn;
+    const uint8_t* next = (const uint8_t*)data;
+    uint16_t n;
+    if (connection >= TCP_MAX_CONNECTIONS)
         return false;
+    conn = &tcpConnections[connection];
+    if (conn->state != TCP_ESTABLISHED && conn->state != TCP_CLOSE_WAIT)
+        return false;
+    if (size / 0xFFFF + 1 > (uint32_t)(TCP_TX_CHUNKS - conn->txChunkCount))
+        return false;
+    while (size > 0)
+    {
+        n = size > 0xFFFF ? 0xFFFF : size;
+        tcpAddChunk(conn, next, n);
+        next += n;
+        size -= n;
+    }
+    tcpOutput(conn);
+    return true;
 }
-void get_siaddr(uint8_t temp_ip[4])
-{
-    uint8_t i;
-    for (i = 0; i < IP_ADD_LENGTH; i++)
-        temp_ip[i] = siaddr[i];
-}
-uint8_t get_tcp_flags()
+
+// Closes a connection from this end
+void tcpClose(uint8_t connection)
 {
-    return tcp_flags;
+    if (connection < TCP_MAX_CONNECTIONS)
+        tcpApplyEvent(&tcpConnections[connection], TCP_EVENT_CLOSE);
 }
-uint32_t htonl(const uint32_t value)
+
+tcpState tcpGetState(uint8_t connection)
 {
-    return htons(value >> 16) | (htons((uint16_t) value) << 16);
+    if (connection >= TCP_MAX_CONNECTIONS)
+        return TCP_CLOSED;
+    return (tcpState)tcpConnections[connection].state;
 }
-void sendTcpMsg(uint8_t packet[], uint8_t flag, uint8_t payload[], bool payload_empty)
+
+// Returns true if a telnet command is waiting, copying it to command
+// (TCP_COMMAND_LENGTH bytes) and its connection to connection
+bool telnetGetCommand(uint8_t* connection, char* command)
 {
     uint8_t i;
-    uint16_t data_length = 0;
-
-    uint16_t initial_id = 0x0;
-    etherFrame* ether = (etherFrame*)packet;
-    i = 0;
-    while ( i < HW_ADD_LENGTH )
-    {
-        ether->destAddress[i] = ether->sourceAddress[i];
-        ether->sourceAddress[i] = macAddress[i];
-        i++;
-    }
-    ether->frameType = htons(IPv4_frame);
-
-    i = 0;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    while ( i < IP_ADD_LENGTH)
+    for (i = 0; i < TCP_MAX_CONNECTIONS; i++)
     {
-        ip->destIp[i] = ip->sourceIp[i];
-        ip->sourceIp[i] = ipAddress[i];
-        i++;
-    }
-
-    data_length = htons(ip->length) - ((ip->revSize & 0xF) * 4); //tcp header + data length
-    ip->revSize = 0x45 ;
-    ip->typeOfService = 0x00;
-    ip->id = htons(initial_id++);
-    ip->flagsAndOffset = 0x0000;
-    ip->ttl = 64;
-    ip->protocol = 0x06;
-    ip->headerChecksum = 0;
-
-    tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-
-    data_length -= ((htons(tcp->offsetAndFlags)) >> 12) * 4; // shift right by 8 to get appropriate
-                                                          // 0-indexed value. Each LSb indicates
-                                                          // 32-bit word (4 bytes).
-
-    tcp->destPort = tcp->sourcePort;
-    tcp->sourcePort = htons(23);
-    tcp->windowSize = htons(0x05b4);
-    tcp->urgentPointer = htons(0);
-    tcp->check = 0;
-    uint8_t tcpSize = sizeof(tcpFrame);
-    uint16_t lenOpts;
-    uint32_t packet_seq = htonl(tcp->sequenceNum);
-    switch (flag)
-    {
-    case 0x01:
-        tcp->ackNum = htonl(packet_seq + 1) ;
-        tcp->sequenceNum = htonl(seq_num);
-        tcp->offsetAndFlags = htons(0b0101000000010000);
-        lenOpts = 0;
-        break;
-    case 0x02:
-        tcp->ackNum = htonl(0);
-        tcp->sequenceNum = htonl(seq_num++);
-        tcp->offsetAndFlags = htons(0b0101000000010000);
-        lenOpts = 0;
-        break;
-    case 0x08:
-        break;
-    case 0x10: // ack
-        ack_num = htonl(packet_seq + data_length) ;
-        tcp->ackNum = ack_num;
-        tcp->sequenceNum = htonl(seq_num);
-        tcp->offsetAndFlags = htons(0b0101000000010000);
-        lenOpts = 0;
-        break;
-    case 0x12: // syn/ack
-        tcp->ackNum = htonl(packet_seq + 1) ;
-        tcp->sequenceNum = htonl(seq_num++);
-        tcp->offsetAndFlags = htons(0b0110000000010010);
-        tcp->optionsPaddingData[0] = 2;
-        tcp->optionsPaddingData[1] = 4;
-        tcp->optionsPaddingData[2] = 0x05;
-        tcp->optionsPaddingData[3] = 0xb4;
-        lenOpts = 4;
-        break;
-    case 0x18: //push ack
-        /*telnet processing: parse tcp->optionsPaddingData. If tcp->optionsPaddingData[i] == 255
-         * you should interpret the next two bytes as a command. Otherwise, interpret as text.*/
-        tcp->ackNum = htonl(packet_seq + data_length) ;
-        tcp->sequenceNum = htonl(seq_num);
-        tcp->offsetAndFlags = htons(0b0101000000010000);
-        lenOpts = 0;
-        ip->length = htons( ipHeaderLength + tcpSize + lenOpts ); /*20 + 8 + dhcpSize + options*/;
-        //options all populated -> make checksums
-
-        etherCalcIpChecksum(ip);
-        sum = 0;
-        etherSumWords(ip->sourceIp, 8);
-        uint16_t tmp16 = ip->protocol;
-        sum += (tmp16 & 0xff) << 8;
-        uint16_t tmp_len = htons(lenOpts + tcpSize);
-        etherSumWords(&tmp_len, 2);
-        // add udp header except crc
-        etherSumWords(tcp, 18);
-        etherSumWords(tcp->optionsPaddingData, lenOpts);
-        tcp->check = getEtherChecksum();
-        etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + tcpSize + lenOpts);
-
-        ip->headerChecksum = 0;
-        tcp->offsetAndFlags = htons(0b0101000000011000);
-        tcp->check = 0;
-        i = 0;
-        while (i < data_length)
+        if (tcpConnections[i].state != TCP_CLOSED && tcpConnections[i].commandPending)
         {
-            if (tcp->optionsPaddingData[i] == 0xFF) // interpret as command
-            {
-                if (tcp->optionsPaddingData[i + 1] == 0xFA) // suboption ; handle on the side
-                {
-                    //iterate through until you locate sequence 0xff 0xf0
-                }
-                else
-                {
-                    switch(tcp->optionsPaddingData[i + 2])
-                    {
-                    case 0x03: // suppress go ahead option
-                        /*
-                         * WILL = 0xfb
-                         * WONT = 0xfc
-                         * DO   = 0xfd
-                         * DONT = 0xfe
-                         */
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfd;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfb;
-                        break;
-                    case 0x05: // status option
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x18: // terminal type option
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x1f: // negotiate window size
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x20: // terminal speed
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x21: // remote flow control
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x22: // linemode option
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x25: // authentication option
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    case 0x27: // new environment option
-                        if (will_wont(tcp->optionsPaddingData[i+1]))
-                            tcp->optionsPaddingData[i + 1] = 0xfe;
-                        else
-                            tcp->optionsPaddingData[i + 1] = 0xfc;
-                        break;
-                    default:
-                        break;
-                    }
-                    i += 3;
-                }
-            }
-            else
-            {
-                putcUart0(tcp->optionsPaddingData[i]);
-                telnet_command[command_iterator] = tcp->optionsPaddingData[i];
-                command_iterator +=1;
-                if (tcp->optionsPaddingData[i] == '\r')
-                {
-                    telnet_command[command_iterator - 1] = '\0';
-                    command_pending = true;
-                    command_iterator = 0;
-                }
-                i+=1;
-            }
+            strcpy(tcpConnections[i].command, command);
+            tcpConnections[i].commandPending = false;
+            *connection = i;
+            return true;
         }
-        seq_num += data_length;
-        telnet_command[data_length] = '\0';
-        lenOpts = data_length;
-        ip->length = htons( ipHeaderLength + tcpSize + lenOpts ); /*20 + 8 + dhcpSize + options*/;
-        //options all populated -> make checksums
-        etherCalcIpChecksum(ip);
-        sum = 0;
-        etherSumWords(ip->sourceIp, 8);
-        tmp16 = ip->protocol;
-        sum += (tmp16 & 0xff) << 8;
-        tmp_len = htons(lenOpts + tcpSize);
-        etherSumWords(&tmp_len, 2);
-        // add udp header except crc
-        etherSumWords(tcp, 18);
-        etherSumWords(tcp->optionsPaddingData, lenOpts);
-        tcp->check = getEtherChecksum();
-        etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + tcpSize + lenOpts);
-        return;
-    default:
-        break;
     }
-    if (!payload_empty)
-    {
-        uint8_t len = strlen((char*) payload);
-        for (i = 0; i < len; i++)
-            tcp->optionsPaddingData[lenOpts++] = payload[i];
-        seq_num += lenOpts;
-    }
-    ip->length = htons( ipHeaderLength + tcpSize + lenOpts ); /*20 + 8 + dhcpSize + options*/;
-    //options all populated -> make checksums
-    etherCalcIpChecksum(ip);
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    uint16_t tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    uint16_t tmp_len = htons(lenOpts + tcpSize);
-    etherSumWords(&tmp_len, 2);
-    // add udp header except crc
-    etherSumWords(tcp, 18);
-    etherSumWords(tcp->optionsPaddingData, lenOpts);
-    tcp->check = getEtherChecksum();
-    etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + tcpSize + lenOpts);
+    return false;
+}
+
+uint32_t tcpGetRetransmitCount()
+{
+    return tcpRetransmitCount;
 }
-bool telnet_command_recv()
+
+// Returns the number of connections reset after TCP_MAX_RETRIES timeouts
+uint32_t tcpGetTimeoutCount()
 {
-    return command_pending;
+    return tcpReclaim.timeouts;
 }
-void clear_command_recv()
+
+// Sets the silence in ms before keepalive probes start (0 for none), the ms
+// between probes and the number left unanswered before the connection is reset
+void tcpSetKeepalive(uint32_t idle, uint32_t interval, uint8_t probes)
 {
-    command_pending = false;
+    tcpKeepaliveIdle = idle;
+    tcpKeepaliveInterval = interval;
+    tcpKeepaliveProbes = probes;
 }
-void copy_command(char* strInput)
+
+void tcpGetReclaimStats(tcpReclaimStats* stats)
 {
-    strInput = strcpy(telnet_command, strInput);
+    *stats = tcpReclaim;
 }
+
 bool will_wont(uint8_t command)
 {
     return command == 0xfb || command == 0xfc;
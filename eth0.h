@@ -38,6 +38,7 @@
 
 #define ETHER_HALFDUPLEX     0x00
 #define ETHER_FULLDUPLEX     0x100
+#define ETHER_RXCHECKSUM     0x200       // verify checksums in the ENC28J60
 #define DHCPDISCOVER 1
 #define DHCPOFFER    2
 #define DHCPREQUEST  3
@@ -49,6 +50,178 @@
 #define LOBYTE(x) ((x) & 0xFF)
 #define HIBYTE(x) (((x) >> 8) & 0xFF)
 
+//-----------------------------------------------------------------------------
+// Structures
+//-----------------------------------------------------------------------------
+
+// Receive ring size, set at compile time to fit the 32K of SRAM
+// ETHER_RX_RING_FRAMES must be a power of 2
+#ifndef ETHER_RX_RING_FRAMES
+#define ETHER_RX_RING_FRAMES 8
+#endif
+#ifndef ETHER_RX_RING_BYTES
+#define ETHER_RX_RING_BYTES  4096
+#endif
+
+// Protocol tags set by etherClassifyPacket()
+typedef enum _etherProtocol
+{
+    ETHER_UNKNOWN,
+    ETHER_ARP_REQUEST,
+    ETHER_ARP_RESPONSE,
+    ETHER_ICMP_ECHO,
+    ETHER_UDP,
+    ETHER_DHCP,
+    ETHER_TCP,
+    ETHER_PROTOCOL_COUNT
+} etherProtocol;
+
+// A frame in SRAM with its header offsets and protocol tag, which are
+// computed once by etherClassifyPacket() and shared by every handler
+typedef struct _etherPacket
+{
+    uint8_t* data;
+    uint16_t size;
+    uint8_t l3Offset;                    // ip or arp header
+    uint8_t l4Offset;                    // icmp, udp or tcp header
+    uint8_t protocol;                    // etherProtocol
+    uint8_t tcpFlags;
+    uint16_t port;                       // udp or tcp destination port
+    bool verified;                       // checksums already checked in chip
+} etherPacket;
+
+// ARP cache entries, and frames held while their next hop is resolved
+// ARP_CACHE_SIZE must be a power of 2; a held frame of ARP_QUEUE_FRAME_SIZE
+// carries a 576-byte datagram, and larger frames are dropped
+#ifndef ARP_CACHE_SIZE
+#define ARP_CACHE_SIZE       8
+#endif
+#ifndef ARP_QUEUE_FRAMES
+#define ARP_QUEUE_FRAMES     2
+#endif
+#ifndef ARP_QUEUE_FRAME_SIZE
+#define ARP_QUEUE_FRAME_SIZE 590
+#endif
+
+// ARP timers in ms
+#define ARP_TIMEOUT          300000      // an entry stays valid
+#define ARP_REFRESH          30000       // before expiry a used entry is refreshed
+#define ARP_RETRY            1000        // between requests
+#define ARP_MAX_TRIES        3           // requests before giving up
+#define ARP_SERVICE_INTERVAL 100         // between runs of etherArpService()
+
+// TCP connections
+// Connections are identified by their index in the control block table
+#ifndef TCP_MAX_CONNECTIONS
+#define TCP_MAX_CONNECTIONS  4
+#endif
+#define TCP_NO_CONNECTION    0xFF
+
+// Bytes of unacknowledged and unsent data held per connection
+#ifndef TCP_TX_BUFFER
+#define TCP_TX_BUFFER        1024
+#endif
+
+// Bytes of out-of-order data held per connection, which is also the window
+// advertised; TCP_RX_BUFFER must be a power of 2
+#ifndef TCP_RX_BUFFER
+#define TCP_RX_BUFFER        1024
+#endif
+// Runs of out-of-order data held in it
+#ifndef TCP_RX_RANGES
+#define TCP_RX_RANGES        4
+#endif
+
+// Default keepalive and reclaim timers in ms; tcpSetKeepalive() changes the
+// keepalive at run time, and an idle time of 0 turns it off
+#ifndef TCP_KEEPALIVE_IDLE
+#define TCP_KEEPALIVE_IDLE   120000      // silence before the first probe
+#endif
+#ifndef TCP_KEEPALIVE_INTERVAL
+#define TCP_KEEPALIVE_INTERVAL 10000     // between unanswered probes
+#endif
+#ifndef TCP_KEEPALIVE_PROBES
+#define TCP_KEEPALIVE_PROBES 5           // unanswered probes before a reset
+#endif
+#ifndef TCP_FIN_WAIT_TIMEOUT
+#define TCP_FIN_WAIT_TIMEOUT 60000       // FIN_WAIT_2 with a silent peer
+#endif
+#ifndef TCP_TIME_WAIT_TIMEOUT
+#define TCP_TIME_WAIT_TIMEOUT 30000      // 2 MSL
+#endif
+
+// Retransmission timers in ms
+#define TCP_RTO_INITIAL      1000        // before the first rtt sample
+#define TCP_RTO_MIN          200
+#define TCP_RTO_MAX          60000
+#define TCP_MAX_RETRIES      8           // timeouts before the connection is reset
+#define TCP_SERVICE_INTERVAL 10          // between runs of tcpService()
+
+// RFC 793 connection states
+typedef enum _tcpState
+{
+    TCP_CLOSED,
+    TCP_LISTEN,
+    TCP_SYN_SENT,
+    TCP_SYN_RCVD,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1,
+    TCP_FIN_WAIT_2,
+    TCP_CLOSE_WAIT,
+    TCP_CLOSING,
+    TCP_LAST_ACK,
+    TCP_TIME_WAIT,
+    TCP_STATE_COUNT
+} tcpState;
+
+// Counts of connection slots reclaimed, by cause, for sizing the table
+typedef struct _tcpReclaimStats
+{
+    uint32_t timeouts;            // reset after TCP_MAX_RETRIES retransmissions
+    uint32_t keepalives;          // reset after unanswered keepalive probes
+    uint32_t finWaits;            // FIN_WAIT_2 timed out
+    uint32_t timeWaits;           // TIME_WAIT timed out
+    uint32_t recycled;            // TIME_WAIT taken early for a new connection
+    uint32_t refused;             // handshakes dropped with every slot in use
+    uint8_t inUse;                // connections now open
+    uint8_t peak;                 // most connections open at once
+} tcpReclaimStats;
+
+// Offer rapid commit (RFC 4039) in discovers, so a server that supports it
+// can bind the client with an ack in two messages instead of four
+#ifndef DHCP_RAPID_COMMIT
+#define DHCP_RAPID_COMMIT    true
+#endif
+
+// The last lease is saved in eeprom words 1-7, with its crc in the last
+#define DHCP_LEASE_ADDRESS   1
+#define DHCP_LEASE_WORDS     6
+
+// DHCP client states (RFC 2131 figure 5); DHCP_OFF when not in use
+typedef enum _dhcpState
+{
+    DHCP_OFF,
+    DHCP_INIT,
+    DHCP_SELECTING,
+    DHCP_REQUESTING,
+    DHCP_BOUND,
+    DHCP_RENEWING,
+    DHCP_REBINDING,
+    DHCP_INIT_REBOOT,                    // a lease saved in eeprom is to be confirmed
+    DHCP_REBOOTING
+} dhcpState;
+
+// Completion handle for a frame moving between SRAM and the ENC28J60 by uDMA
+typedef struct _etherTransfer
+{
+    uint8_t* packet;
+    uint16_t size;
+    bool isWrite;
+    bool pending;
+    bool verified;                       // read checked by the DMA checksum engine
+    bool toRing;                         // read filling a receive ring slot
+} etherTransfer;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -60,22 +233,49 @@ bool etherIsDataAvailable();
 bool etherIsOverflow();
 uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize);
 bool etherPutPacket(uint8_t packet[], uint16_t size);
+void etherOpenPacket();
+void etherWritePacket(const void* data, uint16_t size);
+void etherClosePacket();
+etherTransfer* etherStartGetPacket(uint8_t packet[], uint16_t maxSize);
+etherTransfer* etherStartPutPacket(uint8_t packet[], uint16_t size);
+bool etherIsTransferDone(etherTransfer* xfer);
+uint16_t etherWaitTransfer(etherTransfer* xfer);
+bool etherIsRxDmaBusy();
+
+void etherEnableRxInterrupt();
+void etherIsr();
+void etherCompleteRxDma();
+void etherParsePacket(etherPacket* packet);
+etherProtocol etherClassifyPacket(etherPacket* packet);
+etherPacket* etherGetRxPacket();
+void etherReleaseRxPacket();
+uint32_t etherGetRxOverflowCount();
+uint32_t etherGetRxChecksumDropCount();
+void etherServiceTx();
+uint32_t etherGetTxAbortCount();
 
-bool etherIsIp(uint8_t packet[]);
-bool etherIsIpUnicast(uint8_t packet[]);
+bool etherIsIp(etherPacket* packet);
+bool etherIsIpUnicast(etherPacket* packet);
 
-bool etherIsPingRequest(uint8_t packet[]);
-void etherSendPingResponse(uint8_t packet[]);
+bool etherIsPingRequest(etherPacket* packet);
+void etherSendPingResponse(etherPacket* packet);
 
-bool etherIsArpRequest(uint8_t packet[]);
-void etherSendArpResponse(uint8_t packet[]);
-void etherSendGratuitousArpResponse(uint8_t packet[], uint8_t ip[]);
-void etherSendArpRequest(uint8_t packet[], uint8_t ip[]);
+bool etherIsArpRequest(etherPacket* packet);
+void etherSendArpResponse(etherPacket* packet);
+void etherSendGratuitousArpResponse(etherPacket* packet, uint8_t ip[]);
+void etherSendArpRequest(etherPacket* packet, uint8_t ip[]);
+void arpInit();
+void etherProcessArpResponse(etherPacket* packet);
+void etherArpService();
+uint32_t etherGetArpDropCount();
+bool etherGetNextHop(const uint8_t ip[], uint8_t hop[]);
+bool etherSendIp(uint8_t header[], uint16_t headerSize, const void* data, uint16_t size);
+bool etherSendUdp(const uint8_t ip[], uint16_t sourcePort, uint16_t destPort, const void* data, uint16_t size);
 
-bool etherIsUdp(uint8_t packet[]);
-bool etherIsTcp(uint8_t packet[]);
-uint8_t* etherGetUdpData(uint8_t packet[]);
-void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize);
+bool etherIsUdp(etherPacket* packet);
+bool etherIsTcp(etherPacket* packet);
+uint8_t* etherGetUdpData(etherPacket* packet);
+void etherSendUdpResponse(etherPacket* packet, uint8_t* udpData, uint8_t udpSize);
 
 void etherEnableDhcpMode();
 void etherDisableDhcpMode();
@@ -91,24 +291,43 @@ void etherSetIpDnsServer(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3);
 void etherGetIpDnsServer(uint8_t ip[4]);
 void etherSetMacAddress(uint8_t mac0, uint8_t mac1, uint8_t mac2, uint8_t mac3, uint8_t mac4, uint8_t mac5);
 void etherGetMacAddress(uint8_t mac[6]);
-void dhcpSendMessage(uint8_t packet[], uint8_t type, uint8_t ipAdd[]);
-bool etherIsDhcp(uint8_t packet[]);
-uint8_t getDhcpMsgNumber(uint8_t packet[]);
+void dhcpSendMessage(uint8_t type);
+bool etherIsDhcp(etherPacket* packet);
+uint8_t getDhcpMsgNumber(etherPacket* packet);
 uint16_t htons(const uint16_t value);
-bool matchesXid(uint8_t packet[]);
-void dhcpStoreVars();
+uint32_t etherSumWords(uint32_t sum, const void* data, uint16_t sizeInBytes);
+uint16_t getEtherChecksum(uint32_t sum);
+uint16_t etherUpdateChecksum(uint16_t check, uint16_t oldWord, uint16_t newWord);
+bool matchesXid(etherPacket* packet);
+int16_t dhcpOptionsLength(etherPacket* packet);
+uint8_t* dhcpFindOption(etherPacket* packet, uint8_t code);
+void dhcpProcessMessage(etherPacket* packet);
+void dhcpService();
+void dhcpStart();
+void dhcpRefresh();
+void dhcpRelease();
+dhcpState dhcpGetState();
 void setLeaseTime(uint8_t arg1, uint8_t arg2, uint8_t arg3, uint8_t arg4);
 uint32_t getLeaseTime();
 uint16_t getPortNum();
-bool etherIsArpResponse(uint8_t packet[]);
-void get_siaddr(uint8_t temp_ip[4]);
-uint8_t get_tcp_flags();
-void sendTcpMsg(uint8_t packet[], uint8_t flag, uint8_t payload[], bool payload_empty);
+bool etherIsArpResponse(etherPacket* packet);
 uint32_t htonl(const uint32_t value);
-bool telnet_command_recv();
-void clear_command_recv();
-void copy_command(char* strInput);
+void tcpInit();
+void tcpListen(uint16_t port);
+void tcpCookieStir(uint32_t value);
+void tcpProcessSegment(etherPacket* packet);
+uint16_t tcpSend(uint8_t connection, const uint8_t data[], uint16_t size);
+bool tcpSendConst(uint8_t connection, const void* data, uint32_t size);
+void tcpClose(uint8_t connection);
+void tcpService();
+tcpState tcpGetState(uint8_t connection);
+uint32_t tcpGetRetransmitCount();
+uint32_t tcpGetTimeoutCount();
+void tcpSetKeepalive(uint32_t idle, uint32_t interval, uint8_t probes);
+void tcpGetReclaimStats(tcpReclaimStats* stats);
+bool telnetGetCommand(uint8_t* connection, char* command);
 bool will_wont(uint8_t command);
 #define ntohs htons
+#define ntohl htonl
 
 #endif
@@ -36,14 +36,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#ifndef ENC28J60_MODEL
 #include "tm4c123gh6pm.h"
+#endif
 #include "eth0.h"
 #include "gpio.h"
 #include "spi0.h"
 #include "uart0.h"
-#include "wait.h"
 #include "eeprom.h"
 #include "str.h"
+#include "timer.h"
 
 // Pins
 #define RED_LED PORTF,1
@@ -52,9 +54,22 @@
 #define PUSH_BUTTON PORTF,4
 #define MAX_CHARS 80
 #define MAX_ARGS 6
+
+// LED flashes, in ms
+#define LED_ON_TIME  100
+#define LED_OFF_TIME 100
+// Time the peer gets to acknowledge a telnet reply before a reboot, in ms
+#define TELNET_CLOSE_TIME 1000
+// Time the link gets to come up before the connection info is shown, in ms
+#define STARTUP_INFO_TIME 100
 uint8_t broadcast_ip[] = {255, 255, 255, 255};
-uint8_t no_payload[0];
 char tcp_ifconfig_buffer[128];
+timerEvent redLedTimer;
+timerEvent greenLedTimer;
+timerEvent startupTimer;
+bool redLedOn = false;
+bool greenLedOn = false;
+char prompt[] = "\nIoT-shell-0.1:~ ";
 //-----------------------------------------------------------------------------
 // Subroutines                
 //-----------------------------------------------------------------------------
@@ -66,10 +81,12 @@ typedef struct user_input
     char *temp_command;
     char *temp_arg[MAX_ARGS];
     uint8_t argCount;
+    uint8_t count;                       // characters of strInput typed so far
 
 }user_input;
 // Initialize Hardware
 extern void ResetISR(void);
+#ifndef ENC28J60_MODEL
 void initHw()
 {
 	// Configure HW to work with 16 MHz XTAL, PLL enabled, system clock of 40 MHz
@@ -86,6 +103,7 @@ void initHw()
     selectPinDigitalInput(PUSH_BUTTON);
     initEeprom();
 }
+#endif
 bool is_alphanumeric(char c)
 {
     /*determines whether input is alphanumeric or not based on ASCII values*/
@@ -103,7 +121,7 @@ bool is_alphanumeric(char c)
                             1,1,1,1,1,1,1,1,1,1, //110-119
                             1,1,1,0,0,0,0,0, //120-127
                             };
-    return is_a_n[c];
+    return (uint8_t)c < 128 && is_a_n[(uint8_t)c];
 }
 void tokenize_string(user_input *temp)
 {
@@ -144,41 +162,38 @@ bool isCommand(char* cmd, user_input temp)
   else
     return false;
 }
-void getsUart0(user_input *temp, uint8_t maxChars)
+// Adds the characters received so far to the line being typed, without
+// waiting for more, so the main loop keeps servicing the network
+// Returns true once a carriage return ends the line, which is then null
+// terminated; the next call starts a new line
+bool getsUart0(user_input *temp, uint8_t maxChars)
 {
-    uint8_t count = 0;
     char c;
-    while (count < maxChars)
+    while (kbhitUart0())
     {
         c = getcUart0();
-        //if you've reached the max amount of characters, break (80 chars max)
-        if (count == maxChars)
-        {
-            temp->strInput[count] = '\0';
-            break;
-        }
         if (c == 8 || c == 127)
         {
-            if (count < 1) continue;
-            count--; continue;
+            if (temp->count > 0)
+                temp->count--;
+            continue;
         }
-        //if you've pressed enter, add a newline delimiter, a carriage return, and a null terminator
+        //if you've pressed enter, add a null terminator
         if (c == 13)
         {
-            temp->strInput[count] = '\0';
-            break;
+            temp->strInput[temp->count] = '\0';
+            temp->count = 0;
+            return true;
         }
+        //leave room for the terminator (80 chars max)
+        if (temp->count >= maxChars - 1)
+            continue;
         //if an input is an uppercase letter, make it lowercase
         if (c >= 'A' && c <= 'Z')
-        {
-            c+=32;
-            temp->strInput[count] = c;
-        }
-        //put whatever is in the buffer onto the screen
-        else
-            temp->strInput[count] = c;
-        count++;
+            c += 32;
+        temp->strInput[temp->count++] = c;
     }
+    return false;
 }
 void putIpUart0(uint8_t ip[])
 {
@@ -196,8 +211,10 @@ void displayConnectionInfo()
 {
     uint8_t i;
     char buf_hex[3];
+    char buf_dec[11];
     uint8_t mac[6];
     uint8_t ip[4];
+    tcpReclaimStats reclaim;
     etherGetMacAddress(mac);
     putsUart0("\nHW: ");
     for (i = 0; i < 6; i++)
@@ -235,6 +252,35 @@ void displayConnectionInfo()
         putsUart0("Link is up\n");
     else
         putsUart0("Link is down\n");
+
+    putsUart0("TCP retransmits: ");
+    putsUart0(itoa(tcpGetRetransmitCount(), buf_dec));
+    putsUart0(", timeouts: ");
+    putsUart0(itoa(tcpGetTimeoutCount(), buf_dec));
+    putcUart0('\n');
+
+    tcpGetReclaimStats(&reclaim);
+    putsUart0("TCP reclaimed: keepalive ");
+    putsUart0(itoa(reclaim.keepalives, buf_dec));
+    putsUart0(", fin wait ");
+    putsUart0(itoa(reclaim.finWaits, buf_dec));
+    putsUart0(", time wait ");
+    putsUart0(itoa(reclaim.timeWaits, buf_dec));
+    putsUart0(", recycled ");
+    putsUart0(itoa(reclaim.recycled, buf_dec));
+    putsUart0(", refused ");
+    putsUart0(itoa(reclaim.refused, buf_dec));
+    putcUart0('\n');
+    putsUart0("TCP connections: ");
+    putsUart0(itoa(reclaim.inUse, buf_dec));
+    putsUart0(" open, ");
+    putsUart0(itoa(reclaim.peak, buf_dec));
+    putsUart0(" peak\n");
+    putsUart0("UART dropped: tx ");
+    putsUart0(itoa(getUart0TxDropCount(), buf_dec));
+    putsUart0(", rx ");
+    putsUart0(itoa(getUart0RxDropCount(), buf_dec));
+    putcUart0('\n');
 }
 void putMenu(char* menu)
 {
@@ -243,20 +289,126 @@ void putMenu(char* menu)
         putcUart0(menu[i]);
 }
 
+// Activity LEDs
+// A flash lights the LED for LED_ON_TIME and then holds it dark for
+// LED_OFF_TIME, so a burst of activity still shows as blinks; flashes asked
+// for meanwhile are absorbed, and the timer wheel turns the LED off, so
+// nothing waits
+void redLedTimeout()
+{
+    if (redLedOn)
+    {
+        setPinValue(RED_LED, 0);
+        redLedOn = false;
+        startTimer(&redLedTimer, LED_OFF_TIME, 0, redLedTimeout);
+    }
+}
+
+void flashRedLed()
+{
+    if (!isTimerRunning(&redLedTimer))
+    {
+        setPinValue(RED_LED, 1);
+        redLedOn = true;
+        startTimer(&redLedTimer, LED_ON_TIME, 0, redLedTimeout);
+    }
+}
+
+void greenLedTimeout()
+{
+    if (greenLedOn)
+    {
+        setPinValue(GREEN_LED, 0);
+        greenLedOn = false;
+        startTimer(&greenLedTimer, LED_OFF_TIME, 0, greenLedTimeout);
+    }
+}
+
+void flashGreenLed()
+{
+    if (!isTimerRunning(&greenLedTimer))
+    {
+        setPinValue(GREEN_LED, 1);
+        greenLedOn = true;
+        startTimer(&greenLedTimer, LED_ON_TIME, 0, greenLedTimeout);
+    }
+}
+
+// Handle icmp ping request
+void processPing(etherPacket* packet)
+{
+    etherSendPingResponse(packet);
+    flashRedLed();
+}
+
+// Handlers indexed by the tag set by etherClassifyPacket()
+typedef void (*packetHandler)(etherPacket* packet);
+const packetHandler packetHandlers[ETHER_PROTOCOL_COUNT] =
+{
+    0,                                   // ETHER_UNKNOWN
+    etherSendArpResponse,                // ETHER_ARP_REQUEST
+    etherProcessArpResponse,             // ETHER_ARP_RESPONSE
+    processPing,                         // ETHER_ICMP_ECHO
+    0,                                   // ETHER_UDP
+    dhcpProcessMessage,                  // ETHER_DHCP
+    tcpProcessSegment                    // ETHER_TCP
+};
+
+// Handles one received frame
+void processPacket(etherPacket* packet)
+{
+    packetHandler handler = 0;
+    if (packet->protocol < ETHER_PROTOCOL_COUNT)
+        handler = packetHandlers[packet->protocol];
+    if (handler)
+        handler(packet);
+}
+
+// Blocking function that closes a telnet connection and keeps the packet loop
+// running until the peer acknowledges the data and fin queued on it
+// For use before a reset, which would lose them
+void telnetFlushAndClose(uint8_t conn)
+{
+    etherPacket *packet;
+    uint32_t start = getTimerMs();
+    tcpClose(conn);
+    while ((tcpGetState(conn) == TCP_FIN_WAIT_1 || tcpGetState(conn) == TCP_CLOSING
+            || tcpGetState(conn) == TCP_LAST_ACK)
+           && getTimerMs() - start < TELNET_CLOSE_TIME)
+    {
+        packet = etherGetRxPacket();
+        if (packet != 0)
+        {
+            processPacket(packet);
+            etherReleaseRxPacket();
+        }
+        serviceTimers();
+    }
+}
+
+// Shows the connection info and the first prompt once the link has had
+// STARTUP_INFO_TIME to come up
+void startupTimeout()
+{
+    displayConnectionInfo();
+    putcUart0('\n');
+    putsUart0(prompt);
+}
+
 //-----------------------------------------------------------------------------
 // Main
 //-----------------------------------------------------------------------------
 
-// Max packet is calculated as:
-// Ether frame header (18) + Max MTU (1500) + CRC (4)
-#define MAX_PACKET_SIZE 1522
-
+#ifndef ENC28J60_MODEL
 int main(void)
 {
-    uint8_t data[MAX_PACKET_SIZE];
+    // Frames are drained into the receive ring by the ENC28J60 interrupt
+    etherPacket *packet;
+    uint32_t overflows = 0;
 
     // Init controller
     initHw(); //eeprom is initialized here as well
+    initTimer();
 
     // Setup UART0
     initUart0();
@@ -265,35 +417,39 @@ int main(void)
     // Init ethernet interface (eth0)
     putsUart0("\nStarting eth0-en9\n");
     etherSetMacAddress(2, 3, 4, 5, 6, 123);
-    etherDisableDhcpMode();
-    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX);
-    etherSetIpAddress(192,168,2,123);
-    etherSetIpSubnetMask(255, 255, 255, 0);
-    etherSetIpGatewayAddress(192, 168, 2, 1);
-    waitMicrosecond(100000);
-    displayConnectionInfo();
-    char prompt[] = "\nIoT-shell-0.1:~ ";
-    putcUart0('\n');
-    putsUart0(prompt);
+    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX | ETHER_RXCHECKSUM);
+    etherEnableRxInterrupt();
+    if (etherIsDhcpEnabled())
+        dhcpStart();
+    else
+    {
+        etherSetIpAddress(192,168,2,123);
+        etherSetIpSubnetMask(255, 255, 255, 0);
+        etherSetIpGatewayAddress(192, 168, 2, 1);
+    }
+    tcpListen(23);
+    startTimer(&startupTimer, STARTUP_INFO_TIME, 0, startupTimeout);
     user_input current_user_input;
+    user_input telnet_user_input;
+    current_user_input.count = 0;
+    telnet_user_input.count = 0;
     // Flash LED
-    setPinValue(GREEN_LED, 1);
-    waitMicrosecond(100000);
-    setPinValue(GREEN_LED, 0);
-    waitMicrosecond(100000);
+    flashGreenLed();
 
 
     // Main Loop
     // RTOS and interrupts would greatly improve this code,
     // but the goal here is simplicity
-    // bool telnet_data_recv = false;
     uint8_t i = 0;
+    uint8_t conn;
+    char *reboot_msg = "System rebooting...\n";
+    char *unsupported_msg = "that command is either not specified or supported for telnet use.\n";
     char *menu  =  "\n\thelp menu: \n"
                    "help:\t\t displays help menu\n"
                    "reboot:\t\t reboots the microcontroller.\n"
                    "ifconfig:\t dumps current IP, SN, GW, DNS, and DHCP mode\n"
                    "dhcp:\t\t must be supplied with on|off or refresh|release argument\n"
-                   "\t\t examples: dhcp on OR dhcp dhcp release\n"
+                   "\t\t examples: dhcp on OR dhcp release\n"
                    "set:\t\t primary arg ip, gw, dns, sn, dns and secondary arg ip address\n"
                    "\t\t example: set ip 192.168.1.1\n"
                    "\t\t if going from (dhcp) to (static), all addresses must be set\n";
@@ -302,9 +458,8 @@ int main(void)
 
         uint8_t temp_ip[4] = {0,0,0,0};
         // Put terminal processing here
-        if (kbhitUart0())
+        if (getsUart0(&current_user_input, MAX_CHARS))
         {
-            getsUart0(&current_user_input, MAX_CHARS);
             tokenize_string(&current_user_input);
             //
             /*tokenizing string, setting argCount, getting arguments, and determining command*/
@@ -312,7 +467,8 @@ int main(void)
                 putMenu(menu);
             else if (isCommand("reboot", current_user_input))
             {
-                putsUart0("System rebooting...\n");
+                putsUart0(reboot_msg);
+                flushUart0();
                 ResetISR();
             }
 
@@ -323,23 +479,28 @@ int main(void)
                     if (strcmp(current_user_input.temp_arg[1],"on") == 0)
                     {
                         putsUart0("dhcp on\n");
+                        if (!etherIsDhcpEnabled())
+                            etherEnableDhcpMode();
+                        dhcpStart();
                     }
                     else if (strcmp(current_user_input.temp_arg[1],"off") == 0)
                     {
                         putsUart0("dhcp off\n");
+                        dhcpRelease();
+                        etherDisableDhcpMode();
                     }
-                    else
-                        putsUart0("invalid dhcp command");
-                }
-                else if (current_user_input.argCount == 2)
-                {
-                    if (strcmp(current_user_input.temp_arg[2], "refresh") == 0)
+                    else if (strcmp(current_user_input.temp_arg[1], "refresh") == 0)
                     {
                         putsUart0("dhcp refresh\n");
+                        if (etherIsDhcpEnabled())
+                            dhcpRefresh();
+                        else
+                            putsUart0("dhcp is off\n");
                     }
-                    else if (strcmp(current_user_input.temp_arg[2], "release") == 0)
+                    else if (strcmp(current_user_input.temp_arg[1], "release") == 0)
                     {
                         putsUart0("dhcp release\n");
+                        dhcpRelease();
                     }
                     else
                         putsUart0("invalid dhcp command");
@@ -394,95 +555,39 @@ int main(void)
 
             putsUart0(prompt);
         }
-        if (telnet_command_recv())
+        // telnet commands get their own buffer so a half-typed serial line survives
+        if (telnetGetCommand(&conn, telnet_user_input.strInput))
         {
             putsUart0("recvd command\n");
-            // put commands into current_user_input to save space; you can do this upon a PSH/ACK
-            copy_command(current_user_input.strInput);
-            putsUart0(current_user_input.strInput);
+            putsUart0(telnet_user_input.strInput);
+            tokenize_string(&telnet_user_input);
             // support limited number of commands as to not lose connection
-            if (isCommand("help", current_user_input))
-                sendTcpMsg(data, 0x18, (uint8_t*)menu, false);
-            else if (isCommand("reboot", current_user_input))
+            if (isCommand("help", telnet_user_input))
+                tcpSendConst(conn, menu, strlen(menu));
+            else if (isCommand("reboot", telnet_user_input))
             {
-                sendTcpMsg(data, 0x18, "System rebooting...\n", false);
+                tcpSendConst(conn, reboot_msg, strlen(reboot_msg));
+                telnetFlushAndClose(conn);
                 ResetISR();
             }
             else
-            {
-                sendTcpMsg(data, 0x18, "that command is either not specified or supported for telnet use.\n", true);
-            }
-            clear_command_recv();
+                tcpSendConst(conn, unsupported_msg, strlen(unsupported_msg));
+            telnet_user_input.argCount = 0;
         }
 
         // Packet processing
-        if (etherIsDataAvailable())
+        if (etherGetRxOverflowCount() != overflows)
         {
-            if (etherIsOverflow())
-            {
-                setPinValue(RED_LED, 1);
-                waitMicrosecond(100000);
-                setPinValue(RED_LED, 0);
-            }
-
-            // Get packet
-            etherGetPacket(data, MAX_PACKET_SIZE);
-            // Handle ARP request
-            if (etherIsArpRequest(data))
-            {
-                etherSendArpResponse(data);
-            }
-
-            // Handle IP datagram
-            if (etherIsIp(data))
-            {
-            	if (etherIsIpUnicast(data))
-            	{
-            		// handle icmp ping request
-					if (etherIsPingRequest(data))
-					{
-					  etherSendPingResponse(data);
-                      setPinValue(RED_LED, 1);
-                      waitMicrosecond(100000);
-                      setPinValue(RED_LED, 0);
-                      waitMicrosecond(100000);
-					}
-					if (etherIsTcp(data)) //since we're only supporting port 23, fn
-					{                     //returns false if port != 23
-					    uint8_t flags = get_tcp_flags();
-					    switch (flags)
-                        {
-                        case 0x01: // fin
-                            // ack
-                            sendTcpMsg(data, 0x10, no_payload, true);
-                            // fin
-                            sendTcpMsg(data, 0x01, no_payload, true);
-                            break;
-					    case 0x02: //syn
-					        sendTcpMsg(data, 0x12, no_payload, true);
-					        break;
-					    case 0x10: //ack ---> for the time being, don't take action on receiving ack's
-					               //         System actually has to take action if messages aren't being ack'ed
-					               //         like re-transmissions
-					        // sendTcpMsg(data, 0x12, no_payload);
-					        // if (state == TIME_WAIT) putsUart0("connection closed");
-					        break;
-					    case 0x12: //syn/ack
-					        sendTcpMsg(data, 0x10, no_payload, true);
-					        break;
-					    case 0x18: // push/ack ---> reply with data
-					        // send response -> payload is messenger-given not sender generated
-					        sendTcpMsg(data, 0x18, no_payload, true);
-					        break;
-					    case 0xc2:
-					        sendTcpMsg(data, 0x12, no_payload, true);
-					        break;
-					    default:
-					        break;
-                        }
-					}
-                }
-            }
+            overflows = etherGetRxOverflowCount();
+            flashRedLed();
+        }
+        packet = etherGetRxPacket();
+        if (packet != 0)
+        {
+            processPacket(packet);
+            etherReleaseRxPacket();
         }
+        serviceTimers();
     }
 }
+#endif
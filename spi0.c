@@ -22,9 +22,13 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "spi0.h"
+#ifdef ENC28J60_MODEL
+#include "enc28j60_model.h"
+#else
 #include "tm4c123gh6pm.h"
 #include "gpio.h"
-#include "spi0.h"
+#endif
 
 // Pins
 #define SSI0TX PORTA,5
@@ -32,14 +36,49 @@
 #define SSI0FSS PORTA,3
 #define SSI0CLK PORTA,2
 
+// SSI0 has 8-entry TX and RX FIFOs
+#define SSI0_FIFO_DEPTH 8
+
+// uDMA channels (encoding 0) and largest transfer per control structure
+#define SSI0_RX_DMA_CH 10
+#define SSI0_TX_DMA_CH 11
+#define DMA_ALT 32
+#define DMA_MAX_XFER 1024
+
+//-----------------------------------------------------------------------------
+// Structures
+//-----------------------------------------------------------------------------
+
+// uDMA channel control structure
+typedef struct _dmaControl
+{
+    volatile uint8_t* srcEnd;
+    volatile uint8_t* dstEnd;
+    uint32_t control;
+    uint32_t unused;
+} dmaControl;
+
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
+#ifdef ENC28J60_MODEL
+uint8_t spi0ModelRxData = 0;
+#else
+// Primary structures for channels 0-31 followed by the alternates
+// The table must be aligned on a 1024-byte boundary
+#pragma DATA_ALIGN(spi0DmaTable, 1024)
+dmaControl spi0DmaTable[64];
+uint8_t spi0DmaZero = 0;                 // tx source while reading a block
+uint8_t spi0DmaSink;                     // rx destination while writing a block
+#endif
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
+#ifndef ENC28J60_MODEL
+
 // Initialize SPI0
 void initSpi0(uint32_t pinMask)
 {
@@ -103,3 +142,181 @@ uint32_t readSpi0Data()
 {
     return SSI0_DR_R;
 }
+
+// Blocking function that writes a block of data back-to-back
+// Keeps the tx fifo full and discards the rx data as it arrives
+// At most SSI0_FIFO_DEPTH bytes are in flight so the rx fifo cannot overrun
+void writeSpi0Block(const uint8_t data[], uint16_t size)
+{
+    uint16_t tx = 0, rx = 0;
+    while (rx < size)
+    {
+        if (tx < size && (uint16_t)(tx - rx) < SSI0_FIFO_DEPTH && (SSI0_SR_R & SSI_SR_TNF))
+            SSI0_DR_R = data[tx++];
+        if (SSI0_SR_R & SSI_SR_RNE)
+        {
+            SSI0_DR_R;
+            rx++;
+        }
+    }
+}
+
+// Blocking function that reads a block of data back-to-back
+// Clocks out zeros while draining the rx fifo concurrently
+void readSpi0Block(uint8_t data[], uint16_t size)
+{
+    uint16_t tx = 0, rx = 0;
+    while (rx < size)
+    {
+        if (tx < size && (uint16_t)(tx - rx) < SSI0_FIFO_DEPTH && (SSI0_SR_R & SSI_SR_TNF))
+        {
+            SSI0_DR_R = 0;
+            tx++;
+        }
+        if (SSI0_SR_R & SSI_SR_RNE)
+            data[rx++] = SSI0_DR_R;
+    }
+}
+
+// Initialize uDMA for SSI0 rx (ch 10) and tx (ch 11)
+void initSpi0Dma()
+{
+    SYSCTL_RCGCDMA_R |= SYSCTL_RCGCDMA_R0;
+    _delay_cycles(3);
+    UDMA_CFG_R = UDMA_CFG_MASTEN;
+    UDMA_CTLBASE_R = (uint32_t)spi0DmaTable;
+    UDMA_CHMAP1_R &= ~(UDMA_CHMAP1_CH10SEL_M | UDMA_CHMAP1_CH11SEL_M);
+    // rx must win arbitration so the rx fifo never overruns
+    UDMA_PRIOSET_R = 1 << SSI0_RX_DMA_CH;
+    UDMA_PRIOCLR_R = 1 << SSI0_TX_DMA_CH;
+    UDMA_USEBURSTCLR_R = (1 << SSI0_RX_DMA_CH) | (1 << SSI0_TX_DMA_CH);
+    UDMA_REQMASKCLR_R = (1 << SSI0_RX_DMA_CH) | (1 << SSI0_TX_DMA_CH);
+}
+
+// Loads the control structures for one channel
+// Transfers over DMA_MAX_XFER use the primary structure for the first 1024
+// bytes in ping-pong mode and the alternate structure for the remainder
+void setSpi0DmaChannel(uint8_t channel, volatile uint8_t* src, bool srcInc,
+                       volatile uint8_t* dst, bool dstInc, uint16_t size)
+{
+    uint16_t first = (size > DMA_MAX_XFER) ? DMA_MAX_XFER : size;
+    uint16_t second = size - first;
+    uint32_t control;
+
+    control = (dstInc ? UDMA_CHCTL_DSTINC_8 : UDMA_CHCTL_DSTINC_NONE)
+            | (srcInc ? UDMA_CHCTL_SRCINC_8 : UDMA_CHCTL_SRCINC_NONE)
+            | UDMA_CHCTL_DSTSIZE_8 | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4;
+    spi0DmaTable[channel].srcEnd = srcInc ? src + first - 1 : src;
+    spi0DmaTable[channel].dstEnd = dstInc ? dst + first - 1 : dst;
+    spi0DmaTable[channel].control = control | ((first - 1) << UDMA_CHCTL_XFERSIZE_S)
+            | (second ? UDMA_CHCTL_XFERMODE_PINGPONG : UDMA_CHCTL_XFERMODE_BASIC);
+    if (second)
+    {
+        spi0DmaTable[channel + DMA_ALT].srcEnd = srcInc ? src + size - 1 : src;
+        spi0DmaTable[channel + DMA_ALT].dstEnd = dstInc ? dst + size - 1 : dst;
+        spi0DmaTable[channel + DMA_ALT].control = control | ((second - 1) << UDMA_CHCTL_XFERSIZE_S)
+                | UDMA_CHCTL_XFERMODE_BASIC;
+    }
+    UDMA_ALTCLR_R = 1 << channel;
+}
+
+void startSpi0Dma()
+{
+    SSI0_DMACTL_R = SSI_DMACTL_RXDMAE | SSI_DMACTL_TXDMAE;
+    UDMA_ENASET_R = 1 << SSI0_RX_DMA_CH;
+    UDMA_ENASET_R = 1 << SSI0_TX_DMA_CH;
+}
+
+// Non-blocking function that starts reading a block of data with uDMA
+// Caller must keep ~CS asserted until isSpi0DmaBusy() returns false
+void startSpi0DmaRead(uint8_t data[], uint16_t size)
+{
+    setSpi0DmaChannel(SSI0_RX_DMA_CH, (volatile uint8_t*)&SSI0_DR_R, false, data, true, size);
+    setSpi0DmaChannel(SSI0_TX_DMA_CH, &spi0DmaZero, false, (volatile uint8_t*)&SSI0_DR_R, false, size);
+    startSpi0Dma();
+}
+
+// Non-blocking function that starts writing a block of data with uDMA
+void startSpi0DmaWrite(const uint8_t data[], uint16_t size)
+{
+    setSpi0DmaChannel(SSI0_RX_DMA_CH, (volatile uint8_t*)&SSI0_DR_R, false, &spi0DmaSink, false, size);
+    setSpi0DmaChannel(SSI0_TX_DMA_CH, (volatile uint8_t*)data, true, (volatile uint8_t*)&SSI0_DR_R, false, size);
+    startSpi0Dma();
+}
+
+// Returns true while a uDMA block transfer is in progress
+// The rx channel finishes last, once every byte has been shifted back in
+bool isSpi0DmaBusy()
+{
+    if (UDMA_ENASET_R & (1 << SSI0_RX_DMA_CH))
+        return true;
+    SSI0_DMACTL_R = 0;
+    return false;
+}
+
+#else
+
+// Host build: SSI0 is replaced by the ENC28J60 model, so configuration is a no-op
+void initSpi0(uint32_t pinMask)
+{
+    enc28j60ModelInit();
+}
+
+void setSpi0BaudRate(uint32_t baudRate, uint32_t fcyc)
+{
+}
+
+void setSpi0Mode(uint8_t polarity, uint8_t phase)
+{
+}
+
+// Clocks a byte through the model and latches the byte shifted back
+// Each call also pays the write/busy-wait/read turnaround of the hardware path
+void writeSpi0Data(uint32_t data)
+{
+    spi0ModelRxData = enc28j60ModelTransfer(data);
+    enc28j60ModelAdvanceNs(ENC28J60_MODEL_SPI_GAP_NS);
+}
+
+// Reads data latched by the last write
+uint32_t readSpi0Data()
+{
+    return spi0ModelRxData;
+}
+
+// Block transfers stream through the fifo with no per-byte turnaround
+void writeSpi0Block(const uint8_t data[], uint16_t size)
+{
+    uint16_t i;
+    for (i = 0; i < size; i++)
+        enc28j60ModelTransfer(data[i]);
+}
+
+void readSpi0Block(uint8_t data[], uint16_t size)
+{
+    uint16_t i;
+    for (i = 0; i < size; i++)
+        data[i] = enc28j60ModelTransfer(0);
+}
+
+// uDMA transfers complete in simulated time while the caller keeps running
+void initSpi0Dma()
+{
+}
+
+void startSpi0DmaRead(uint8_t data[], uint16_t size)
+{
+    enc28j60ModelStartDma(data, 0, size);
+}
+
+void startSpi0DmaWrite(const uint8_t data[], uint16_t size)
+{
+    enc28j60ModelStartDma(0, data, size);
+}
+
+bool isSpi0DmaBusy()
+{
+    return enc28j60ModelIsDmaBusy();
+}
+
+#endif
@@ -35,5 +35,11 @@ void setSpi0BaudRate(uint32_t clockRate, uint32_t fcyc);
 void setSpi0Mode(uint8_t polarity, uint8_t phase);
 void writeSpi0Data(uint32_t data);
 uint32_t readSpi0Data();
+void writeSpi0Block(const uint8_t data[], uint16_t size);
+void readSpi0Block(uint8_t data[], uint16_t size);
+void initSpi0Dma();
+void startSpi0DmaRead(uint8_t data[], uint16_t size);
+void startSpi0DmaWrite(const uint8_t data[], uint16_t size);
+bool isSpi0DmaBusy();
 
 #endif
@@ -30,10 +30,10 @@ char* htoa(uint8_t src, char* dest)//converts a single byte to a hex char
      dest[i] = '\0';
      return dest;
 }
-char* itoa(uint16_t src, char* dest)
+char* itoa(uint32_t src, char* dest)
 {
-     //buffer should be five chars wide since 2^16 - 1 is 65535
-     uint8_t i = src;
+     //buffer should be eleven chars wide since 2^32 - 1 is 4294967295
+     uint32_t i = src;
      uint8_t q;
      uint8_t iterator = 0;
      if (i == 0)
@@ -75,10 +75,11 @@ char* strcpy(const char* src, char* dest)
   dest[i]= '\0';
   return dest;
 }
-uint8_t strlen(const char* str)
+uint16_t strlen(const char* str)
 {
-     uint8_t result = 0;
-     while (str[++result] != '\0');
+     uint16_t result = 0;
+     while (str[result] != '\0')
+          result++;
      return result;
 }
 int strcmp(const char* str1, const char* str2)
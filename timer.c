@@ -0,0 +1,233 @@
+// Timer Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Hardware configuration:
+// SysTick:
+//   Counts the core clock and interrupts every millisecond
+// Protocol timeouts are measured against getTimerMs() and serviced from the
+//   main loop, so nothing busy-waits for them
+// getTimerUs() adds the SysTick count within the current millisecond
+// Timer wheel:
+//   Starting and stopping an event is O(1); serviceTimers() moves an event
+//   down a level at most TIMER_WHEEL_LEVELS - 1 times before it is due, and
+//   skips straight to the present when no event is running
+// In the host model build the clock follows the simulated time of the
+//   ENC28J60 model
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "timer.h"
+#ifdef ENC28J60_MODEL
+#include "enc28j60_model.h"
+#else
+#include "tm4c123gh6pm.h"
+#endif
+
+#define SYSTEM_CLOCK_HZ 40000000
+#define SYSTICK_RELOAD  (SYSTEM_CLOCK_HZ / 1000 - 1)
+
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK  (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN  ((1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+volatile uint32_t timerMs = 0;
+
+timerEvent* timerWheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+uint32_t timerWheelTime = 0;             // next ms the wheel runs
+uint16_t timerCount = 0;                 // events running
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Starts the millisecond tick
+void initTimer()
+{
+#ifndef ENC28J60_MODEL
+    NVIC_ST_CTRL_R = 0;
+    NVIC_ST_RELOAD_R = SYSTICK_RELOAD;
+    NVIC_ST_CURRENT_R = 0;
+    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC | NVIC_ST_CTRL_INTEN | NVIC_ST_CTRL_ENABLE;
+#endif
+    timerMs = 0;
+    timerWheelTime = getTimerMs();
+}
+
+void sysTickIsr()
+{
+    timerMs++;
+}
+
+// Returns milliseconds since initTimer()
+// The count wraps after 49 days, so compare times by subtracting them
+uint32_t getTimerMs()
+{
+#ifdef ENC28J60_MODEL
+    return enc28j60ModelGetTimeNs() / 1000000;
+#else
+    return timerMs;
+#endif
+}
+
+// Returns microseconds since initTimer(), wrapping after 71 minutes
+// Call from thread code, where a pending tick is taken at once
+uint32_t getTimerUs()
+{
+#ifdef ENC28J60_MODEL
+    return enc28j60ModelGetTimeNs() / 1000;
+#else
+    uint32_t ms, count;
+    do
+    {
+        ms = timerMs;
+        count = NVIC_ST_CURRENT_R;
+    }
+    while (ms != timerMs);
+    return ms * 1000 + (SYSTICK_RELOAD - count) / (SYSTEM_CLOCK_HZ / 1000000);
+#endif
+}
+
+// Files an event in the slot for its expiry: level 0 holds the next 2^bits
+// ms by the ms, and each level above holds 2^bits times the span below by
+// slots of that span
+// An event that is already due goes in the slot run next
+void timerInsert(timerEvent* event)
+{
+    uint32_t expires = event->expires;
+    uint32_t delta = expires - timerWheelTime;
+    timerEvent** slot;
+    uint8_t level = 0;
+    if ((int32_t)delta < 0)
+    {
+        delta = 0;
+        expires = timerWheelTime;
+    }
+    else if (delta > TIMER_WHEEL_SPAN)
+    {
+        delta = TIMER_WHEEL_SPAN;
+        expires = timerWheelTime + TIMER_WHEEL_SPAN;
+    }
+    while (level < TIMER_WHEEL_LEVELS - 1 && (delta >> (TIMER_WHEEL_BITS * (level + 1))) != 0)
+        level++;
+    slot = &timerWheel[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    event->next = *slot;
+    if (event->next != 0)
+        event->next->prev = &event->next;
+    event->prev = slot;
+    *slot = event;
+}
+
+// Unlinks an event from its slot, or from the list being run
+void timerRemove(timerEvent* event)
+{
+    *event->prev = event->next;
+    if (event->next != 0)
+        event->next->prev = event->prev;
+    event->prev = 0;
+}
+
+// Refiles the events of a slot of a higher level, which now fall within
+// the levels below
+void timerCascade(uint8_t level, uint32_t index)
+{
+    timerEvent* event = timerWheel[level][index];
+    timerEvent* next;
+    timerWheel[level][index] = 0;
+    while (event != 0)
+    {
+        next = event->next;
+        timerInsert(event);
+        event = next;
+    }
+}
+
+// Calls back after ms, and then every period ms unless period is 0
+// Starting a running event restarts it
+void startTimer(timerEvent* event, uint32_t ms, uint32_t period, timerCallback callback)
+{
+    if (event->prev != 0)
+        stopTimer(event);
+    event->expires = getTimerMs() + ms;
+    event->period = period;
+    event->callback = callback;
+    if (timerCount++ == 0)
+        timerWheelTime = getTimerMs();
+    timerInsert(event);
+}
+
+// Stops an event, if it is running, without calling back
+void stopTimer(timerEvent* event)
+{
+    if (event->prev != 0)
+    {
+        timerRemove(event);
+        timerCount--;
+    }
+}
+
+bool isTimerRunning(timerEvent* event)
+{
+    return event->prev != 0;
+}
+
+// Runs the wheel up to the present, calling back the events that are due
+// A repeating event is restarted before its callback, from its due time
+// unless it has fallen a whole period behind
+// Call from the main loop
+void serviceTimers()
+{
+    uint32_t now = getTimerMs();
+    timerEvent* due;
+    timerEvent* event;
+    uint32_t index;
+    uint8_t level;
+    while (timerCount != 0 && (int32_t)(now - timerWheelTime) >= 0)
+    {
+        index = timerWheelTime & TIMER_WHEEL_MASK;
+        for (level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++)
+        {
+            index = (timerWheelTime >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+            timerCascade(level, index);
+        }
+        // the slot is taken off the wheel first, so an event started from a
+        // callback is never run in the same pass
+        index = timerWheelTime & TIMER_WHEEL_MASK;
+        due = timerWheel[0][index];
+        timerWheel[0][index] = 0;
+        if (due != 0)
+            due->prev = &due;
+        timerWheelTime++;
+        while (due != 0)
+        {
+            event = due;
+            timerRemove(event);
+            if (event->period != 0)
+            {
+                event->expires += event->period;
+                if ((int32_t)(now - event->expires) >= 0)
+                    event->expires = now + event->period;
+                timerInsert(event);
+            }
+            else
+                timerCount--;
+            event->callback();
+        }
+    }
+    if (timerCount == 0)
+        timerWheelTime = now + 1;
+}
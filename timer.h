@@ -0,0 +1,71 @@
+// Timer Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    40 MHz
+
+// Hardware configuration:
+// SysTick:
+//   Counts the core clock and interrupts every millisecond
+// Timer wheel:
+//   Events started with startTimer() call back from serviceTimers() in the
+//   main loop, never from the interrupt
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timer wheel of TIMER_WHEEL_LEVELS levels of 2^TIMER_WHEEL_BITS slots, each
+// level counting in units of the whole level below (1 ms at level 0)
+// An event further out than the wheel spans (2^20 ms, 17 minutes, by
+// default) waits in the top level and is filed again when its slot comes up
+// TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS must be less than 32
+#ifndef TIMER_WHEEL_BITS
+#define TIMER_WHEEL_BITS     5
+#endif
+#ifndef TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_LEVELS   4
+#endif
+
+//-----------------------------------------------------------------------------
+// Structures
+//-----------------------------------------------------------------------------
+
+typedef void (*timerCallback)();
+
+// A timed callback; the caller owns the storage, which starts zeroed and
+// must stay valid while the event is running
+typedef struct _timerEvent
+{
+    struct _timerEvent* next;            // next event in the same slot
+    struct _timerEvent** prev;           // link pointing at this event, 0 when stopped
+    uint32_t expires;                    // ms time it is due
+    uint32_t period;                     // ms between repeats, 0 for one shot
+    timerCallback callback;
+} timerEvent;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initTimer();
+void sysTickIsr();
+uint32_t getTimerMs();
+uint32_t getTimerUs();
+
+void startTimer(timerEvent* event, uint32_t ms, uint32_t period, timerCallback callback);
+void stopTimer(timerEvent* event);
+bool isTimerRunning(timerEvent* event);
+void serviceTimers();
+
+#endif
@@ -13,6 +13,12 @@
 // UART Interface:
 //   U0TX (PA1) and U0RX (PA0) are connected to the 2nd controller
 //   The USB on the 2nd controller enumerates to an ICDI interface and a virtual COM port
+// UART0 interrupt:
+//   Refills the tx FIFO from the tx ring each time it drains to half full,
+//   and empties the rx FIFO into the rx ring when it is half full or a
+//   character has waited 32 bit times
+// putcUart0() and putsUart0() only copy into the tx ring, so logging never
+//   waits on the 115200 baud line
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -27,10 +33,23 @@
 #define UART_TX_MASK 2
 #define UART_RX_MASK 1
 
+#define UART0_TX_MASK (UART0_TX_BUFFER - 1)
+#define UART0_RX_MASK (UART0_RX_BUFFER - 1)
+
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
+char uart0TxBuffer[UART0_TX_BUFFER];
+volatile uint16_t uart0TxHead = 0;       // written by putcUart0()
+volatile uint16_t uart0TxTail = 0;       // written by uart0FillTxFifo()
+uint32_t uart0TxDropCount = 0;
+
+char uart0RxBuffer[UART0_RX_BUFFER];
+volatile uint16_t uart0RxHead = 0;       // written by the isr
+volatile uint16_t uart0RxTail = 0;       // written by getcUart0()
+volatile uint32_t uart0RxDropCount = 0;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -67,6 +86,10 @@ void initUart0()
     UART0_LCRH_R = UART_LCRH_WLEN_8 | UART_LCRH_FEN;    // configure for 8N1 w/ 16-level FIFO
     UART0_CTL_R = UART_CTL_TXE | UART_CTL_RXE | UART_CTL_UARTEN;
                                                         // enable TX, RX, and module
+
+    // Interrupt at the default half-full FIFO levels, and on rx timeout
+    UART0_IM_R = UART_IM_TXIM | UART_IM_RXIM | UART_IM_RTIM;
+    NVIC_EN0_R = 1 << (INT_UART0 - 16);
 }
 
 // Set baud rate as function of instruction cycle frequency
@@ -78,30 +101,103 @@ void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc)
     UART0_FBRD_R = ((divisorTimes128 + 1)) >> 1 & 63;    // set fractional value to round(fract(r)*64)
 }
 
-// Blocking function that writes a serial character when the UART buffer is not full
+// Moves queued characters into the tx FIFO until it is full
+// Called from the isr only on a tx interrupt, or from putcUart0() with the
+// tx interrupt masked, so the two never run at once
+void uart0FillTxFifo()
+{
+    uint16_t tail = uart0TxTail;
+    while (tail != uart0TxHead && !(UART0_FR_R & UART_FR_TXFF))
+    {
+        UART0_DR_R = uart0TxBuffer[tail];
+        tail = (tail + 1) & UART0_TX_MASK;
+    }
+    uart0TxTail = tail;
+}
+
+// Handles the UART0 interrupt
+void uart0Isr()
+{
+    uint32_t status = UART0_MIS_R;
+    uint16_t head;
+    char c;
+    UART0_ICR_R = status & (UART_ICR_TXIC | UART_ICR_RXIC | UART_ICR_RTIC);
+    // an rx interrupt may arrive while putcUart0() is filling the FIFO
+    if (status & UART_MIS_TXMIS)
+        uart0FillTxFifo();
+    while (!(UART0_FR_R & UART_FR_RXFE))
+    {
+        c = UART0_DR_R & 0xFF;
+        head = (uart0RxHead + 1) & UART0_RX_MASK;
+        if (head == uart0RxTail)
+            uart0RxDropCount++;
+        else
+        {
+            uart0RxBuffer[uart0RxHead] = c;
+            uart0RxHead = head;
+        }
+    }
+}
+
+// Non-blocking function that queues a serial character, or drops and counts
+// it if the tx ring is full
+// The FIFO is topped up here as well, since the interrupt only comes as the
+// FIFO drains past half full
 void putcUart0(char c)
 {
-    while (UART0_FR_R & UART_FR_TXFF);               // wait if uart0 tx fifo full
-    UART0_DR_R = c;                                  // write character to fifo
+    uint16_t head = (uart0TxHead + 1) & UART0_TX_MASK;
+    if (head == uart0TxTail)
+    {
+        uart0TxDropCount++;
+        return;
+    }
+    uart0TxBuffer[uart0TxHead] = c;
+    uart0TxHead = head;
+    UART0_IM_R &= ~UART_IM_TXIM;
+    uart0FillTxFifo();
+    UART0_IM_R |= UART_IM_TXIM;
 }
 
-// Blocking function that writes a string when the UART buffer is not full
+// Non-blocking function that queues a string
 void putsUart0(char* str)
 {
-    uint8_t i = 0;
+    uint16_t i = 0;
     while (str[i] != '\0')
         putcUart0(str[i++]);
 }
 
+// Blocking function that returns once all queued characters are on the line
+// For use before a reset, which would lose them
+void flushUart0()
+{
+    while (uart0TxTail != uart0TxHead);
+    while (UART0_FR_R & UART_FR_BUSY);
+}
+
 // Blocking function that returns with serial data once the buffer is not empty
 char getcUart0()
 {
-    while (UART0_FR_R & UART_FR_RXFE);               // wait if uart0 rx fifo empty
-    return UART0_DR_R & 0xFF;                        // get character from fifo
+    char c;
+    while (uart0RxTail == uart0RxHead);
+    c = uart0RxBuffer[uart0RxTail];
+    uart0RxTail = (uart0RxTail + 1) & UART0_RX_MASK;
+    return c;
 }
 
 // Returns the status of the receive buffer
 bool kbhitUart0()
 {
-    return !(UART0_FR_R & UART_FR_RXFE);
+    return uart0RxTail != uart0RxHead;
+}
+
+// Returns the number of characters dropped because the tx ring was full
+uint32_t getUart0TxDropCount()
+{
+    return uart0TxDropCount;
+}
+
+// Returns the number of characters lost because the rx ring was full
+uint32_t getUart0RxDropCount()
+{
+    return uart0RxDropCount;
 }
@@ -13,6 +13,8 @@
 // UART Interface:
 //   U0TX (PA1) and U0RX (PA0) are connected to the 2nd controller
 //   The USB on the 2nd controller enumerates to an ICDI interface and a virtual COM port
+// UART0 interrupt:
+//   Moves characters between the FIFOs and the ring buffers below
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -21,6 +23,15 @@
 #ifndef UART0_H_
 #define UART0_H_
 
+// Ring buffer sizes; both must be powers of 2
+// Output that does not fit in the tx ring is dropped and counted
+#ifndef UART0_TX_BUFFER
+#define UART0_TX_BUFFER 512
+#endif
+#ifndef UART0_RX_BUFFER
+#define UART0_RX_BUFFER 64
+#endif
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -29,7 +40,11 @@ void initUart0();
 void setUart0BaudRate(uint32_t baudRate, uint32_t fcyc);
 void putcUart0(char c);
 void putsUart0(char* str);
+void flushUart0();
 char getcUart0();
 bool kbhitUart0();
+uint32_t getUart0TxDropCount();
+uint32_t getUart0RxDropCount();
+void uart0Isr();
 
 #endif